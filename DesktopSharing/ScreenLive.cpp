@@ -8,7 +8,7 @@
 #include <versionhelpers.h>
 
 ScreenLive::ScreenLive()
-	: event_loop_(new xop::EventLoop)
+	: event_loop_(new xop::EventLoop(std::thread::hardware_concurrency() + 1))
 {
 	encoding_fps_ = 0;
 	rtsp_clients_.clear();
@@ -43,6 +43,7 @@ std::string ScreenLive::GetStatusInfo()
 	if (is_encoder_started_) {
 		info += "Encoder: " + av_config_.codec + " \n\n";
 		info += "Encoding framerate: " + std::to_string(encoding_fps_) + " \n\n";
+		info += video_pipeline_.GetStatusInfo() + " \n";
 	}
 
 	if (rtsp_server_ != nullptr) {
@@ -138,6 +139,12 @@ bool ScreenLive::StartLive(int type, LiveConfig& config)
 			this->rtsp_clients_.erase(peer_ip + ":" + std::to_string(peer_port));
 			printf("RTSP client: %u\n", this->rtsp_clients_.size());
 		});
+		session->SetKeyFrameRequestCallback([this](xop::MediaSessionId sessionId, xop::MediaChannelId channel_id) {
+			if (channel_id == xop::channel_0) {
+				h264_encoder_.RequestKeyFrame();
+			}
+		});
+		session->SetGopCache(config.gop_cache_bytes);
 
 
 		session_id = rtsp_server->AddSession(session);
@@ -146,6 +153,7 @@ bool ScreenLive::StartLive(int type, LiveConfig& config)
 
 		std::lock_guard<std::mutex> locker(mutex_);
 		rtsp_server_ = rtsp_server;
+		rtsp_gop_cache_ = (config.gop_cache_bytes > 0);
 		media_session_id_ = session_id;
 	}
 	else if (type == SCREEN_LIVE_RTSP_PUSHER) {
@@ -385,7 +393,13 @@ int ScreenLive::StartEncoder(AVConfig& config)
 	}
 
 	is_encoder_started_ = true;
-	encode_video_thread_.reset(new std::thread(&ScreenLive::EncodeVideo, this));
+
+	video_pipeline_.SetStageCallback(VideoPipeline::STAGE_CAPTURE, [this](VideoFrame& frame) { return CaptureVideo(frame); });
+	video_pipeline_.SetStageCallback(VideoPipeline::STAGE_CONVERT, [this](VideoFrame& frame) { return ConvertVideo(frame); });
+	video_pipeline_.SetStageCallback(VideoPipeline::STAGE_ENCODE, [this](VideoFrame& frame) { return EncodeVideo(frame); });
+	video_pipeline_.SetStageCallback(VideoPipeline::STAGE_PACKETIZE, [this](VideoFrame& frame) { return PacketizeVideo(frame); });
+	video_pipeline_.Start(av_config_.framerate);
+
 	encode_audio_thread_.reset(new std::thread(&ScreenLive::EncodeAudio, this));
 	return 0;
 }
@@ -395,10 +409,8 @@ int ScreenLive::StopEncoder()
 	if (is_encoder_started_) {
 		is_encoder_started_ = false;
 
-		if (encode_video_thread_) {
-			encode_video_thread_->join();
-			encode_video_thread_ = nullptr;
-		}
+		video_pipeline_.Stop();
+		encoding_fps_ = 0;
 
 		if (encode_audio_thread_) {
 			encode_audio_thread_->join();
@@ -425,49 +437,64 @@ bool ScreenLive::IsKeyFrame(const uint8_t* data, uint32_t size)
 	return false;
 }
 
-void ScreenLive::EncodeVideo()
+bool ScreenLive::CaptureVideo(VideoFrame& frame)
 {
-	static xop::Timestamp encoding_ts, update_ts;	
-	uint32_t encoding_fps = 0;
-	uint32_t msec = 1000 / av_config_.framerate;
+	if (!is_capture_started_) {
+		return false;
+	}
 
+	frame.timestamp = xop::H264Source::GetTimestamp();
+	return screen_capture_->CaptureFrame(frame.image, frame.width, frame.height);
+}
 
-	while (is_encoder_started_ && is_capture_started_) {
-		if (update_ts.Elapsed() >= 1000) {
-			update_ts.Reset();
-			encoding_fps_ = encoding_fps;
-			encoding_fps = 0;
-		}
+bool ScreenLive::ConvertVideo(VideoFrame& frame)
+{
+	/* hardware codecs take BGRA and convert on the GPU */
+	if (!h264_encoder_.IsSoftwareCodec()) {
+		return true;
+	}
 
-		uint32_t delay = msec;
-		uint32_t elapsed = (uint32_t)encoding_ts.Elapsed();
-		if (elapsed > delay) {
-			delay = 0;
-		}
-		else {
-			delay -= elapsed;
-		}
+	return h264_encoder_.Convert(&frame.image[0], frame.width, frame.height, frame.yuv_frame);
+}
 
-		std::this_thread::sleep_for(std::chrono::milliseconds(delay));
-		encoding_ts.Reset();
+bool ScreenLive::EncodeVideo(VideoFrame& frame)
+{
+	/* the last packet may still be referenced by the senders, the slot's buffer
+	   is only written again once they have all let go of it */
+	uint32_t max_frame_size = h264_encoder_.GetMaxFrameSize();
+	if (frame.packet == nullptr || frame.packet_capacity < max_frame_size || frame.packet.use_count() > 1) {
+		frame.packet.reset(new uint8_t[max_frame_size], std::default_delete<uint8_t[]>());
+		frame.packet_capacity = max_frame_size;
+	}
+	else {
+		/* pairs with the release of the last reference on a sender thread */
+		std::atomic_thread_fence(std::memory_order_acquire);
+	}
 
-		std::vector<uint8_t> bgra_image;
-		uint32_t timestamp = xop::H264Source::GetTimestamp();
-		int frame_size = 0;
-		uint32_t width = 0, height = 0;
+	int frame_size = 0;
+	if (h264_encoder_.IsSoftwareCodec()) {
+		frame_size = h264_encoder_.Encode(frame.yuv_frame, frame.packet.get(), frame.packet_capacity);
+	}
+	else {
+		frame_size = h264_encoder_.Encode(&frame.image[0], frame.width, frame.height, (uint32_t)frame.image.size(),
+										  frame.packet.get(), frame.packet_capacity);
+	}
 
-		if (screen_capture_->CaptureFrame(bgra_image, width, height)) {
-			std::vector<uint8_t> out_frame;
-			if (h264_encoder_.Encode(&bgra_image[0], width, height, bgra_image.size(), out_frame) > 0) {
-				if (out_frame.size() > 0) {
-					encoding_fps += 1;
-					PushVideo(&out_frame[0], out_frame.size(), timestamp);
-				}
-			}
-		}
+	frame.packet_size = (frame_size > 0) ? frame_size : 0;
+	return (frame.packet_size > 0);
+}
+
+bool ScreenLive::PacketizeVideo(VideoFrame& frame)
+{
+	if (encoding_fps_ts_.Elapsed() >= 1000) {
+		encoding_fps_ts_.Reset();
+		encoding_fps_ = encoding_frames_;
+		encoding_frames_ = 0;
 	}
 
-	encoding_fps_ = 0;
+	encoding_frames_ += 1;
+	PushVideo(frame.packet, frame.packet_size, frame.timestamp);
+	return true;
 }
 
 void ScreenLive::EncodeAudio()
@@ -496,19 +523,22 @@ void ScreenLive::EncodeAudio()
 	}
 }
 
-void ScreenLive::PushVideo(const uint8_t* data, uint32_t size, uint32_t timestamp)
+void ScreenLive::PushVideo(std::shared_ptr<uint8_t> data, uint32_t size, uint32_t timestamp)
 {
-	xop::AVFrame video_frame(size);
-	video_frame.size = size - 4; /* -4 去掉H.264起始码 */
-	video_frame.type = IsKeyFrame(data, size) ? xop::VIDEO_FRAME_I : xop::VIDEO_FRAME_P;
+	if (size <= 4) {
+		return;
+	}
+
+	/* -4 去掉H.264起始码, the frame shares the encoder's buffer */
+	xop::AVFrame video_frame(std::shared_ptr<uint8_t>(data, data.get() + 4), size - 4);
+	video_frame.type = IsKeyFrame(data.get(), size) ? xop::VIDEO_FRAME_I : xop::VIDEO_FRAME_P;
 	video_frame.timestamp = timestamp;
-	memcpy(video_frame.buffer.get(), data + 4, size - 4);
 
 	if (size > 0) {
 		std::lock_guard<std::mutex> locker(mutex_);
 
 		/* RTSP服务器 */
-		if (rtsp_server_ != nullptr && this->rtsp_clients_.size() > 0) {
+		if (rtsp_server_ != nullptr && (this->rtsp_clients_.size() > 0 || rtsp_gop_cache_)) {
 			rtsp_server_->PushFrame(media_session_id_, xop::channel_0, video_frame);
 		}
 
@@ -536,7 +566,7 @@ void ScreenLive::PushAudio(const uint8_t* data, uint32_t size, uint32_t timestam
 		std::lock_guard<std::mutex> locker(mutex_);
 
 		/* RTSP服务器 */
-		if (rtsp_server_ != nullptr && this->rtsp_clients_.size() > 0) {
+		if (rtsp_server_ != nullptr && (this->rtsp_clients_.size() > 0 || rtsp_gop_cache_)) {
 			rtsp_server_->PushFrame(media_session_id_, xop::channel_1, audio_frame);
 		}
 
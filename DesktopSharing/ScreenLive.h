@@ -8,6 +8,8 @@
 #include "H264Encoder.h"
 #include "AudioCapture/AudioCapture.h"
 #include "ScreenCapture/ScreenCapture.h"
+#include "VideoPipeline.h"
+#include "net/Timestamp.h"
 #include <mutex>
 #include <atomic>
 #include <string>
@@ -44,6 +46,7 @@ struct LiveConfig
 	std::string suffix;
 	std::string ip;
 	uint16_t port;
+	uint32_t gop_cache_bytes = 0; /* replay the last GOP to new clients, 0: off */
 };
 
 class ScreenLive
@@ -76,9 +79,14 @@ public:
 private:
 	ScreenLive();
 	
-	void EncodeVideo();
+	/* video pipeline stages */
+	bool CaptureVideo(VideoFrame& frame);
+	bool ConvertVideo(VideoFrame& frame);
+	bool EncodeVideo(VideoFrame& frame);
+	bool PacketizeVideo(VideoFrame& frame);
+
 	void EncodeAudio();
-	void PushVideo(const uint8_t* data, uint32_t size, uint32_t timestamp);
+	void PushVideo(std::shared_ptr<uint8_t> data, uint32_t size, uint32_t timestamp);
 	void PushAudio(const uint8_t* data, uint32_t size, uint32_t timestamp);
 	bool IsKeyFrame(const uint8_t* data, uint32_t size);
 
@@ -96,18 +104,21 @@ private:
     // encoder
 	H264Encoder h264_encoder_;
 	AACEncoder aac_encoder_;
-	std::shared_ptr<std::thread> encode_video_thread_ = nullptr;
+	VideoPipeline video_pipeline_;
 	std::shared_ptr<std::thread> encode_audio_thread_ = nullptr;
 
 	// streamer
 	xop::MediaSessionId media_session_id_ = 0;
 	std::unique_ptr<xop::EventLoop> event_loop_ = nullptr;
 	std::shared_ptr<xop::RtspServer> rtsp_server_ = nullptr;
+	bool rtsp_gop_cache_ = false; /* frames go to the server even with no client */
 	std::shared_ptr<xop::RtspPusher> rtsp_pusher_ = nullptr;
 	std::shared_ptr<xop::RtmpPublisher> rtmp_pusher_ = nullptr;
 
 	// status info
 	std::atomic_int encoding_fps_;
+	uint32_t encoding_frames_ = 0;
+	xop::Timestamp encoding_fps_ts_;
 	std::set<std::string> rtsp_clients_;
 };
 
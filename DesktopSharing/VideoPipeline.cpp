@@ -0,0 +1,230 @@
+#include "VideoPipeline.h"
+#include <chrono>
+
+static inline int64_t GetTimeNowUs()
+{
+	auto time_point = std::chrono::steady_clock::now();
+	return std::chrono::duration_cast<std::chrono::microseconds>(time_point.time_since_epoch()).count();
+}
+
+LatencyHistogram::LatencyHistogram()
+{
+	Reset();
+}
+
+void LatencyHistogram::Record(int64_t usec)
+{
+	int index = 0;
+	int64_t bound = 64;
+	while (index < kNumBuckets - 1 && usec >= bound) {
+		bound <<= 1;
+		index++;
+	}
+
+	buckets_[index].fetch_add(1, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::Reset()
+{
+	for (int n = 0; n < kNumBuckets; n++) {
+		buckets_[n].store(0, std::memory_order_relaxed);
+	}
+}
+
+uint64_t LatencyHistogram::GetCount() const
+{
+	uint64_t count = 0;
+	for (int n = 0; n < kNumBuckets; n++) {
+		count += buckets_[n].load(std::memory_order_relaxed);
+	}
+	return count;
+}
+
+int64_t LatencyHistogram::GetPercentile(double percentile) const
+{
+	uint64_t count = GetCount();
+	if (count == 0) {
+		return 0;
+	}
+
+	uint64_t target = (uint64_t)(count * percentile / 100.0);
+	uint64_t sum = 0;
+	int64_t bound = 64;
+	for (int n = 0; n < kNumBuckets; n++, bound <<= 1) {
+		sum += buckets_[n].load(std::memory_order_relaxed);
+		if (sum > target) {
+			return bound;
+		}
+	}
+
+	return bound;
+}
+
+VideoPipeline::VideoPipeline(uint32_t num_slots)
+{
+	is_started_ = false;
+	dropped_frames_ = 0;
+
+	for (uint32_t n = 0; n < num_slots; n++) {
+		slots_.emplace_back(new VideoFrame);
+	}
+}
+
+VideoPipeline::~VideoPipeline()
+{
+	Stop();
+}
+
+void VideoPipeline::SetStageCallback(Stage stage, const StageCallback& callback)
+{
+	if (stage < STAGE_MAX && !is_started_) {
+		callbacks_[stage] = callback;
+	}
+}
+
+bool VideoPipeline::Start(uint32_t framerate)
+{
+	if (is_started_ || framerate == 0 || !callbacks_[STAGE_CAPTURE]) {
+		return false;
+	}
+
+	for (int n = 0; n < STAGE_MAX; n++) {
+		queues_[n].frames.clear();
+		histograms_[n].Reset();
+	}
+
+	for (auto& slot : slots_) {
+		queues_[0].frames.push_back(slot.get());
+	}
+
+	dropped_frames_ = 0;
+	is_started_ = true;
+
+	threads_.emplace_back(&VideoPipeline::CaptureThread, this, framerate);
+	for (int n = STAGE_CONVERT; n < STAGE_MAX; n++) {
+		threads_.emplace_back(&VideoPipeline::StageThread, this, (Stage)n);
+	}
+
+	return true;
+}
+
+void VideoPipeline::Stop()
+{
+	if (!is_started_) {
+		return;
+	}
+
+	is_started_ = false;
+	for (int n = 0; n < STAGE_MAX; n++) {
+		std::lock_guard<std::mutex> locker(queues_[n].mutex);
+		queues_[n].cond.notify_all();
+	}
+
+	for (auto& thread : threads_) {
+		thread.join();
+	}
+	threads_.clear();
+}
+
+std::string VideoPipeline::GetStatusInfo() const
+{
+	static const char* stage_names[STAGE_MAX] = { "capture", "convert", "encode", "packetize" };
+
+	std::string info;
+	char buf[128] = { 0 };
+
+	for (int n = 0; n < STAGE_MAX; n++) {
+		snprintf(buf, sizeof(buf), "%s: p50 %.1fms, p99 %.1fms \n",
+			stage_names[n],
+			histograms_[n].GetPercentile(50) / 1000.0,
+			histograms_[n].GetPercentile(99) / 1000.0);
+		info += buf;
+	}
+
+	info += "Dropped frames: " + std::to_string(dropped_frames_) + " \n";
+	return info;
+}
+
+void VideoPipeline::CaptureThread(uint32_t framerate)
+{
+	int64_t interval = 1000000 / framerate;
+	int64_t next_time = GetTimeNowUs();
+
+	while (is_started_) {
+		int64_t now = GetTimeNowUs();
+		if (now < next_time) {
+			std::this_thread::sleep_for(std::chrono::microseconds(next_time - now));
+			continue;
+		}
+
+		next_time += interval;
+		if (next_time < now) {
+			next_time = now + interval; /* fell behind, do not burst to catch up */
+		}
+
+		VideoFrame* frame = PopFrame(0, 0);
+		if (frame == nullptr) {
+			dropped_frames_ += 1; /* every slot is still in flight */
+			continue;
+		}
+
+		int64_t begin = GetTimeNowUs();
+		bool ret = callbacks_[STAGE_CAPTURE](*frame);
+		histograms_[STAGE_CAPTURE].Record(GetTimeNowUs() - begin);
+
+		PushFrame(ret ? STAGE_CONVERT : 0, frame);
+	}
+}
+
+void VideoPipeline::StageThread(Stage stage)
+{
+	while (is_started_) {
+		VideoFrame* frame = PopFrame(stage, 100);
+		if (frame == nullptr) {
+			continue;
+		}
+
+		bool ret = true;
+		if (callbacks_[stage]) {
+			int64_t begin = GetTimeNowUs();
+			ret = callbacks_[stage](*frame);
+			histograms_[stage].Record(GetTimeNowUs() - begin);
+		}
+
+		if (!ret) {
+			dropped_frames_ += 1;
+		}
+
+		PushFrame((ret && stage + 1 < STAGE_MAX) ? stage + 1 : 0, frame);
+	}
+}
+
+VideoFrame* VideoPipeline::PopFrame(int queue_index, int timeout_msec)
+{
+	FrameQueue& queue = queues_[queue_index];
+	std::unique_lock<std::mutex> locker(queue.mutex);
+
+	if (queue.frames.empty() && timeout_msec > 0) {
+		queue.cond.wait_for(locker, std::chrono::milliseconds(timeout_msec), [this, &queue] {
+			return !queue.frames.empty() || !is_started_;
+		});
+	}
+
+	if (queue.frames.empty()) {
+		return nullptr;
+	}
+
+	VideoFrame* frame = queue.frames.front();
+	queue.frames.pop_front();
+	return frame;
+}
+
+void VideoPipeline::PushFrame(int queue_index, VideoFrame* frame)
+{
+	FrameQueue& queue = queues_[queue_index];
+	{
+		std::lock_guard<std::mutex> locker(queue.mutex);
+		queue.frames.push_back(frame);
+	}
+	queue.cond.notify_one();
+}
@@ -0,0 +1,117 @@
+#ifndef VIDEO_PIPELINE_H
+#define VIDEO_PIPELINE_H
+
+#include "codec/avcodec/av_common.h"
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <string>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+
+/* One frame slot, allocated once and recycled through the pipeline stages. */
+struct VideoFrame
+{
+	std::vector<uint8_t> image;       /* BGRA picture from the capture stage */
+	uint32_t width = 0;
+	uint32_t height = 0;
+	uint32_t timestamp = 0;
+
+	ffmpeg::AVFramePtr yuv_frame;     /* colour converted picture, software codec only */
+
+	std::shared_ptr<uint8_t> packet;  /* encoded frame, handed on as is and only reused once released */
+	uint32_t packet_capacity = 0;
+	uint32_t packet_size = 0;
+};
+
+/* Power-of-two latency buckets from 64us to ~1s, safe to read from any thread. */
+class LatencyHistogram
+{
+public:
+	static const int kNumBuckets = 15;
+
+	LatencyHistogram();
+
+	void Record(int64_t usec);
+	void Reset();
+
+	uint64_t GetCount() const;
+
+	/* upper bound of the bucket holding the given percentile, in microseconds */
+	int64_t GetPercentile(double percentile) const;
+
+private:
+	std::atomic<uint64_t> buckets_[kNumBuckets];
+};
+
+/* Bounded capture -> convert -> encode -> packetize pipeline.
+ * Every stage runs on its own thread and hands frame slots to the next one,
+ * so a frame can be encoded while the next one is converted and captured.
+ * A fixed number of slots bounds the latency: when all of them are in flight
+ * the capture stage skips its tick instead of queueing more frames. */
+class VideoPipeline
+{
+public:
+	enum Stage
+	{
+		STAGE_CAPTURE = 0,
+		STAGE_CONVERT,
+		STAGE_ENCODE,
+		STAGE_PACKETIZE,
+		STAGE_MAX,
+	};
+
+	/* return false to drop the frame, its slot goes back to the free list */
+	using StageCallback = std::function<bool(VideoFrame& frame)>;
+
+	VideoPipeline& operator=(const VideoPipeline&) = delete;
+	VideoPipeline(const VideoPipeline&) = delete;
+	VideoPipeline(uint32_t num_slots = 4);
+	virtual ~VideoPipeline();
+
+	void SetStageCallback(Stage stage, const StageCallback& callback);
+
+	bool Start(uint32_t framerate);
+	void Stop();
+
+	bool IsStarted() const
+	{ return is_started_; }
+
+	uint32_t GetDroppedFrames() const
+	{ return dropped_frames_; }
+
+	const LatencyHistogram& GetLatencyHistogram(Stage stage) const
+	{ return histograms_[stage]; }
+
+	std::string GetStatusInfo() const;
+
+private:
+	void CaptureThread(uint32_t framerate);
+	void StageThread(Stage stage);
+
+	VideoFrame* PopFrame(int queue_index, int timeout_msec);
+	void PushFrame(int queue_index, VideoFrame* frame);
+
+	/* queue 0 holds free slots, queue n feeds stage n */
+	struct FrameQueue
+	{
+		std::mutex mutex;
+		std::condition_variable cond;
+		std::deque<VideoFrame*> frames;
+	};
+
+	std::vector<std::unique_ptr<VideoFrame>> slots_;
+	FrameQueue queues_[STAGE_MAX];
+	StageCallback callbacks_[STAGE_MAX];
+	LatencyHistogram histograms_[STAGE_MAX];
+	std::vector<std::thread> threads_;
+
+	std::atomic_bool is_started_;
+	std::atomic<uint32_t> dropped_frames_;
+};
+
+#endif
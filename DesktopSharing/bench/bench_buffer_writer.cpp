@@ -0,0 +1,93 @@
+/* BufferWriter flush cost: frames of RTP-sized packets queued and flushed into a
+ * loopback socket pair, a reader thread drains the other end. Linux only.
+ *
+ * Build and run from DesktopSharing/:
+ *   g++ -O2 -std=c++14 -I. -Inet bench/bench_buffer_writer.cpp net/*.cpp -lpthread -o bench_buffer_writer && ./bench_buffer_writer
+ *
+ * For the one-send()-per-packet baseline build the same file in a worktree of 41ca8de^.
+ */
+
+#include "net/BufferWriter.h"
+#include "net/SocketUtil.h"
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+using namespace xop;
+
+static double ThreadCpuSeconds()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_THREAD, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+int main(int argc, char** argv)
+{
+	int num_frames = argc > 1 ? atoi(argv[1]) : 20000;
+	int packets_per_frame = argc > 2 ? atoi(argv[2]) : 60;
+	const uint32_t packet_size = 1400;
+
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+		perror("socketpair");
+		return 1;
+	}
+	SocketUtil::SetNonBlock(sv[0]);
+
+	std::atomic<uint64_t> received(0);
+	uint64_t expected = (uint64_t)num_frames * packets_per_frame * packet_size;
+	std::thread reader([&] {
+		static char buf[256 * 1024];
+		while (received < expected) {
+			ssize_t n = read(sv[1], buf, sizeof(buf));
+			if (n <= 0) {
+				break;
+			}
+			received += n;
+		}
+	});
+
+	std::shared_ptr<char> payload(new char[packet_size], std::default_delete<char[]>());
+	memset(payload.get(), 0x55, packet_size);
+
+	BufferWriter writer(packets_per_frame * 4);
+	uint64_t send_calls = 0;
+	auto start = std::chrono::steady_clock::now();
+	double cpu_start = ThreadCpuSeconds();
+
+	for (int f = 0; f < num_frames; f++) {
+		for (int n = 0; n < packets_per_frame; n++) {
+			writer.Append(payload, packet_size);
+		}
+
+		while (!writer.IsEmpty()) {
+			send_calls++;
+			if (writer.Send(sv[0]) < 0) {
+				perror("send");
+				return 1;
+			}
+
+			if (!writer.IsEmpty()) {
+				struct pollfd pfd = { sv[0], POLLOUT, 0 };
+				poll(&pfd, 1, 100);
+			}
+		}
+	}
+
+	double cpu = ThreadCpuSeconds() - cpu_start;
+	reader.join();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	printf("%d frames x %d packets x %u bytes: %.0f MB/s, writer cpu %.2f us/frame, %.2f Send() per frame\n",
+		num_frames, packets_per_frame, packet_size, received / seconds / 1e6,
+		cpu * 1e6 / num_frames, (double)send_calls / num_frames);
+	return received == expected ? 0 : 1;
+}
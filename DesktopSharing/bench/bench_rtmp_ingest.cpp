@@ -0,0 +1,174 @@
+/* RTMP ingest parse cost for a 50 Mbit/s publisher: 30 fps video (about 208 KB frames,
+ * a 4x key frame every 60 frames) plus 50 audio frames/s. The stream is chunked with
+ * RtmpChunk::CreateChunk, fed through a socketpair and parsed with RtmpChunk::Parse while
+ * a 2-GOP window of video payloads stays referenced. Only Parse time is counted; the best
+ * of 3 runs is reported with a checksum over payloads and timestamps.
+ *
+ * Build and run from DesktopSharing/:
+ *   g++ -O2 -std=c++14 -I. -Inet bench/bench_rtmp_ingest.cpp xop/RtmpChunk.cpp xop/amf.cpp net/*.cpp -lpthread -o bench_rtmp_ingest
+ *   for c in 128 4096 60000; do ./bench_rtmp_ingest $c; done
+ *
+ * For the per-chunk parser baseline build the same file in a worktree of 72bdf2c^.
+ */
+
+#include "xop/RtmpChunk.h"
+#include "net/BufferReader.h"
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace xop;
+
+static void AppendMessage(RtmpChunk& writer, std::string& stream, uint32_t csid, RtmpMessage& msg)
+{
+	std::vector<char> buf(msg.length * 2 + 1024);
+	int size = writer.CreateChunk(csid, msg, buf.data(), (uint32_t)buf.size());
+	stream.append(buf.data(), size);
+}
+
+static std::string MakeStream(uint32_t chunk_size, int seconds)
+{
+	RtmpChunk writer;
+	writer.SetOutChunkSize(chunk_size);
+
+	std::string stream;
+	uint32_t seed = 1;
+	for (int s = 0; s < seconds; s++) {
+		for (int f = 0; f < 30; f++) {
+			uint32_t timestamp = s * 1000 + f * 33;
+
+			for (int a = 0; a < 2; a++) {
+				RtmpMessage audio;
+				audio.type_id = 8;
+				audio.stream_id = 1;
+				audio._timestamp = timestamp;
+				audio.length = 400;
+				audio.payload.reset(new char[audio.length], std::default_delete<char[]>());
+				memset(audio.payload.get(), a, audio.length);
+				AppendMessage(writer, stream, 4, audio);
+			}
+
+			seed = seed * 1103515245 + 12345;
+			RtmpMessage video;
+			video.type_id = 9;
+			video.stream_id = 1;
+			video._timestamp = timestamp;
+			video.length = (f % 60 == 0 ? 4 : 1) * 180000 + seed % 40000;
+			video.payload.reset(new char[video.length], std::default_delete<char[]>());
+			for (uint32_t i = 0; i < video.length; i++) {
+				video.payload.get()[i] = (char)(i * 31 + f);
+			}
+			AppendMessage(writer, stream, 6, video);
+		}
+	}
+	return stream;
+}
+
+struct Result
+{
+	uint64_t messages = 0;
+	uint64_t bytes = 0;
+	uint64_t checksum = 0;
+	double parse_sec = 0;
+};
+
+static bool RunOnce(const std::string& stream, uint32_t chunk_size, Result& result)
+{
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		return false;
+	}
+
+	int buf_size = 1 << 20;
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &buf_size, sizeof(buf_size));
+	setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
+
+	std::thread writer([&stream, &sv]() {
+		size_t offset = 0;
+		while (offset < stream.size()) {
+			ssize_t n = write(sv[0], stream.data() + offset, std::min<size_t>(65536, stream.size() - offset));
+			if (n > 0) {
+				offset += n;
+			}
+		}
+		close(sv[0]);
+	});
+
+	RtmpChunk parser;
+	parser.SetInChunkSize(chunk_size);
+	BufferReader in;
+	std::deque<std::shared_ptr<char>> gop; /* what a 2-GOP cache keeps referenced */
+	bool ok = true;
+
+	for (;;) {
+		int n = in.Read(sv[1]);
+		if (n <= 0 && in.ReadableBytes() == 0) {
+			break;
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		int ret = 0;
+		do {
+			RtmpMessage msg;
+			ret = parser.Parse(in, msg);
+			if (ret < 0) {
+				ok = false;
+				break;
+			}
+			if (msg.IsCompleted()) {
+				result.messages++;
+				result.bytes += msg.length;
+				result.checksum += (uint8_t)msg.payload.get()[msg.length - 1] + msg._timestamp;
+				if (msg.type_id == 9) {
+					gop.push_back(msg.payload);
+					if (gop.size() > 120) {
+						gop.pop_front();
+					}
+				}
+			}
+		} while (ret > 0 && in.ReadableBytes() > 0);
+		result.parse_sec += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		if (!ok) {
+			break;
+		}
+	}
+
+	writer.join();
+	close(sv[1]);
+	return ok;
+}
+
+int main(int argc, char** argv)
+{
+	uint32_t chunk_size = argc > 1 ? atoi(argv[1]) : 4096;
+	int seconds = argc > 2 ? atoi(argv[2]) : 20;
+
+	std::string stream = MakeStream(chunk_size, seconds);
+
+	Result best;
+	for (int run = 0; run < 3; run++) {
+		Result result;
+		if (!RunOnce(stream, chunk_size, result)) {
+			printf("parse error\n");
+			return 1;
+		}
+		if (run == 0 || result.parse_sec < best.parse_sec) {
+			best = result;
+		}
+	}
+
+	printf("chunk %5u: %llu msgs, %.1f MB parsed in %.3f s -> %.0f MB/s (%.0fx a 50 Mbit/s publisher), checksum %llu\n",
+		chunk_size, (unsigned long long)best.messages, best.bytes / 1e6, best.parse_sec,
+		best.bytes / 1e6 / best.parse_sec, best.bytes * 8 / best.parse_sec / 50e6,
+		(unsigned long long)best.checksum);
+	return 0;
+}
@@ -0,0 +1,108 @@
+/* Start-code scan speed over a 1 MB 4K-sized IDR access unit: 16 slices, random payload
+ * with emulation prevention applied. Times a findNal walk, H264NalIterator and a bytewise
+ * reference scan, and checks that all three find the same number of NAL units.
+ *
+ * Build and run from DesktopSharing/:
+ *   g++ -O2 -std=c++14 -I. bench/bench_start_code.cpp xop/H264Parser.cpp -o bench_start_code && ./bench_start_code
+ *
+ * For the scalar scanner baseline build the same file in a worktree of c799e01^.
+ */
+
+#include "xop/H264Parser.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace xop;
+
+static const uint8_t* ScanBytewise(const uint8_t* p, const uint8_t* end)
+{
+	for (; p + 3 <= end; p++) {
+		if (p[0] == 0 && p[1] == 0 && p[2] == 1) {
+			return p;
+		}
+	}
+	return end;
+}
+
+static std::vector<uint8_t> MakeAccessUnit(size_t size, size_t slices)
+{
+	std::vector<uint8_t> au(size);
+	srand(1);
+	for (auto& c : au) {
+		c = (uint8_t)rand();
+	}
+
+	/* emulation prevention: no 00 00 0x (x <= 3) inside the payload */
+	for (size_t i = 0; i + 2 < au.size(); i++) {
+		if (au[i] == 0 && au[i + 1] == 0 && au[i + 2] <= 3) {
+			au[i + 2] = 3;
+		}
+	}
+
+	for (size_t i = 0; i + 4 < au.size(); i += size / slices) {
+		au[i] = 0; au[i + 1] = 0; au[i + 2] = 0; au[i + 3] = 1; au[i + 4] = 0x65;
+	}
+	return au;
+}
+
+template <typename F>
+static void Run(const char* name, const std::vector<uint8_t>& au, int rounds, F scan)
+{
+	size_t nals = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int r = 0; r < rounds; r++) {
+		nals += scan();
+	}
+	double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	printf("  %-16s %7.2f GB/s  %zu NALs\n", name, au.size() * (double)rounds / sec / 1e9, nals / rounds);
+}
+
+int main(int argc, char** argv)
+{
+	int rounds = argc > 1 ? atoi(argv[1]) : 200;
+	std::vector<uint8_t> au = MakeAccessUnit(1 << 20, 16);
+
+	printf("1 MB access unit, 16 slices, %d rounds\n", rounds);
+
+	Run("findNal walk", au, rounds, [&au]() {
+		size_t count = 0;
+		uint8_t* p = (uint8_t*)au.data();
+		uint32_t size = (uint32_t)au.size();
+		while (size >= 5) {
+			Nal nal = H264Parser::findNal(p, size);
+			if (nal.first == nullptr) {
+				break;
+			}
+			count++;
+			size -= (uint32_t)(nal.second - p);
+			p = nal.second;
+		}
+		return count;
+	});
+
+	Run("H264NalIterator", au, rounds, [&au]() {
+		size_t count = 0;
+		H264NalIterator iter(au.data(), (uint32_t)au.size());
+		const uint8_t* nal = nullptr;
+		uint32_t size = 0;
+		while (iter.Next(nal, size)) {
+			count++;
+		}
+		return count;
+	});
+
+	Run("bytewise", au, rounds, [&au]() {
+		size_t count = 0;
+		const uint8_t* p = au.data();
+		const uint8_t* end = p + au.size();
+		while ((p = ScanBytewise(p, end)) != end) {
+			count++;
+			p += 3;
+		}
+		return count;
+	});
+
+	return 0;
+}
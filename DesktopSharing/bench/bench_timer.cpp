@@ -0,0 +1,98 @@
+/* TimerQueue cost with 100k timers: add, remove every 7th, then run the queue the way
+ * TaskScheduler::Start does and check that nothing fired early or was lost.
+ *
+ * Build and run from DesktopSharing/:
+ *   g++ -O2 -std=c++14 -I. -Inet bench/bench_timer.cpp net/*.cpp -lpthread -o bench_timer && ./bench_timer
+ *
+ * For the std::map TimerQueue baseline build the same file in a worktree of 61d4843^.
+ */
+
+#include "net/Timer.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace xop;
+
+static int64_t NowMs()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double Ms(std::chrono::steady_clock::time_point begin, std::chrono::steady_clock::time_point end)
+{
+	return std::chrono::duration<double, std::milli>(end - begin).count();
+}
+
+int main(int argc, char** argv)
+{
+	int num_timers = argc > 1 ? atoi(argv[1]) : 100000;
+
+	TimerQueue queue;
+	std::mt19937 rng(1);
+	std::vector<int64_t> due(num_timers), fired(num_timers, -1);
+	std::vector<TimerId> ids(num_timers);
+	std::vector<int> count(num_timers, 0);
+
+	/* mostly short timers, every 10th a long one, every 100th repeats three times */
+	auto t0 = std::chrono::steady_clock::now();
+	for (int i = 0; i < num_timers; i++) {
+		uint32_t msec = (i % 10 == 0) ? 5000 + rng() % 3000 : 1 + rng() % 3000;
+		bool repeat = (i % 100 == 1);
+		due[i] = NowMs() + msec;
+		ids[i] = queue.AddTimer([i, repeat, &fired, &count] {
+			if (fired[i] < 0) {
+				fired[i] = NowMs();
+			}
+			count[i]++;
+			return repeat && count[i] < 3;
+		}, msec);
+	}
+
+	auto t1 = std::chrono::steady_clock::now();
+	int num_removed = 0;
+	for (int i = 0; i < num_timers; i += 7) {
+		queue.RemoveTimer(ids[i]);
+		num_removed++;
+	}
+	auto t2 = std::chrono::steady_clock::now();
+
+	double handle_ms = 0;
+	long wakeups = 0;
+	/* the last repeating timer is done within 9 s */
+	int64_t end = NowMs() + 12000;
+	while (NowMs() < end) {
+		auto begin = std::chrono::steady_clock::now();
+		queue.HandleTimerEvent();
+		int64_t remaining = queue.GetTimeRemaining();
+		handle_ms += Ms(begin, std::chrono::steady_clock::now());
+		if (remaining < 0) {
+			break;
+		}
+		wakeups++;
+		std::this_thread::sleep_for(std::chrono::milliseconds(remaining));
+	}
+
+	int early = 0, lost = 0, wrong = 0;
+	for (int i = 0; i < num_timers; i++) {
+		if (i % 7 == 0) {
+			wrong += (fired[i] >= 0);
+			continue;
+		}
+		if (fired[i] < 0) {
+			lost++;
+			continue;
+		}
+		early += (fired[i] < due[i]);
+		wrong += (i % 100 == 1 && count[i] != 3);
+	}
+
+	printf("%d timers: add %.1f ms, remove %d %.2f ms, expire %.1f ms over %ld wakeups\n",
+		num_timers, Ms(t0, t1), num_removed, Ms(t1, t2), handle_ms, wakeups);
+	printf("early %d, lost %d, wrong %d\n", early, lost, wrong);
+	return (early || lost || wrong) ? 1 : 0;
+}
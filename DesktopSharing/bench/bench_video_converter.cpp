@@ -0,0 +1,129 @@
+/* VideoConverter BGRA -> YUV420P at 1920x1080 and 3840x2160, libyuv against swscale.
+ * Both backends convert the same synthetic desktop frame into a reused output picture,
+ * the way H264Encoder calls Convert. Reports ms per frame and the largest Y difference
+ * between the two backends.
+ *
+ * Build and run from DesktopSharing/ against an ffmpeg matching ../libs/ffmpeg/include:
+ *   g++ -O2 -std=c++14 -I. -Icodec/avcodec -I../libs/ffmpeg/include -Ilibyuv/include bench/bench_video_converter.cpp codec/avcodec/video_converter.cpp libyuv/source/*.cc -lswscale -lavformat -lavutil -o bench_video_converter && ./bench_video_converter
+ */
+
+#include "codec/avcodec/video_converter.h"
+extern "C" {
+#include <libavutil/pixdesc.h>
+}
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using namespace ffmpeg;
+
+static AVFramePtr MakeDesktopFrame(int width, int height)
+{
+	AVFramePtr frame(av_frame_alloc(), [](AVFrame* ptr) {
+		av_frame_free(&ptr);
+	});
+
+	frame->width = width;
+	frame->height = height;
+	frame->format = AV_PIX_FMT_BGRA;
+	if (av_frame_get_buffer(frame.get(), 32) != 0) {
+		return nullptr;
+	}
+
+	/* flat window areas, gradients and some noise, roughly what a captured desktop holds */
+	uint32_t seed = 1;
+	for (int y = 0; y < height; y++) {
+		uint8_t* row = frame->data[0] + y * frame->linesize[0];
+		for (int x = 0; x < width; x++) {
+			uint8_t* px = row + x * 4;
+			if ((x / 256 + y / 256) % 3 == 0) {
+				px[0] = 0xf0; px[1] = 0xf0; px[2] = 0xf0;
+			}
+			else if ((x / 256 + y / 256) % 3 == 1) {
+				px[0] = (uint8_t)x; px[1] = (uint8_t)y; px[2] = (uint8_t)(x + y);
+			}
+			else {
+				seed = seed * 1103515245 + 12345;
+				px[0] = (uint8_t)(seed >> 8); px[1] = (uint8_t)(seed >> 16); px[2] = (uint8_t)(seed >> 24);
+			}
+			px[3] = 0xff;
+		}
+	}
+	return frame;
+}
+
+static double Run(AVFramePtr in_frame, VideoConverter::Backend backend, int frames, AVFramePtr& out_frame)
+{
+	int width = in_frame->width;
+	int height = in_frame->height;
+
+	VideoConverter converter;
+	if (!converter.Init(width, height, AV_PIX_FMT_BGRA, width, height, AV_PIX_FMT_YUV420P, backend)) {
+		return -1;
+	}
+
+	/* first call allocates the output picture, keep it out of the timing */
+	if (converter.Convert(in_frame, out_frame) != height) {
+		return -1;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < frames; i++) {
+		if (converter.Convert(in_frame, out_frame) != height) {
+			return -1;
+		}
+	}
+	double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return sec * 1000.0 / frames;
+}
+
+static int MaxDiffY(AVFramePtr a, AVFramePtr b)
+{
+	int diff = 0;
+	for (int y = 0; y < a->height; y++) {
+		const uint8_t* ra = a->data[0] + y * a->linesize[0];
+		const uint8_t* rb = b->data[0] + y * b->linesize[0];
+		for (int x = 0; x < a->width; x++) {
+			diff = std::max(diff, std::abs(ra[x] - rb[x]));
+		}
+	}
+	return diff;
+}
+
+int main(int argc, char** argv)
+{
+	int frames = argc > 1 ? atoi(argv[1]) : 60;
+
+	/* the headers and the linked libraries must agree on the pixel format numbering */
+	const char* bgra = av_get_pix_fmt_name(AV_PIX_FMT_BGRA);
+	const char* yuv = av_get_pix_fmt_name(AV_PIX_FMT_YUV420P);
+	if (!bgra || strcmp(bgra, "bgra") != 0 || !yuv || strcmp(yuv, "yuv420p") != 0) {
+		printf("pixel format mismatch between headers and libavutil\n");
+		return 1;
+	}
+
+	const int sizes[][2] = { { 1920, 1080 }, { 3840, 2160 } };
+	for (auto& size : sizes) {
+		AVFramePtr in_frame = MakeDesktopFrame(size[0], size[1]);
+		if (!in_frame) {
+			printf("av_frame_get_buffer failed\n");
+			return 1;
+		}
+
+		AVFramePtr yuv_libyuv, yuv_swscale;
+		double ms_libyuv = Run(in_frame, VideoConverter::BACKEND_LIBYUV, frames, yuv_libyuv);
+		double ms_swscale = Run(in_frame, VideoConverter::BACKEND_SWSCALE, frames, yuv_swscale);
+		if (ms_libyuv < 0 || ms_swscale < 0) {
+			printf("%dx%d: convert failed\n", size[0], size[1]);
+			return 1;
+		}
+
+		printf("%dx%d, %d frames: libyuv %.2f ms/frame, swscale %.2f ms/frame (%.1fx), max Y diff %d\n",
+			size[0], size[1], frames, ms_libyuv, ms_swscale, ms_swscale / ms_libyuv,
+			MaxDiffY(yuv_libyuv, yuv_swscale));
+	}
+
+	return 0;
+}
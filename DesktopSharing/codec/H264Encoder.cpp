@@ -1,4 +1,11 @@
 #include "H264Encoder.h"
+#include <chrono>
+
+static int64_t GetTimeNowMs()
+{
+	auto time_point = std::chrono::steady_clock::now();
+	return std::chrono::duration_cast<std::chrono::milliseconds>(time_point.time_since_epoch()).count();
+}
 
 H264Encoder::H264Encoder()
 {
@@ -96,15 +103,29 @@ bool H264Encoder::IsKeyFrame(const uint8_t* data, uint32_t size)
 int H264Encoder::Encode(uint8_t* in_buffer, uint32_t in_width, uint32_t in_height,
 						uint32_t image_size, std::vector<uint8_t>& out_frame)
 {
-	out_frame.clear();
+	out_frame.resize(GetMaxFrameSize());
+
+	int frame_size = Encode(in_buffer, in_width, in_height, image_size, out_frame.data(), (uint32_t)out_frame.size());
+	if (frame_size > 0) {
+		out_frame.resize(frame_size);
+	}
+	else {
+		out_frame.clear();
+	}
+
+	return frame_size;
+}
 
+int H264Encoder::Encode(uint8_t* in_buffer, uint32_t in_width, uint32_t in_height,
+						uint32_t image_size, uint8_t* out_buffer, uint32_t out_buffer_size)
+{
 	if (!h264_encoder_.GetAVCodecContext()) {
 		return -1;
 	}
 
+	CheckKeyFrameRequest();
+
 	int frame_size = 0;
-	int max_buffer_size = encoder_config_.video.width * encoder_config_.video.height * 4;
-	std::shared_ptr<uint8_t> out_buffer(new uint8_t[max_buffer_size], std::default_delete<uint8_t[]>());
 
 	if (nvenc_data_ != nullptr) {
 		ID3D11Device* device = nvenc_info.get_device(nvenc_data_);
@@ -118,38 +139,74 @@ int H264Encoder::Encode(uint8_t* in_buffer, uint32_t in_width, uint32_t in_heigh
 		}
 		context->Unmap(texture, D3D11CalcSubresource(0, 0, 1));
 
-		frame_size = nvenc_info.encode_texture(nvenc_data_, texture, out_buffer.get(),
-			encoder_config_.video.width * encoder_config_.video.height * 4);
+		frame_size = nvenc_info.encode_texture(nvenc_data_, texture, out_buffer, out_buffer_size);
 	}
 	else if (qsv_encoder_.IsInitialized()) {
-		frame_size = qsv_encoder_.Encode(in_buffer, in_width, in_height, out_buffer.get(), max_buffer_size);
+		frame_size = qsv_encoder_.Encode(in_buffer, in_width, in_height, out_buffer, out_buffer_size);
 	}
 	else {
 		ffmpeg::AVPacketPtr pkt_ptr = h264_encoder_.Encode(in_buffer, in_width, in_height, image_size);
-		int extra_data_size = 0;
-		uint8_t* extra_data = nullptr;
+		frame_size = WritePacket(pkt_ptr, out_buffer, out_buffer_size);
+	}
 
-		if (pkt_ptr != nullptr) {		
-			if (IsKeyFrame(pkt_ptr->data, pkt_ptr->size)) {
-				/* ʹAV_CODEC_FLAG_GLOBAL_HEADER, Ҫsps, pps */
-				extra_data = h264_encoder_.GetAVCodecContext()->extradata;
-				extra_data_size = h264_encoder_.GetAVCodecContext()->extradata_size;
-				memcpy(out_buffer.get(), extra_data, extra_data_size);
-				frame_size += extra_data_size;
-			}
+	UpdateKeyFrameTime(out_buffer, frame_size);
+	return (frame_size > 0) ? frame_size : 0;
+}
+
+bool H264Encoder::IsSoftwareCodec() const
+{
+	return (nvenc_data_ == nullptr && !qsv_encoder_.IsInitialized());
+}
+
+bool H264Encoder::Convert(const uint8_t* in_buffer, uint32_t in_width, uint32_t in_height, ffmpeg::AVFramePtr& yuv_frame)
+{
+	if (!IsSoftwareCodec()) {
+		return false;
+	}
+
+	return h264_encoder_.Convert(in_buffer, in_width, in_height, yuv_frame);
+}
+
+int H264Encoder::Encode(ffmpeg::AVFramePtr yuv_frame, uint8_t* out_buffer, uint32_t out_buffer_size)
+{
+	if (!h264_encoder_.GetAVCodecContext() || !IsSoftwareCodec()) {
+		return -1;
+	}
 
-			memcpy(out_buffer.get() + frame_size, pkt_ptr->data, pkt_ptr->size);
-			frame_size += pkt_ptr->size;
+	CheckKeyFrameRequest();
+
+	ffmpeg::AVPacketPtr pkt_ptr = h264_encoder_.Encode(yuv_frame);
+	int frame_size = WritePacket(pkt_ptr, out_buffer, out_buffer_size);
+	UpdateKeyFrameTime(out_buffer, frame_size);
+	return (frame_size > 0) ? frame_size : 0;
+}
+
+int H264Encoder::WritePacket(ffmpeg::AVPacketPtr pkt_ptr, uint8_t* out_buffer, uint32_t out_buffer_size)
+{
+	if (pkt_ptr == nullptr) {
+		return 0;
+	}
+
+	uint32_t frame_size = 0;
+
+	if (IsKeyFrame(pkt_ptr->data, pkt_ptr->size)) {
+				/* ʹAV_CODEC_FLAG_GLOBAL_HEADER, Ҫsps, pps */
+		uint8_t* extra_data = h264_encoder_.GetAVCodecContext()->extradata;
+		uint32_t extra_data_size = h264_encoder_.GetAVCodecContext()->extradata_size;
+		if (extra_data_size > out_buffer_size) {
+			return -1;
 		}
+		memcpy(out_buffer, extra_data, extra_data_size);
+		frame_size += extra_data_size;
 	}
 
-	if (frame_size > 0) {
-		out_frame.resize(frame_size);
-		out_frame.assign(out_buffer.get(), out_buffer.get() + frame_size);
-		return frame_size;
+	if (frame_size + pkt_ptr->size > out_buffer_size) {
+		return -1;
 	}
 
-	return 0;
+	memcpy(out_buffer + frame_size, pkt_ptr->data, pkt_ptr->size);
+	frame_size += pkt_ptr->size;
+	return (int)frame_size;
 }
 
 int H264Encoder::GetSequenceParams(uint8_t* out_buffer, int out_buffer_size)
@@ -174,3 +231,38 @@ int H264Encoder::GetSequenceParams(uint8_t* out_buffer, int out_buffer_size)
 
 	return size;
 }
+
+void H264Encoder::ForceIDR()
+{
+	if (nvenc_data_ != nullptr) {
+		nvenc_info.request_idr(nvenc_data_);
+	}
+	else if (qsv_encoder_.IsInitialized()) {
+		qsv_encoder_.ForceIDR();
+	}
+	else {
+		h264_encoder_.ForceIDR();
+	}
+}
+
+void H264Encoder::RequestKeyFrame()
+{
+	key_frame_requested_ = true;
+}
+
+void H264Encoder::CheckKeyFrameRequest()
+{
+	/* on the encoding thread, so the backends see ForceIDR from the thread that encodes */
+	if (key_frame_requested_ && GetTimeNowMs() - last_key_frame_time_ >= key_frame_request_interval_) {
+		key_frame_requested_ = false;
+		ForceIDR();
+	}
+}
+
+void H264Encoder::UpdateKeyFrameTime(const uint8_t* frame, int frame_size)
+{
+	if (frame_size > 0 && IsKeyFrame(frame, frame_size)) {
+		last_key_frame_time_ = GetTimeNowMs();
+		key_frame_requested_ = false;
+	}
+}
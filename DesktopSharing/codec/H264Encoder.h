@@ -4,6 +4,7 @@
 #include "NvCodec/nvenc.h"
 #include "QsvCodec/QsvEncoder.h"
 #include <string>
+#include <atomic>
 
 class H264Encoder
 {
@@ -21,14 +22,44 @@ public:
 	int Encode(uint8_t* in_buffer, uint32_t in_width, uint32_t in_height,
 			   uint32_t image_size, std::vector<uint8_t>& out_frame);
 
+	/* Encodes into a caller owned buffer, returns the frame size or <= 0 */
+	int Encode(uint8_t* in_buffer, uint32_t in_width, uint32_t in_height,
+			   uint32_t image_size, uint8_t* out_buffer, uint32_t out_buffer_size);
+
+	/* Software codec only: colour conversion and encoding as separate steps */
+	bool IsSoftwareCodec() const;
+	bool Convert(const uint8_t* in_buffer, uint32_t in_width, uint32_t in_height, ffmpeg::AVFramePtr& yuv_frame);
+	int Encode(ffmpeg::AVFramePtr yuv_frame, uint8_t* out_buffer, uint32_t out_buffer_size);
+
+	/* Upper bound of an encoded frame, the output size NVENC and QSV have always been given */
+	uint32_t GetMaxFrameSize() const
+	{ return encoder_config_.video.width * encoder_config_.video.height * 4; }
+
 	int GetSequenceParams(uint8_t* out_buffer, int out_buffer_size);
 
+	void ForceIDR();
+
+	/* Key frame request from a viewer, callable from any thread. Requests are coalesced
+	   into at most one IDR per interval, a key frame encoded meanwhile answers them all. */
+	void RequestKeyFrame();
+
+	void SetKeyFrameRequestInterval(uint32_t msec)
+	{ key_frame_request_interval_ = msec; }
+
 private:
+	void CheckKeyFrameRequest();
+	void UpdateKeyFrameTime(const uint8_t* frame, int frame_size);
+
 	bool IsKeyFrame(const uint8_t* data, uint32_t size);
+	int  WritePacket(ffmpeg::AVPacketPtr pkt_ptr, uint8_t* out_buffer, uint32_t out_buffer_size);
 
 	std::string codec_;
 	ffmpeg::AVConfig encoder_config_;
 	void* nvenc_data_ = nullptr;
 	QsvEncoder qsv_encoder_;
 	ffmpeg::H264Encoder h264_encoder_;
+
+	std::atomic_bool key_frame_requested_{ false };
+	std::atomic<uint32_t> key_frame_request_interval_{ 1000 };
+	int64_t last_key_frame_time_ = 0;
 };
@@ -1,11 +1,6 @@
 ﻿#include "h264_encoder.h"
 #include "av_common.h"
 
-#define USE_LIBYUV 0
-#if USE_LIBYUV
-#include "libyuv.h"
-#endif
-
 using namespace ffmpeg;
 
 bool H264Encoder::Init(AVConfig& video_config)
@@ -79,6 +74,8 @@ void H264Encoder::Destroy()
 		video_converter_.reset();
 	}
 
+	yuv_frame_.reset();
+
 	if (codec_context_) {
 		avcodec_close(codec_context_);
 		avcodec_free_context(&codec_context_);
@@ -93,11 +90,20 @@ void H264Encoder::Destroy()
 
 AVPacketPtr H264Encoder::Encode(const uint8_t *image, uint32_t width, uint32_t height, uint32_t image_size, uint64_t pts)
 {
-	if (!is_initialized_) {
+	if (!Convert(image, width, height, yuv_frame_)) {
 		return nullptr;
 	}
 
-	if (width != in_width_ || height != av_config_.video.height || !video_converter_) {
+	return Encode(yuv_frame_, pts);
+}
+
+bool H264Encoder::Convert(const uint8_t *image, uint32_t width, uint32_t height, AVFramePtr& yuv_frame)
+{
+	if (!is_initialized_) {
+		return false;
+	}
+
+	if (width != in_width_ || height != in_height_ || !video_converter_) {
 		in_width_ = width;
 		in_height_ = height;
 
@@ -105,42 +111,32 @@ AVPacketPtr H264Encoder::Encode(const uint8_t *image, uint32_t width, uint32_t h
 		if (!video_converter_->Init(in_width_, in_height_, (AVPixelFormat)av_config_.video.format,
 									codec_context_->width, codec_context_->height, codec_context_->pix_fmt)) {
 			video_converter_.reset();
-			return nullptr;
+			return false;
 		}
 	}
 
+	/* the source image is referenced in place, not copied */
 	ffmpeg::AVFramePtr in_frame(av_frame_alloc(), [](AVFrame* ptr) { av_frame_free(&ptr); });
 	in_frame->width = in_width_;
 	in_frame->height = in_height_;
 	in_frame->format = av_config_.video.format;
-	if (av_frame_get_buffer(in_frame.get(), 32) != 0) {
-		return nullptr;
+	if (av_image_fill_arrays(in_frame->data, in_frame->linesize, image, 
+							(AVPixelFormat)av_config_.video.format, in_width_, in_height_, 1) < 0) {
+		return false;
 	}
 
-	//int pic_size = av_image_get_buffer_size(av_config_.video.format, in_width_, in_height_, in_frame->linesize[0]);
-	//if (pic_size <= 0) {
-	//	return nullptr;
-	//}
-
-	memcpy(in_frame->data[0], image, image_size);
+	if (video_converter_->Convert(in_frame, yuv_frame) <= 0) {
+		return false;
+	}
 
-//#if USE_LIBYUV	
-	//int result = libyuv::ARGBToI420(bgra_image, width * 4,
-	//	yuv_frame->data[0], yuv_frame->linesize[0],
-	//	yuv_frame->data[1], yuv_frame->linesize[1],
-	//	yuv_frame->data[2], yuv_frame->linesize[2],
-	//	width, height);
+	return true;
+}
 
-	//if (result != 0) {
-	//	LOG("libyuv::ARGBToI420() failed.\n");
-	//	return nullptr;
-	//}
-//#else
-	AVFramePtr yuv_frame = nullptr;
-	if (video_converter_->Convert(in_frame, yuv_frame) <= 0) {
+AVPacketPtr H264Encoder::Encode(AVFramePtr yuv_frame, uint64_t pts)
+{
+	if (!is_initialized_ || !yuv_frame) {
 		return nullptr;
 	}
-//#endif
 
 	if (pts >= 0) {
 		yuv_frame->pts = pts;
@@ -15,12 +15,18 @@ public:
 
 	virtual AVPacketPtr Encode(const uint8_t *image, uint32_t width, uint32_t height, uint32_t image_size, uint64_t pts = 0);
 
+	/* Encode() split in two steps so that colour conversion and encoding can run 
+	   on different threads. yuv_frame is reused when it already has the right size. */
+	bool Convert(const uint8_t *image, uint32_t width, uint32_t height, AVFramePtr& yuv_frame);
+	AVPacketPtr Encode(AVFramePtr yuv_frame, uint64_t pts = 0);
+
 	virtual void ForceIDR();
 	virtual void SetBitrate(uint32_t bitrate_kbps);
 
 private:
 	int64_t pts_ = 0;
 	std::unique_ptr<VideoConverter> video_converter_;
+	AVFramePtr yuv_frame_;
 	uint32_t in_width_  = 0;
 	uint32_t in_height_ = 0;
 	bool force_idr_ = false;
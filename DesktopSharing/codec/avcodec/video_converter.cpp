@@ -1,4 +1,5 @@
 #include "video_converter.h"
+#include "libyuv.h"
 
 using namespace ffmpeg;
 
@@ -12,25 +13,59 @@ VideoConverter::~VideoConverter()
 	Destroy();
 }
 
-bool VideoConverter::Init(int in_width, int in_height, AVPixelFormat in_format,
+bool VideoConverter::IsLibyuvSupported(int in_width, int in_height, AVPixelFormat in_format,
 	int out_width, int out_height, AVPixelFormat out_format)
 {
-	if (sws_context_) {
+	if (in_width != out_width || in_height != out_height || out_format != AV_PIX_FMT_YUV420P) {
 		return false;
 	}
 
-	if (sws_context_ == nullptr) {
+	switch (in_format)
+	{
+	case AV_PIX_FMT_BGRA:
+	case AV_PIX_FMT_RGBA:
+	case AV_PIX_FMT_ARGB:
+	case AV_PIX_FMT_ABGR:
+		return true;
+	default:
+		break;
+	}
+
+	return false;
+}
+
+bool VideoConverter::Init(int in_width, int in_height, AVPixelFormat in_format,
+	int out_width, int out_height, AVPixelFormat out_format, Backend backend)
+{
+	if (backend_ != BACKEND_AUTO) {
+		return false;
+	}
+
+	bool use_libyuv = IsLibyuvSupported(in_width, in_height, in_format, out_width, out_height, out_format);
+	if (backend == BACKEND_LIBYUV && !use_libyuv) {
+		return false;
+	}
+
+	if (backend == BACKEND_SWSCALE || !use_libyuv) {
 		sws_context_ = sws_getContext(
 			in_width, in_height, in_format,out_width, 
 			out_height, out_format, 
 			SWS_BICUBIC, NULL, NULL, NULL);
-
-		out_width_ = out_width;
-		out_height_ = out_height;
-		out_format_ = out_format;
-		return sws_context_ != nullptr;
+		if (sws_context_ == nullptr) {
+			return false;
+		}
+		backend_ = BACKEND_SWSCALE;
 	}
-	return false;
+	else {
+		/* libyuv picks its AVX2/SSSE3/NEON row functions at runtime */
+		backend_ = BACKEND_LIBYUV;
+	}
+
+	in_format_ = in_format;
+	out_width_ = out_width;
+	out_height_ = out_height;
+	out_format_ = out_format;
+	return true;
 }
 
 void VideoConverter::Destroy()
@@ -39,26 +74,37 @@ void VideoConverter::Destroy()
 		sws_freeContext(sws_context_);
 		sws_context_ = nullptr;
 	}
+
+	backend_ = BACKEND_AUTO;
 }
 
 int VideoConverter::Convert(AVFramePtr in_frame, AVFramePtr& out_frame)
 {
-	if (!sws_context_) {
+	if (backend_ == BACKEND_AUTO || !in_frame) {
 		return -1;
 	}
 
-	out_frame.reset(av_frame_alloc(), [](AVFrame* ptr) {
-		av_frame_free(&ptr);
-	});
+	/* reuse the caller's picture when it matches, the encoder may still hold a reference to it */
+	if (out_frame == nullptr || out_frame->width != out_width_ || out_frame->height != out_height_ ||
+		out_frame->format != out_format_ || !av_frame_is_writable(out_frame.get())) {
+		out_frame.reset(av_frame_alloc(), [](AVFrame* ptr) {
+			av_frame_free(&ptr);
+		});
+
+		out_frame->width = out_width_;
+		out_frame->height = out_height_;
+		out_frame->format = out_format_;
+
+		if (av_frame_get_buffer(out_frame.get(), 32) != 0) {
+			return -1;
+		}
+	}
 
-	out_frame->width = out_width_;
-	out_frame->height = out_height_;
-	out_frame->format = out_format_;
 	out_frame->pts = in_frame->pts;
 	out_frame->pkt_dts = in_frame->pkt_dts;
 
-	if (av_frame_get_buffer(out_frame.get(), 32) != 0) {
-		return -1;
+	if (backend_ == BACKEND_LIBYUV) {
+		return ConvertLibyuv(in_frame, out_frame);
 	}
 
 	int out_height = sws_scale(sws_context_, in_frame->data, in_frame->linesize, 0, in_frame->height,
@@ -68,4 +114,39 @@ int VideoConverter::Convert(AVFramePtr in_frame, AVFramePtr& out_frame)
 	}
 
 	return out_height;
+}
+
+int VideoConverter::ConvertLibyuv(AVFramePtr in_frame, AVFramePtr out_frame)
+{
+	/* libyuv names packed formats after the 32-bit word, ffmpeg after the byte order */
+	int (*convert)(const uint8_t*, int, uint8_t*, int, uint8_t*, int, uint8_t*, int, int, int) = nullptr;
+
+	switch (in_format_)
+	{
+	case AV_PIX_FMT_BGRA:
+		convert = libyuv::ARGBToI420;
+		break;
+	case AV_PIX_FMT_RGBA:
+		convert = libyuv::ABGRToI420;
+		break;
+	case AV_PIX_FMT_ARGB:
+		convert = libyuv::BGRAToI420;
+		break;
+	case AV_PIX_FMT_ABGR:
+		convert = libyuv::RGBAToI420;
+		break;
+	default:
+		return -1;
+	}
+
+	int ret = convert(in_frame->data[0], in_frame->linesize[0],
+		out_frame->data[0], out_frame->linesize[0],
+		out_frame->data[1], out_frame->linesize[1],
+		out_frame->data[2], out_frame->linesize[2],
+		out_width_, out_height_);
+	if (ret != 0) {
+		return -1;
+	}
+
+	return out_height_;
 }
\ No newline at end of file
@@ -19,15 +19,32 @@ public:
 	VideoConverter();
 	virtual ~VideoConverter();
 
+	enum Backend
+	{
+		BACKEND_AUTO = 0, /* libyuv when no scaling is needed, swscale otherwise */
+		BACKEND_SWSCALE,
+		BACKEND_LIBYUV,
+	};
+
 	bool Init(int in_width, int in_height, AVPixelFormat in_format,
-		int out_width, int out_height, AVPixelFormat out_format);
+		int out_width, int out_height, AVPixelFormat out_format, Backend backend = BACKEND_AUTO);
 
 	void Destroy();
 
 	int  Convert(AVFramePtr in_frame, AVFramePtr& out_frame);
 
+	Backend GetBackend() const
+	{ return backend_; }
+
+	static bool IsLibyuvSupported(int in_width, int in_height, AVPixelFormat in_format,
+		int out_width, int out_height, AVPixelFormat out_format);
+
 private:
+	int ConvertLibyuv(AVFramePtr in_frame, AVFramePtr out_frame);
+
 	SwsContext* sws_context_ = nullptr;
+	Backend backend_ = BACKEND_AUTO;
+	AVPixelFormat in_format_ = AV_PIX_FMT_NONE;
 	int out_width_ = 0;
 	int out_height_ = 0;
 	AVPixelFormat out_format_ = AV_PIX_FMT_NONE;
@@ -116,6 +116,7 @@ int main(int argc, char **argv)
 	live_config.ip = "0.0.0.0";
 	live_config.port = 8554;
 	live_config.suffix = "live";
+	live_config.gop_cache_bytes = 4 * 1024 * 1024; // first viewer starts at once
 
 	// pusher
 	live_config.rtmp_url = RTMP_PUSHER_TEST;
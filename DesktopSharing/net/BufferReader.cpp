@@ -3,7 +3,11 @@
 
 #include "BufferReader.h"
 #include "Socket.h"
+#include "MemoryManager.h"
 #include <cstring>
+#if defined(__linux) || defined(__linux__) 
+#include <sys/uio.h>
+#endif
  
 using namespace xop;
 uint32_t xop::ReadUint32BE(char* data)
@@ -50,44 +54,236 @@ uint16_t xop::ReadUint16LE(char* data)
 
 const char BufferReader::kCRLF[] = "\r\n";
 
-BufferReader::BufferReader(uint32_t initial_size)
+BufferReader::BufferReader(uint32_t block_size)
+	: block_size_(block_size > 0 ? block_size : kDefaultBlockSize)
 {
-	buffer_.resize(initial_size);
+
 }	
 
 BufferReader::~BufferReader()
 {
-	
+	RetrieveAll();
+}
+
+BufferReader::Block BufferReader::AllocBlock(uint32_t capacity)
+{
+	Block block;
+	block.data = (char*)xop::Alloc(capacity);
+	block.capacity = capacity;
+	return block;
+}
+
+void BufferReader::FreeBlock(Block& block)
+{
+	xop::Free(block.data);
+	block.data = nullptr;
+}
+
+BufferReader::Slice BufferReader::Front() const
+{
+	Slice slice;
+	if (!blocks_.empty()) {
+		const Block& block = blocks_.front();
+		slice.data = block.data + block.begin;
+		slice.size = block.end - block.begin;
+	}
+	return slice;
+}
+
+char* BufferReader::Pullup(uint32_t len)
+{
+	if (len > readable_bytes_ || readable_bytes_ == 0) {
+		return nullptr;
+	}
+
+	Block& front = blocks_.front();
+	if (front.end - front.begin >= len) {
+		return front.data + front.begin;
+	}
+
+	/* gather the straddling prefix into one block, leave the rest where it is */
+	Block block = AllocBlock((len > block_size_) ? len : block_size_);
+	uint32_t size = 0;
+	while (size < len) {
+		Block& src = blocks_.front();
+		uint32_t bytes = std::min(src.end - src.begin, len - size);
+		memcpy(block.data + size, src.data + src.begin, bytes);
+		src.begin += bytes;
+		size += bytes;
+		if (src.begin == src.end) {
+			FreeBlock(src);
+			blocks_.pop_front();
+		}
+	}
+
+	block.end = size;
+	blocks_.push_front(block);
+	return block.data;
+}
+
+const char* BufferReader::FindFirstCrlf()
+{
+	const char* begin = Peek();
+	if (begin == nullptr) {
+		return nullptr;
+	}
+
+	const char* end = begin + readable_bytes_;
+	const char* crlf = std::search(begin, end, kCRLF, kCRLF + 2);
+	return crlf == end ? nullptr : crlf;
+}
+
+const char* BufferReader::FindLastCrlf()
+{
+	const char* begin = Peek();
+	if (begin == nullptr) {
+		return nullptr;
+	}
+
+	const char* end = begin + readable_bytes_;
+	const char* crlf = std::find_end(begin, end, kCRLF, kCRLF + 2);
+	return crlf == end ? nullptr : crlf;
+}
+
+const char* BufferReader::FindLastCrlfCrlf()
+{
+	const char* begin = Peek();
+	if (begin == nullptr) {
+		return nullptr;
+	}
+
+	char crlfCrlf[] = "\r\n\r\n";
+	const char* end = begin + readable_bytes_;
+	const char* crlf = std::find_end(begin, end, crlfCrlf, crlfCrlf + 4);
+	return crlf == end ? nullptr : crlf;
+}
+
+void BufferReader::RetrieveAll()
+{
+	for (auto& block : blocks_) {
+		FreeBlock(block);
+	}
+
+	blocks_.clear();
+	readable_bytes_ = 0;
+}
+
+void BufferReader::Retrieve(size_t len)
+{
+	if (len >= readable_bytes_) {
+		RetrieveAll();
+		return;
+	}
+
+	readable_bytes_ -= (uint32_t)len;
+	while (len > 0) {
+		Block& block = blocks_.front();
+		uint32_t bytes = (uint32_t)std::min((size_t)(block.end - block.begin), len);
+		block.begin += bytes;
+		len -= bytes;
+		if (block.begin == block.end) {
+			FreeBlock(block);
+			blocks_.pop_front();
+		}
+	}
+}
+
+uint32_t BufferReader::ReadBytes(char* data, uint32_t len)
+{
+	if (len > readable_bytes_) {
+		len = readable_bytes_;
+	}
+
+	uint32_t size = 0;
+	while (size < len) {
+		Slice slice = Front();
+		uint32_t bytes = std::min(slice.size, len - size);
+		memcpy(data + size, slice.data, bytes);
+		Retrieve(bytes);
+		size += bytes;
+	}
+
+	return size;
+}
+
+uint32_t BufferReader::Size() const
+{
+	uint32_t size = 0;
+	for (auto& block : blocks_) {
+		size += block.capacity;
+	}
+	return size;
 }
 
 int BufferReader::Read(SOCKET sockfd)
 {	
-	uint32_t size = WritableBytes();
-	if(size < MAX_BYTES_PER_READ) {
-		uint32_t bufferReaderSize = (uint32_t)buffer_.size();
-		if(bufferReaderSize > MAX_BUFFER_SIZE) {
-			return 0; 
-		}
-        
-		buffer_.resize(bufferReaderSize + MAX_BYTES_PER_READ);
+	if (readable_bytes_ > MAX_BUFFER_SIZE) {
+		return 0; 
+	}
+
+	/* free space of the last block plus fresh blocks, up to kMaxBlocksPerRead blocks per call */
+	Block blocks[kMaxBlocksPerRead + 1];
+	uint32_t num_blocks = 0;
+	bool use_tail = !blocks_.empty() && blocks_.back().end < blocks_.back().capacity;
+	if (use_tail) {
+		blocks[num_blocks++] = blocks_.back();
+	}
+
+	while (num_blocks < kMaxBlocksPerRead) {
+		blocks[num_blocks++] = AllocBlock(block_size_);
+	}
+
+#if defined(__linux) || defined(__linux__) 
+	struct iovec iov[kMaxBlocksPerRead + 1];
+	for (uint32_t n = 0; n < num_blocks; n++) {
+		iov[n].iov_base = blocks[n].data + blocks[n].end;
+		iov[n].iov_len = blocks[n].capacity - blocks[n].end;
+	}
+
+	int bytes_read = (int)::readv(sockfd, iov, (int)num_blocks);
+#elif defined(WIN32) || defined(_WIN32) 
+	WSABUF wsa_bufs[kMaxBlocksPerRead + 1];
+	for (uint32_t n = 0; n < num_blocks; n++) {
+		wsa_bufs[n].buf = blocks[n].data + blocks[n].end;
+		wsa_bufs[n].len = blocks[n].capacity - blocks[n].end;
 	}
 
-	int bytes_read = ::recv(sockfd, beginWrite(), MAX_BYTES_PER_READ, 0);
-	if(bytes_read > 0) {
-		writer_index_ += bytes_read;
+	DWORD bytes = 0, flags = 0;
+	int bytes_read = -1;
+	if (WSARecv(sockfd, wsa_bufs, num_blocks, &bytes, &flags, NULL, NULL) == 0) {
+		bytes_read = (int)bytes;
+	}
+#endif
+
+	uint32_t size = (bytes_read > 0) ? (uint32_t)bytes_read : 0;
+	readable_bytes_ += size;
+
+	for (uint32_t n = 0; n < num_blocks; n++) {
+		Block& block = blocks[n];
+		uint32_t bytes = std::min(block.capacity - block.end, size);
+		block.end += bytes;
+		size -= bytes;
+
+		if (n == 0 && use_tail) {
+			blocks_.back().end = block.end;
+		}
+		else if (bytes > 0) {
+			blocks_.push_back(block);
+		}
+		else {
+			FreeBlock(block);
+		}
 	}
 
 	return bytes_read;
 }
 
-
 uint32_t BufferReader::ReadAll(std::string& data)
 {
 	uint32_t size = ReadableBytes();
 	if(size > 0)  {
-		data.assign(Peek(), size);
-		writer_index_ = 0;
-		reader_index_ = 0;
+		data.resize(size);
+		ReadBytes(&data[0], size);
 	}
 
 	return size;
@@ -105,4 +301,3 @@ uint32_t BufferReader::ReadUntilCrlf(std::string& data)
 	Retrieve(size);
 	return size;
 }
-
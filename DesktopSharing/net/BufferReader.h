@@ -6,6 +6,7 @@
 
 #include <cstdint>
 #include <vector>
+#include <deque>
 #include <string>
 #include <algorithm>  
 #include <memory>  
@@ -21,87 +22,75 @@ uint32_t ReadUint24LE(char* data);
 uint16_t ReadUint16BE(char* data);
 uint16_t ReadUint16LE(char* data);
     
+/* Chain of pooled fixed-size blocks filled with one readv per readiness event.
+ * Parsers walk the data with Front()/ReadBytes() without copying; Peek() and the
+ * Find helpers make the range contiguous first, copying only the part that 
+ * straddles blocks. Fully consumed blocks go back to the pool at once, so an
+ * idle connection holds no buffer memory. */
 class BufferReader
 {
 public:	
-	BufferReader(uint32_t initial_size = 2048);
+	/* read-only view of one block, valid until the next Retrieve or Read */
+	struct Slice
+	{
+		const char* data = nullptr;
+		uint32_t size = 0;
+	};
+
+	BufferReader(uint32_t block_size = kDefaultBlockSize);
 	virtual ~BufferReader();
 
 	uint32_t ReadableBytes() const
-	{ return (uint32_t)(writer_index_ - reader_index_); }
+	{ return readable_bytes_; }
 
-	uint32_t WritableBytes() const
-	{  return (uint32_t)(buffer_.size() - writer_index_); }
+	Slice Front() const;
+
+	/* makes the first len bytes contiguous, nullptr if fewer are readable */
+	char* Pullup(uint32_t len);
 
 	char* Peek() 
-	{ return Begin() + reader_index_; }
-
-	const char* Peek() const
-	{ return Begin() + reader_index_; }
-
-	const char* FindFirstCrlf() const {    
-		const char* crlf = std::search(Peek(), BeginWrite(), kCRLF, kCRLF+2);
-		return crlf == BeginWrite() ? nullptr : crlf;
-	}
-
-	const char* FindLastCrlf() const {    
-		const char* crlf = std::find_end(Peek(), BeginWrite(), kCRLF, kCRLF+2);
-		return crlf == BeginWrite() ? nullptr : crlf;
-	}
-
-	const char* FindLastCrlfCrlf() const {
-		char crlfCrlf[] = "\r\n\r\n";
-		const char* crlf = std::find_end(Peek(), BeginWrite(), crlfCrlf, crlfCrlf + 4);
-		return crlf == BeginWrite() ? nullptr : crlf;
-	}
-
-	void RetrieveAll()  { 
-		writer_index_ = 0; 
-		reader_index_ = 0; 
-	}
-
-	void Retrieve(size_t len) {
-		if (len <= ReadableBytes()) {
-			reader_index_ += len;
-			if(reader_index_ == writer_index_) {
-				reader_index_ = 0;
-				writer_index_ = 0;
-			}
-		}
-		else {
-			RetrieveAll();
-		}
-	}
+	{ return Pullup(readable_bytes_); }
+
+	const char* FindFirstCrlf();
+	const char* FindLastCrlf();
+	const char* FindLastCrlfCrlf();
+
+	void RetrieveAll();
+	void Retrieve(size_t len);
 
+	/* end must come from Peek() or a Find helper with no Read in between */
 	void RetrieveUntil(const char* end)
-	{ Retrieve(end - Peek()); }
+	{ Retrieve(end - Front().data); }
+
+	/* copies len bytes out of the chain and retrieves them */
+	uint32_t ReadBytes(char* data, uint32_t len);
 
 	int Read(SOCKET sockfd);
 	uint32_t ReadAll(std::string& data);
 	uint32_t ReadUntilCrlf(std::string& data);
 
-	uint32_t Size() const 
-	{ return (uint32_t)buffer_.size(); }
+	/* bytes held in blocks, including consumed and free space */
+	uint32_t Size() const;
 
 private:
-	char* Begin()
-	{ return &*buffer_.begin(); }
-
-	const char* Begin() const
-	{ return &*buffer_.begin(); }
-
-	char* beginWrite()
-	{ return Begin() + writer_index_; }
+	struct Block
+	{
+		char* data = nullptr;
+		uint32_t capacity = 0;
+		uint32_t begin = 0;
+		uint32_t end = 0;
+	};
 
-	const char* BeginWrite() const
-	{ return Begin() + writer_index_; }
+	Block AllocBlock(uint32_t capacity);
+	void  FreeBlock(Block& block);
 
-	std::vector<char> buffer_;
-	size_t reader_index_ = 0;
-	size_t writer_index_ = 0;
+	std::deque<Block> blocks_;
+	uint32_t block_size_ = kDefaultBlockSize;
+	uint32_t readable_bytes_ = 0;
 
 	static const char kCRLF[];
-	static const uint32_t MAX_BYTES_PER_READ = 4096;
+	static const uint32_t kDefaultBlockSize = 16384;
+	static const uint32_t kMaxBlocksPerRead = 4;
 	static const uint32_t MAX_BUFFER_SIZE = 1024 * 100000;
 };
 
@@ -4,9 +4,31 @@
 #include "BufferWriter.h"
 #include "Socket.h"
 #include "SocketUtil.h"
+#include <chrono>
+
+#if defined(__linux) || defined(__linux__)
+#include <sys/uio.h>
+#include <limits.h>
+typedef struct iovec IoBuffer;
+#define IO_BUFFER_SET(b, p, l) { (b).iov_base = (p); (b).iov_len = (l); }
+#elif defined(WIN32) || defined(_WIN32)
+typedef WSABUF IoBuffer;
+#define IO_BUFFER_SET(b, p, l) { (b).buf = (p); (b).len = (ULONG)(l); }
+#else
+#include <sys/uio.h>
+#include <limits.h>
+typedef struct iovec IoBuffer;
+#define IO_BUFFER_SET(b, p, l) { (b).iov_base = (p); (b).iov_len = (l); }
+#endif
 
 using namespace xop;
 
+static inline int64_t GetTimeNow()
+{
+	auto time_point = std::chrono::steady_clock::now();
+	return std::chrono::duration_cast<std::chrono::milliseconds>(time_point.time_since_epoch()).count();
+}
+
 void xop::WriteUint32BE(char* p, uint32_t value)
 {
 	p[0] = value >> 24;
@@ -65,8 +87,14 @@ bool BufferWriter::Append(std::shared_ptr<char> data, uint32_t size, uint32_t in
 		return false;
 	}
      
-	Packet pkt = { data, size, index };
-	buffer_.emplace(std::move(pkt));
+	Packet pkt;
+	pkt.data = data;
+	pkt.size = size;
+	pkt.writeIndex = index;
+	pkt.prefixSize = 0;
+	pkt.timestamp = GetTimeNow();
+	buffer_.emplace_back(std::move(pkt));
+	queued_bytes_ += size - index;
 	return true;
 }
 
@@ -85,7 +113,32 @@ bool BufferWriter::Append(const char* data, uint32_t size, uint32_t index)
 	memcpy(pkt.data.get(), data, size);
 	pkt.size = size;
 	pkt.writeIndex = index;
-	buffer_.emplace(std::move(pkt));
+	pkt.prefixSize = 0;
+	pkt.timestamp = GetTimeNow();
+	buffer_.emplace_back(std::move(pkt));
+	queued_bytes_ += size - index;
+	return true;
+}
+
+bool BufferWriter::Append(const char* prefix, uint32_t prefix_size, std::shared_ptr<char> data, uint32_t size)
+{
+	if (prefix_size > kMaxPrefixSize || size == 0) {
+		return false;
+	}
+
+	if ((int)buffer_.size() >= max_queue_length_) {
+		return false;
+	}
+
+	Packet pkt;
+	pkt.data = std::move(data);
+	pkt.size = size;
+	pkt.writeIndex = 0;
+	pkt.prefixSize = prefix_size;
+	memcpy(pkt.prefix, prefix, prefix_size);
+	pkt.timestamp = GetTimeNow();
+	buffer_.emplace_back(std::move(pkt));
+	queued_bytes_ += prefix_size + size;
 	return true;
 }
 
@@ -96,36 +149,33 @@ int BufferWriter::Send(SOCKET sockfd, int timeout)
 	}
       
 	int ret = 0;
-	int count = 1;
+	uint32_t bytes_queued = 0;
 
-	do
-	{
-		if (buffer_.empty()) {
-			return 0;
-		}
-		
-		count -= 1;
-		Packet &pkt = buffer_.front();
-		ret = ::send(sockfd, pkt.data.get() + pkt.writeIndex, pkt.size - pkt.writeIndex, 0);
+	while (!buffer_.empty()) {
+		ret = SendPackets(sockfd, bytes_queued);
 		if (ret > 0) {
-			pkt.writeIndex += ret;
-			if (pkt.size == pkt.writeIndex) {
-				count += 1;
-				buffer_.pop();
+			Consume((uint32_t)ret);
+			if ((uint32_t)ret < bytes_queued) {
+				break; /* socket buffer is full, wait for EVENT_OUT */
 			}
 		}
-		else if (ret < 0) {
+		else {
+			if (ret < 0) {
 #if defined(__linux) || defined(__linux__)
-		if (errno == EINTR || errno == EAGAIN) 
+				if (errno == EINTR || errno == EAGAIN) 
 #elif defined(WIN32) || defined(_WIN32)
-			int error = WSAGetLastError();
-			if (error == WSAEWOULDBLOCK || error == WSAEINPROGRESS || error == 0)
+				int error = WSAGetLastError();
+				if (error == WSAEWOULDBLOCK || error == WSAEINPROGRESS || error == 0)
+#else
+				if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
 #endif
-			{
-				ret = 0;
+				{
+					ret = 0;
+				}
 			}
+			break;
 		}
-	} while (count > 0);
+	}
 
 	if (timeout > 0) {
 		SocketUtil::SetNonBlock(sockfd);
@@ -134,4 +184,83 @@ int BufferWriter::Send(SOCKET sockfd, int timeout)
 	return ret;
 }
 
+int BufferWriter::SendPackets(SOCKET sockfd, uint32_t& bytes_queued)
+{
+	bytes_queued = 0;
+
+	IoBuffer bufs[kMaxIovecs];
+	int num_bufs = 0;
+	int max_bufs = kMaxIovecs;
+#if defined(IOV_MAX)
+	if (max_bufs > IOV_MAX) {
+		max_bufs = IOV_MAX;
+	}
+#endif
+
+	/* a packet takes two slots while its prefix is not fully written */
+	for (auto iter = buffer_.begin(); iter != buffer_.end() && num_bufs + 2 <= max_bufs; iter++) {
+		if (iter->writeIndex < iter->prefixSize) {
+			IO_BUFFER_SET(bufs[num_bufs], iter->prefix + iter->writeIndex, iter->prefixSize - iter->writeIndex);
+			num_bufs++;
+			IO_BUFFER_SET(bufs[num_bufs], iter->data.get(), iter->size);
+			num_bufs++;
+		}
+		else {
+			IO_BUFFER_SET(bufs[num_bufs], iter->data.get() + iter->writeIndex - iter->prefixSize, 
+						iter->prefixSize + iter->size - iter->writeIndex);
+			num_bufs++;
+		}
+		bytes_queued += iter->prefixSize + iter->size - iter->writeIndex;
+	}
+
+#if defined(__linux) || defined(__linux__)
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = bufs;
+	msg.msg_iovlen = num_bufs;
+	return (int)::sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+#elif defined(WIN32) || defined(_WIN32)
+	DWORD bytes_sent = 0;
+	if (WSASend(sockfd, bufs, num_bufs, &bytes_sent, 0, NULL, NULL) == SOCKET_ERROR) {
+		return -1;
+	}
+	return (int)bytes_sent;
+#else
+	/* no MSG_NOSIGNAL here, TcpConnection sets SO_NOSIGPIPE on the socket instead */
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = bufs;
+	msg.msg_iovlen = num_bufs;
+	return (int)::sendmsg(sockfd, &msg, 0);
+#endif
+}
+
+int64_t BufferWriter::QueuedTime() const
+{
+	if (buffer_.empty()) {
+		return 0;
+	}
+
+	int64_t elapsed = GetTimeNow() - buffer_.front().timestamp;
+	return (elapsed > 0) ? elapsed : 0;
+}
+
+void BufferWriter::Consume(uint32_t bytes)
+{
+	queued_bytes_ -= (bytes < queued_bytes_) ? bytes : queued_bytes_;
+
+	/* pop fully written packets, the last one may be left partially written */
+	while (bytes > 0 && !buffer_.empty()) {
+		Packet &pkt = buffer_.front();
+		uint32_t remaining = pkt.prefixSize + pkt.size - pkt.writeIndex;
+		if (bytes >= remaining) {
+			bytes -= remaining;
+			buffer_.pop_front();
+		}
+		else {
+			pkt.writeIndex += bytes;
+			bytes = 0;
+		}
+	}
+}
 
@@ -6,7 +6,7 @@
 
 #include <cstdint>
 #include <memory>
-#include <queue>
+#include <deque>
 #include <string>
 #include "Socket.h"
 
@@ -28,6 +28,13 @@ public:
 
 	bool Append(std::shared_ptr<char> data, uint32_t size, uint32_t index=0);
 	bool Append(const char* data, uint32_t size, uint32_t index=0);
+
+	/* Queues a small per-connection prefix (copied into the queue slot) followed 
+	   by a shared body that is sent in place, both go out in the same writev. */
+	bool Append(const char* prefix, uint32_t prefix_size, std::shared_ptr<char> data, uint32_t size);
+
+	/* Flushes as many queued packets as fit in one writev/WSASend call, 
+	   repeating while the socket accepts whole batches. */
 	int Send(SOCKET sockfd, int timeout=0);
 
 	bool IsEmpty() const 
@@ -38,19 +45,36 @@ public:
 
 	uint32_t Size() const 
 	{ return (uint32_t)buffer_.size(); }
+
+	/* Bytes not yet written to the socket. */
+	uint32_t QueuedBytes() const
+	{ return queued_bytes_; }
+
+	/* Milliseconds the oldest queued packet has been waiting, 0 if empty. */
+	int64_t QueuedTime() const;
 	
 private:
+	static const uint32_t kMaxPrefixSize = 16;
+
 	typedef struct 
 	{
 		std::shared_ptr<char> data;
 		uint32_t size;
-		uint32_t writeIndex;
+		uint32_t writeIndex; /* counts prefix bytes first, then data bytes */
+		uint32_t prefixSize;
+		char prefix[kMaxPrefixSize];
+		int64_t timestamp;   /* ms, when the packet was queued */
 	} Packet;
 
-	std::queue<Packet> buffer_;  		
+	int SendPackets(SOCKET sockfd, uint32_t& bytes_queued);
+	void Consume(uint32_t bytes);
+
+	std::deque<Packet> buffer_;  		
 	int max_queue_length_ = 0;
+	uint32_t queued_bytes_ = 0;
 	 
 	static const int kMaxQueueLength = 10000;
+	static const int kMaxIovecs = 1024;
 };
 
 }
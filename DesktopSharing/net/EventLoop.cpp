@@ -5,6 +5,9 @@
 
 #if defined(WIN32) || defined(_WIN32) 
 #include<windows.h>
+#elif defined(__linux) || defined(__linux__) 
+#include <pthread.h>
+#include <sched.h>
 #endif
 
 #if defined(WIN32) || defined(_WIN32) 
@@ -14,14 +17,20 @@
 
 using namespace xop;
 
-EventLoop::EventLoop(uint32_t num_threads)
+EventLoop::EventLoop(uint32_t num_threads, bool cpu_affinity, int backend)
 	: index_(1)
+	, cpu_affinity_(cpu_affinity)
+	, backend_(backend)
 {
 	num_threads_ = 1;
 	if (num_threads > 0) {
 		num_threads_ = num_threads;
 	}
 
+	if (num_threads_ > kMaxThreads) {
+		num_threads_ = kMaxThreads;
+	}
+
 	this->Loop();
 }
 
@@ -33,19 +42,30 @@ EventLoop::~EventLoop()
 std::shared_ptr<TaskScheduler> EventLoop::GetTaskScheduler()
 {
 	std::lock_guard<std::mutex> locker(mutex_);
+	if (task_schedulers_.empty()) {
+		return nullptr;
+	}
+
 	if (task_schedulers_.size() == 1) {
 		return task_schedulers_.at(0);
 	}
-	else {
-		auto task_scheduler = task_schedulers_.at(index_);
-		index_++;
-		if (index_ >= task_schedulers_.size()) {
-			index_ = 1;
-		}		
-		return task_scheduler;
+
+	/* least connections, starting from the round-robin index so ties are spread evenly */
+	uint32_t num_schedulers = (uint32_t)task_schedulers_.size();
+	uint32_t best = index_;
+	for (uint32_t n = 0; n < num_schedulers - 1; n++) {
+		uint32_t index = 1 + (index_ - 1 + n) % (num_schedulers - 1);
+		if (task_schedulers_[index]->GetNumConnections() < task_schedulers_[best]->GetNumConnections()) {
+			best = index;
+		}
+	}
+
+	index_++;
+	if (index_ >= num_schedulers) {
+		index_ = 1;
 	}
 
-	return nullptr;
+	return task_schedulers_.at(best);
 }
 
 void EventLoop::Loop()
@@ -58,17 +78,25 @@ void EventLoop::Loop()
 
 	for (uint32_t n = 0; n < num_threads_; n++) 
 	{
-#if defined(__linux) || defined(__linux__) 
-		std::shared_ptr<TaskScheduler> task_scheduler_ptr(new EpollTaskScheduler(n));
-#elif defined(WIN32) || defined(_WIN32) 
-		std::shared_ptr<TaskScheduler> task_scheduler_ptr(new SelectTaskScheduler(n));
-#endif
+		std::shared_ptr<TaskScheduler> task_scheduler_ptr = CreateTaskScheduler(n);
 		task_schedulers_.push_back(task_scheduler_ptr);
 		std::shared_ptr<std::thread> thread(new std::thread(&TaskScheduler::Start, task_scheduler_ptr.get()));
 		thread->native_handle();
 		threads_.push_back(thread);
 	}
 
+	if (cpu_affinity_ && num_threads_ > 1) {
+		uint32_t num_cpus = std::thread::hardware_concurrency();
+		if (num_cpus == 0) {
+			num_cpus = 1;
+		}
+
+		/* the acceptor scheduler floats, connection schedulers get one CPU each */
+		for (uint32_t n = 1; n < num_threads_; n++) {
+			SetThreadAffinity(threads_[n].get(), (n - 1) % num_cpus);
+		}
+	}
+
 	const int priority = TASK_SCHEDULER_PRIORITY_REALTIME;
 
 	for (auto iter : threads_) 
@@ -98,6 +126,37 @@ void EventLoop::Loop()
 	}
 }
 
+std::shared_ptr<TaskScheduler> EventLoop::CreateTaskScheduler(int id)
+{
+#if defined(__linux) || defined(__linux__) 
+	if (backend_ == TASK_SCHEDULER_BACKEND_SELECT) {
+		return std::make_shared<SelectTaskScheduler>(id);
+	}
+
+	if (backend_ == TASK_SCHEDULER_BACKEND_IO_URING && IoUringTaskScheduler::IsSupported()) {
+		return std::make_shared<IoUringTaskScheduler>(id);
+	}
+
+	return std::make_shared<EpollTaskScheduler>(id);
+#elif defined(WIN32) || defined(_WIN32) 
+	return std::make_shared<SelectTaskScheduler>(id);
+#endif
+}
+
+void EventLoop::SetThreadAffinity(std::thread* thread, uint32_t cpu)
+{
+#if defined(__linux) || defined(__linux__) 
+	cpu_set_t cpu_set;
+	CPU_ZERO(&cpu_set);
+	CPU_SET(cpu, &cpu_set);
+	pthread_setaffinity_np(thread->native_handle(), sizeof(cpu_set_t), &cpu_set);
+#elif defined(WIN32) || defined(_WIN32) 
+	if (cpu < sizeof(DWORD_PTR) * 8) {
+		SetThreadAffinityMask(thread->native_handle(), (DWORD_PTR)1 << cpu);
+	}
+#endif
+}
+
 void EventLoop::Quit()
 {
 	std::lock_guard<std::mutex> locker(mutex_);
@@ -134,7 +193,9 @@ TimerId EventLoop::AddTimer(TimerEvent timerEvent, uint32_t msec)
 {
 	std::lock_guard<std::mutex> locker(mutex_);
 	if (task_schedulers_.size() > 0) {
-		return task_schedulers_[0]->AddTimer(timerEvent, msec);
+		uint32_t index = event_index_++ % task_schedulers_.size();
+		TimerId timer_id = task_schedulers_[index]->AddTimer(timerEvent, msec);
+		return (index << kTimerIdBits) | (timer_id & TimerQueue::kMaxTimerId);
 	}
 	return 0;
 }
@@ -142,8 +203,9 @@ TimerId EventLoop::AddTimer(TimerEvent timerEvent, uint32_t msec)
 void EventLoop::RemoveTimer(TimerId timerId)
 {
 	std::lock_guard<std::mutex> locker(mutex_);
-	if (task_schedulers_.size() > 0) {
-		task_schedulers_[0]->RemoveTimer(timerId);
+	uint32_t index = timerId >> kTimerIdBits;
+	if (index < task_schedulers_.size()) {
+		task_schedulers_[index]->RemoveTimer(timerId & TimerQueue::kMaxTimerId);
 	}	
 }
 
@@ -151,7 +213,8 @@ bool EventLoop::AddTriggerEvent(TriggerEvent callback)
 {   
 	std::lock_guard<std::mutex> locker(mutex_);
 	if (task_schedulers_.size() > 0) {
-		return task_schedulers_[0]->AddTriggerEvent(callback);
+		uint32_t index = event_index_++ % task_schedulers_.size();
+		return task_schedulers_[index]->AddTriggerEvent(std::move(callback));
 	}
 	return false;
 }
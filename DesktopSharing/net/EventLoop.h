@@ -14,6 +14,7 @@
 
 #include "SelectTaskScheduler.h"
 #include "EpollTaskScheduler.h"
+#include "IoUringTaskScheduler.h"
 #include "Pipe.h"
 #include "Timer.h"
 #include "RingBuffer.h"
@@ -24,6 +25,11 @@
 #define TASK_SCHEDULER_PRIORITY_HIGHEST   3
 #define TASK_SCHEDULER_PRIORITY_REALTIME  4
 
+#define TASK_SCHEDULER_BACKEND_DEFAULT    0  /* epoll on linux, select on windows */
+#define TASK_SCHEDULER_BACKEND_SELECT     1
+#define TASK_SCHEDULER_BACKEND_EPOLL      2
+#define TASK_SCHEDULER_BACKEND_IO_URING   3  /* falls back to epoll on kernels without io_uring */
+
 namespace xop
 {
 
@@ -32,14 +38,26 @@ class EventLoop
 public:
 	EventLoop(const EventLoop&) = delete;
 	EventLoop &operator = (const EventLoop&) = delete; 
-	EventLoop(uint32_t num_threads =1);  //std::thread::hardware_concurrency()
+	/* num_threads: std::thread::hardware_concurrency()+1 gives one scheduler per core plus the acceptor scheduler. 
+	   cpu_affinity: pin each connection scheduler thread to its own CPU. 
+	   backend: one of TASK_SCHEDULER_BACKEND_*. */
+	EventLoop(uint32_t num_threads =1, bool cpu_affinity =false, int backend =TASK_SCHEDULER_BACKEND_DEFAULT);
 	virtual ~EventLoop();
 
+	/* Returns the connection scheduler with the fewest connections.
+	   Scheduler 0 is kept for acceptors when there is more than one thread. */
 	std::shared_ptr<TaskScheduler> GetTaskScheduler();
 
+	uint32_t GetNumThreads() const
+	{ return num_threads_; }
+
+	/* Trigger events and timers are spread over all schedulers, 
+	   use the connection's own TaskScheduler for work that must stay ordered. */
 	bool AddTriggerEvent(TriggerEvent callback);
 	TimerId AddTimer(TimerEvent timerEvent, uint32_t msec);
 	void RemoveTimer(TimerId timerId);	
+
+	/* Channels registered here (acceptors) run on scheduler 0. */
 	void UpdateChannel(ChannelPtr channel);
 	void RemoveChannel(ChannelPtr& channel);
 	
@@ -47,11 +65,20 @@ public:
 	void Quit();
 
 private:
+	void SetThreadAffinity(std::thread* thread, uint32_t cpu);
+	std::shared_ptr<TaskScheduler> CreateTaskScheduler(int id);
+
 	std::mutex mutex_;
 	uint32_t num_threads_ = 1;
 	uint32_t index_ = 1;
+	uint32_t event_index_ = 0;
+	bool cpu_affinity_ = false;
+	int backend_ = TASK_SCHEDULER_BACKEND_DEFAULT;
 	std::vector<std::shared_ptr<TaskScheduler>> task_schedulers_;
 	std::vector<std::shared_ptr<std::thread>> threads_;
+
+	static const uint32_t kMaxThreads = 255;
+	static const uint32_t kTimerIdBits = 24;
 };
 
 }
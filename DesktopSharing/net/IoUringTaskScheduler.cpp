@@ -0,0 +1,370 @@
+#include "IoUringTaskScheduler.h"
+#include <chrono>
+
+#if defined(__linux) || defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#endif
+
+using namespace xop;
+
+#if defined(__linux) || defined(__linux__)
+static int io_uring_setup(uint32_t entries, struct io_uring_params* params)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+#endif
+
+IoUringTaskScheduler::IoUringTaskScheduler(int id)
+	: TaskScheduler(id)
+{
+	active_channels_.reserve(kMaxEvents);
+	rearm_polls_.reserve(kMaxEvents);
+	if (this->Setup()) {
+		this->UpdateChannel(wakeup_channel_);
+	}
+}
+
+IoUringTaskScheduler::~IoUringTaskScheduler()
+{
+	this->Release();
+}
+
+bool IoUringTaskScheduler::IsSupported()
+{
+#if defined(__linux) || defined(__linux__)
+	static int is_supported = -1;
+	static std::once_flag flag;
+	std::call_once(flag, [] {
+		struct io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		int fd = io_uring_setup(2, &params);
+		is_supported = (fd >= 0 && (params.features & IORING_FEAT_SINGLE_MMAP)) ? 1 : 0;
+		if (fd >= 0) {
+			::close(fd);
+		}
+	});
+	return is_supported == 1;
+#else
+	return false;
+#endif
+}
+
+bool IoUringTaskScheduler::Setup()
+{
+#if defined(__linux) || defined(__linux__)
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = kRingEntries * 4;
+
+	ring_fd_ = io_uring_setup(kRingEntries, &params);
+	if (ring_fd_ < 0 || !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+		this->Release();
+		return false;
+	}
+
+	/* one mapping covers both rings, the SQE array has its own */
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring_size_ = (sq_size > cq_size) ? sq_size : cq_size;
+	ring_ptr_ = mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+	if (ring_ptr_ == MAP_FAILED) {
+		ring_ptr_ = nullptr;
+		this->Release();
+		return false;
+	}
+
+	sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+	sqes_ptr_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+	if (sqes_ptr_ == MAP_FAILED) {
+		sqes_ptr_ = nullptr;
+		this->Release();
+		return false;
+	}
+
+	char* ring = (char*)ring_ptr_;
+	sq_head_ = (uint32_t*)(ring + params.sq_off.head);
+	sq_tail_ = (uint32_t*)(ring + params.sq_off.tail);
+	sq_array_ = (uint32_t*)(ring + params.sq_off.array);
+	sq_mask_ = *(uint32_t*)(ring + params.sq_off.ring_mask);
+	sq_entries_ = params.sq_entries;
+	sqes_ = (struct io_uring_sqe*)sqes_ptr_;
+
+	cq_head_ = (uint32_t*)(ring + params.cq_off.head);
+	cq_tail_ = (uint32_t*)(ring + params.cq_off.tail);
+	cq_mask_ = *(uint32_t*)(ring + params.cq_off.ring_mask);
+	cqes_ = (struct io_uring_cqe*)(ring + params.cq_off.cqes);
+	return true;
+#else
+	return false;
+#endif
+}
+
+void IoUringTaskScheduler::Release()
+{
+#if defined(__linux) || defined(__linux__)
+	if (sqes_ptr_) {
+		munmap(sqes_ptr_, sqes_size_);
+		sqes_ptr_ = nullptr;
+	}
+
+	if (ring_ptr_) {
+		munmap(ring_ptr_, ring_size_);
+		ring_ptr_ = nullptr;
+	}
+
+	if (ring_fd_ >= 0) {
+		::close(ring_fd_);
+		ring_fd_ = -1;
+	}
+#endif
+}
+
+void IoUringTaskScheduler::UpdateChannel(ChannelPtr channel)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+#if defined(__linux) || defined(__linux__)
+	if (ring_fd_ < 0) {
+		return;
+	}
+
+	int fd = channel->GetSocket();
+	auto iter = channels_.find(fd);
+	if (iter != channels_.end()) {
+		if (channel->IsNoneEvent()) {
+			RemovePoll(fd, iter->second);
+			channels_.erase(iter);
+		}
+		else if (iter->second.events != (uint32_t)channel->GetEvents() || iter->second.channel != channel) {
+			RemovePoll(fd, iter->second);
+			iter->second.channel = channel;
+			AddPoll(fd, iter->second);
+		}
+	}
+	else {
+		if (!channel->IsNoneEvent()) {
+			ChannelData& data = channels_[fd];
+			data.channel = channel;
+			AddPoll(fd, data);
+		}
+	}
+
+	/* the loop thread submits with its next wait, other threads must not leave the change queued */
+	if (sq_pending_ > 0 && std::this_thread::get_id() != thread_id_) {
+		Submit();
+	}
+#endif
+}
+
+void IoUringTaskScheduler::RemoveChannel(ChannelPtr& channel)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+#if defined(__linux) || defined(__linux__)
+	int fd = channel->GetSocket();
+	auto iter = channels_.find(fd);
+	if (iter != channels_.end()) {
+		RemovePoll(fd, iter->second);
+		channels_.erase(iter);
+
+		if (sq_pending_ > 0 && std::this_thread::get_id() != thread_id_) {
+			Submit();
+		}
+	}
+#endif
+}
+
+bool IoUringTaskScheduler::HandleEvent(int timeout)
+{
+#if defined(__linux) || defined(__linux__)
+	if (ring_fd_ < 0) {
+		return false;
+	}
+
+	std::unique_lock<std::mutex> locker(mutex_);
+	thread_id_ = std::this_thread::get_id();
+	if (timeout >= 0) {
+		AddTimeout(timeout);
+	}
+
+	/* queued interest changes and the timeout go in with the wait,
+	   completions already waiting must not block it */
+	uint32_t to_submit = sq_pending_;
+	uint32_t min_complete = (*cq_head_ == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) ? 1 : 0;
+	sq_pending_ = 0;
+
+	locker.unlock();
+	int ret = io_uring_enter(ring_fd_, to_submit, min_complete, IORING_ENTER_GETEVENTS);
+	locker.lock();
+
+	if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+		return false;
+	}
+
+	uint32_t head = *cq_head_;
+	uint32_t tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+	uint32_t num_events = 0;
+
+	for (; head != tail && num_events < kMaxEvents; head++, num_events++) {
+		struct io_uring_cqe* cqe = &cqes_[head & cq_mask_];
+		uint64_t user_data = cqe->user_data;
+		int res = cqe->res;
+
+		if (user_data & kTimeoutUserData) {
+			if ((user_data & ~kTimeoutUserData) == timeout_seq_) {
+				timeout_deadline_ = -1;
+			}
+			continue;
+		}
+
+		if (user_data == kIgnoreUserData) {
+			continue;
+		}
+
+		/* completions of a poll that was removed or replaced carry an old generation */
+		int fd = (int)(uint32_t)user_data;
+		auto iter = channels_.find(fd);
+		if (iter == channels_.end() || MakeUserData(fd, iter->second.generation) != user_data) {
+			continue;
+		}
+
+		ChannelData& data = iter->second;
+		if (res < 0 && res != -ECANCELED) {
+			active_channels_.emplace_back(data.channel, EVENT_ERR);
+			continue;
+		}
+
+		if (res > 0) {
+			active_channels_.emplace_back(data.channel, res);
+		}
+
+		rearm_polls_.emplace_back(fd, data.generation);
+	}
+
+	__atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+	locker.unlock();
+
+	for (auto& iter : active_channels_) {
+		iter.first->HandleEvent(iter.second);
+	}
+	active_channels_.clear();
+
+	/* re-armed only now, so whatever the handler left unread fires again;
+	   a channel updated or removed meanwhile already has its new poll */
+	locker.lock();
+	for (auto& poll : rearm_polls_) {
+		auto iter = channels_.find(poll.first);
+		if (iter != channels_.end() && iter->second.generation == poll.second) {
+			AddPoll(poll.first, iter->second);
+		}
+	}
+	rearm_polls_.clear();
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool IoUringTaskScheduler::PushSqe(const io_uring_sqe& sqe)
+{
+#if defined(__linux) || defined(__linux__)
+	uint32_t head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+	uint32_t tail = *sq_tail_;
+	if (tail - head >= sq_entries_) {
+		Submit();
+		head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+		if (tail - head >= sq_entries_) {
+			return false;
+		}
+	}
+
+	/* the entry must be complete before the tail makes it visible to a concurrent io_uring_enter */
+	uint32_t index = tail & sq_mask_;
+	memcpy(&sqes_[index], &sqe, sizeof(sqe));
+	sq_array_[index] = index;
+	__atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+	sq_pending_++;
+	return true;
+#else
+	return false;
+#endif
+}
+
+void IoUringTaskScheduler::AddPoll(int fd, ChannelData& data)
+{
+#if defined(__linux) || defined(__linux__)
+	struct io_uring_sqe sqe;
+	memset(&sqe, 0, sizeof(sqe));
+
+	data.generation = (++generation_) & 0x3fffffff;
+	data.events = (uint32_t)data.channel->GetEvents();
+
+	sqe.opcode = IORING_OP_POLL_ADD;
+	sqe.fd = fd;
+	sqe.poll32_events = data.events;
+	sqe.user_data = MakeUserData(fd, data.generation);
+
+	PushSqe(sqe);
+#endif
+}
+
+void IoUringTaskScheduler::RemovePoll(int fd, ChannelData& data)
+{
+#if defined(__linux) || defined(__linux__)
+	struct io_uring_sqe sqe;
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_POLL_REMOVE;
+	sqe.fd = -1;
+	sqe.addr = MakeUserData(fd, data.generation);
+	sqe.user_data = kIgnoreUserData;
+
+	PushSqe(sqe);
+#endif
+}
+
+void IoUringTaskScheduler::AddTimeout(int timeout)
+{
+#if defined(__linux) || defined(__linux__)
+	/* a timeout that is still pending and due no later can be reused */
+	auto time_point = std::chrono::steady_clock::now();
+	int64_t deadline = std::chrono::duration_cast<std::chrono::milliseconds>(time_point.time_since_epoch()).count() + timeout;
+	if (timeout_deadline_ >= 0 && timeout_deadline_ <= deadline) {
+		return;
+	}
+
+	timeout_spec_.tv_sec = timeout / 1000;
+	timeout_spec_.tv_nsec = (long long)(timeout % 1000) * 1000000;
+	timeout_deadline_ = deadline;
+	timeout_seq_++;
+
+	struct io_uring_sqe sqe;
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_TIMEOUT;
+	sqe.fd = -1;
+	sqe.addr = (uint64_t)(uintptr_t)&timeout_spec_;
+	sqe.len = 1;
+	sqe.user_data = kTimeoutUserData | timeout_seq_;
+
+	PushSqe(sqe);
+#endif
+}
+
+int IoUringTaskScheduler::Submit()
+{
+#if defined(__linux) || defined(__linux__)
+	uint32_t to_submit = sq_pending_;
+	sq_pending_ = 0;
+	return (to_submit > 0) ? io_uring_enter(ring_fd_, to_submit, 0, 0) : 0;
+#else
+	return -1;
+#endif
+}
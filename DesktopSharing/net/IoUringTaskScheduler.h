@@ -0,0 +1,100 @@
+#ifndef XOP_IO_URING_TASK_SCHEDULER_H
+#define XOP_IO_URING_TASK_SCHEDULER_H
+
+#include "TaskScheduler.h"
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace xop
+{
+
+/* Readiness scheduler on top of io_uring, Linux 5.4 and later.
+ * Channels are watched with one-shot poll requests that are re-armed after
+ * their handler has run, so a socket with unread data fires again just like
+ * with level-triggered epoll. Re-arms, interest changes and the wait timeout
+ * are queued as SQEs and go to the kernel with the io_uring_enter that waits
+ * for completions, instead of one epoll_ctl per EVENT_OUT toggle.
+ * Socket I/O itself stays with the connections, only readiness goes through
+ * the ring: there is no multishot recv, no linked sends and no registered
+ * buffers. Each dispatched channel costs one re-arm SQE, so this is not faster
+ * than epoll under many busy sockets (bench/bench_event_loop.cpp) and stays
+ * opt-in. */
+class IoUringTaskScheduler : public TaskScheduler
+{
+public:
+	IoUringTaskScheduler(int id = 0);
+	virtual ~IoUringTaskScheduler();
+
+	/* false when the kernel is too old, io_uring is disabled or filtered by seccomp */
+	static bool IsSupported();
+
+	void UpdateChannel(ChannelPtr channel);
+	void RemoveChannel(ChannelPtr& channel);
+
+	// timeout: ms
+	bool HandleEvent(int timeout);
+
+private:
+	struct ChannelData
+	{
+		ChannelPtr channel;
+		uint32_t events = 0;
+		uint32_t generation = 0;
+	};
+
+	bool Setup();
+	void Release();
+
+	bool PushSqe(const io_uring_sqe& sqe);
+	void AddPoll(int fd, ChannelData& data);
+	void RemovePoll(int fd, ChannelData& data);
+	void AddTimeout(int timeout);
+	int  Submit();
+
+	static uint64_t MakeUserData(int fd, uint32_t generation)
+	{ return ((uint64_t)generation << 32) | (uint32_t)fd; }
+
+	int ring_fd_ = -1;
+	void* ring_ptr_ = nullptr;
+	size_t ring_size_ = 0;
+	void* sqes_ptr_ = nullptr;
+	size_t sqes_size_ = 0;
+
+	uint32_t* sq_head_ = nullptr;
+	uint32_t* sq_tail_ = nullptr;
+	uint32_t* sq_array_ = nullptr;
+	uint32_t sq_mask_ = 0;
+	uint32_t sq_entries_ = 0;
+	uint32_t sq_pending_ = 0;
+	io_uring_sqe* sqes_ = nullptr;
+
+	uint32_t* cq_head_ = nullptr;
+	uint32_t* cq_tail_ = nullptr;
+	uint32_t cq_mask_ = 0;
+	io_uring_cqe* cqes_ = nullptr;
+
+	uint32_t generation_ = 0;
+	uint64_t timeout_seq_ = 0;
+	int64_t timeout_deadline_ = -1;
+	struct Timespec { int64_t tv_sec; long long tv_nsec; } timeout_spec_;
+
+	std::thread::id thread_id_;
+	std::mutex mutex_;
+	std::unordered_map<int, ChannelData> channels_;
+	std::vector<std::pair<ChannelPtr, int>> active_channels_;
+	std::vector<std::pair<int, uint32_t>> rearm_polls_;  /* fd, generation of the poll that fired */
+
+	static const uint32_t kRingEntries = 1024;
+	static const uint32_t kMaxEvents = 512;
+	static const uint64_t kTimeoutUserData = 1ULL << 63;
+	static const uint64_t kIgnoreUserData = kTimeoutUserData - 1;
+};
+
+}
+
+#endif
@@ -1,18 +1,20 @@
 // PHZ
 // 2018-5-15
 
-#if defined(WIN32) || defined(_WIN32) 
+#if defined(WIN32) || defined(_WIN32)
 #ifndef _CRT_SECURE_NO_WARNINGS
 #define _CRT_SECURE_NO_WARNINGS
 #endif
 #endif
 
 #include "Logger.h"
-#include "Timestamp.h"
-#include <stdarg.h>
+#include <chrono>
+#include <ctime>
+#include <algorithm>
 #include <iostream>
 
 using namespace xop;
+using namespace std::chrono;
 
 const char* Priority_To_String[] =
 {
@@ -23,9 +25,48 @@ const char* Priority_To_String[] =
 	"ERROR"
 };
 
-Logger::Logger() 
+/* Single-producer ring owned by one thread, drained by the writer thread. */
+class xop::LogRing
 {
-    
+public:
+	static const uint32_t kNumRecords = 512;
+
+	LogRecord records[kNumRecords];
+	char pad0[64];
+	std::atomic<uint32_t> head{ 0 };
+	char pad1[64];
+	std::atomic<uint32_t> tail{ 0 };
+	std::atomic_bool is_orphan{ false };
+};
+
+namespace
+{
+
+/* marks the ring orphan when its thread exits, the writer frees it once drained */
+struct ThreadRing
+{
+	~ThreadRing()
+	{
+		if (ring) {
+			ring->is_orphan = true;
+		}
+	}
+
+	std::shared_ptr<LogRing> ring;
+};
+
+thread_local ThreadRing t_thread_ring;
+
+}
+
+Logger::Logger()
+	: is_running_(true)
+	, level_(XOP_LOG_LEVEL)
+	, dropped_records_(0)
+	, flush_requests_(0)
+	, flush_done_(0)
+{
+	writer_.reset(new std::thread(&Logger::WriterThread, this));
 }
 
 Logger& Logger::Instance()
@@ -36,12 +77,15 @@ Logger& Logger::Instance()
 
 Logger::~Logger()
 {
-
+	is_running_ = false;
+	if (writer_ && writer_->joinable()) {
+		writer_->join();
+	}
 }
 
 void Logger::Init(char *pathname)
 {
-	std::unique_lock<std::mutex> lock(mutex_);
+	std::unique_lock<std::mutex> lock(file_mutex_);
 
 	if (pathname != nullptr) {
 		ofs_.open(pathname, std::ios::out | std::ios::binary);
@@ -54,46 +98,160 @@ void Logger::Init(char *pathname)
 
 void Logger::Exit()
 {
-	std::unique_lock<std::mutex> lock(mutex_);
+	Flush();
 
+	std::unique_lock<std::mutex> lock(file_mutex_);
 	if (ofs_.is_open()) {
 		ofs_.close();
 	}
 }
 
-void Logger::Log(Priority priority, const char* __file, const char* __func, int __line, const char *fmt, ...)
-{	
-	std::unique_lock<std::mutex> lock(mutex_);
-
-	char buf[2048] = {0};
-	sprintf(buf, "[%s][%s:%s:%d] ", Priority_To_String[priority],  __file, __func, __line);
-	va_list args;
-	va_start(args, fmt);
-	vsprintf(buf + strlen(buf), fmt, args);
-	va_end(args);
-	this->Write(std::string(buf));
+void Logger::Flush()
+{
+	if (!is_running_ || (writer_ && writer_->get_id() == std::this_thread::get_id())) {
+		return;
+	}
+
+	uint64_t request = ++flush_requests_;
+	while (flush_done_ < request && is_running_) {
+		std::this_thread::sleep_for(milliseconds(1));
+	}
 }
 
-void Logger::Log2(Priority priority, const char *fmt, ...)
+LogRing* Logger::GetThreadRing()
 {
-	std::unique_lock<std::mutex> lock(mutex_);
+	if (!t_thread_ring.ring) {
+		t_thread_ring.ring = std::make_shared<LogRing>();
+		std::lock_guard<std::mutex> lock(mutex_);
+		rings_.push_back(t_thread_ring.ring);
+	}
 
-	char buf[4096] = { 0 };
-	sprintf(buf, "[%s] ", Priority_To_String[priority]);  
-	va_list args;
-	va_start(args, fmt);
-	vsprintf(buf + strlen(buf), fmt, args);
-	va_end(args);
-	this->Write(std::string(buf));
+	return t_thread_ring.ring.get();
 }
 
-void Logger::Write(std::string info)
+LogRecord* Logger::BeginRecord(Priority priority, const char* file, const char* func, int line, const char* fmt)
 {
-	if (ofs_.is_open()) {
-		ofs_ << "[" << Timestamp::Localtime() << "]"
-			<< info << std::endl;
+	LogRing* ring = GetThreadRing();
+	uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+	if (tail - ring->head.load(std::memory_order_acquire) >= LogRing::kNumRecords) {
+		dropped_records_++; /* the event loop must never wait for the writer */
+		return nullptr;
+	}
+
+	LogRecord* record = &ring->records[tail % LogRing::kNumRecords];
+	record->time = duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
+	record->file = file;
+	record->func = func;
+	record->line = line;
+	record->fmt = fmt;
+	record->priority = priority;
+	return record;
+}
+
+void Logger::EndRecord()
+{
+	LogRing* ring = t_thread_ring.ring.get();
+	ring->tail.store(ring->tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void Logger::WriterThread()
+{
+	while (is_running_) {
+		uint64_t request = flush_requests_;
+		uint32_t num_records = Drain();
+		flush_done_ = request;
+
+		if (num_records == 0) {
+			std::this_thread::sleep_for(milliseconds(5));
+		}
 	}
-   
-	std::cout << "[" << Timestamp::Localtime() << "]"
-			<< info << std::endl;
+
+	Drain();
+}
+
+uint32_t Logger::Drain()
+{
+	std::vector<std::shared_ptr<LogRing>> rings;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		rings = rings_;
+	}
+
+	std::vector<std::pair<LogRing*, uint32_t>> tails;
+	pending_.clear();
+	for (auto& ring : rings) {
+		uint32_t head = ring->head.load(std::memory_order_relaxed);
+		uint32_t tail = ring->tail.load(std::memory_order_acquire);
+		for (uint32_t n = head; n != tail; n++) {
+			pending_.push_back(&ring->records[n % LogRing::kNumRecords]);
+		}
+		tails.emplace_back(ring.get(), tail);
+	}
+
+	/* rings are per thread, merge them back into time order */
+	std::stable_sort(pending_.begin(), pending_.end(), [](const LogRecord* a, const LogRecord* b) {
+		return a->time < b->time;
+	});
+
+	out_.clear();
+	for (auto record : pending_) {
+		Write(*record);
+	}
+
+	if (!out_.empty()) {
+		std::lock_guard<std::mutex> lock(file_mutex_);
+		if (ofs_.is_open()) {
+			ofs_.write(out_.data(), out_.size());
+			ofs_.flush();
+		}
+		std::cout.write(out_.data(), out_.size());
+		std::cout.flush();
+	}
+
+	for (auto& iter : tails) {
+		iter.first->head.store(iter.second, std::memory_order_release);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		rings_.erase(std::remove_if(rings_.begin(), rings_.end(), [](const std::shared_ptr<LogRing>& ring) {
+			return ring->is_orphan && ring->head.load() == ring->tail.load();
+		}), rings_.end());
+	}
+
+	return (uint32_t)pending_.size();
+}
+
+void Logger::Write(const LogRecord& record)
+{
+	char buf[4096] = { 0 };
+	int len = 0;
+
+	time_t tt = (time_t)(record.time / 1000000);
+	struct tm tm;
+#if defined(WIN32) || defined(_WIN32)
+	localtime_s(&tm, &tt);
+#else
+	localtime_r(&tt, &tm);
+#endif
+	len += (int)strftime(buf, sizeof(buf), "[%F %T]", &tm);
+
+	if (record.file != nullptr) {
+		len += snprintf(buf + len, sizeof(buf) - len, "[%s][%s:%s:%d] ",
+			Priority_To_String[record.priority], record.file, record.func, record.line);
+	}
+	else {
+		len += snprintf(buf + len, sizeof(buf) - len, "[%s] ", Priority_To_String[record.priority]);
+	}
+
+	int size = record.format(buf + len, sizeof(buf) - len - 1, record.fmt, record.args);
+	if (size > 0) {
+		len = std::min(len + size, (int)sizeof(buf) - 2);
+	}
+
+	if (len > 0 && buf[len - 1] != '\n') {
+		buf[len++] = '\n';
+	}
+
+	out_.append(buf, len);
 }
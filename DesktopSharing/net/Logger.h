@@ -7,50 +7,244 @@
 #include <string>
 #include <mutex>
 #include <thread>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <tuple>
+#include <utility>
 #include <fstream>
+#include <cstdio>
 #include <cstring>
-#include <iostream>
-#include <sstream>
+#include <cstdint>
+#include <type_traits>
 
 namespace xop {
 
 
-enum Priority 
+enum Priority
 {
     LOG_DEBUG, LOG_STATE, LOG_INFO, LOG_WARNING, LOG_ERROR,
-};	
-	
+};
+
+/* Lowest priority compiled in, calls below it are removed by the compiler. */
+#ifndef XOP_LOG_LEVEL
+#ifdef _DEBUG
+#define XOP_LOG_LEVEL 0
+#else
+#define XOP_LOG_LEVEL 2
+#endif
+#endif
+
+class LogRing;
+
+/* One log call, formatted later by the writer thread. Arguments are stored by value,
+   strings are copied in, the format string and file/func must be literals. */
+struct LogRecord
+{
+	typedef int (*Formatter)(char* buf, size_t size, const char* fmt, const char* args);
+
+	int64_t time = 0;
+	const char* file = nullptr;
+	const char* func = nullptr;
+	const char* fmt = nullptr;
+	Formatter format = nullptr;
+	int line = 0;
+	int priority = 0;
+
+	static const size_t kMaxArgsSize = 200;
+	char args[kMaxArgsSize];
+};
+
+namespace log_detail {
+
+template <typename T>
+struct ArgTraits
+{
+	static_assert(std::is_trivially_copyable<T>::value, "log arguments must be plain values or C strings");
+	typedef T Type;
+	static const size_t kFixedSize = sizeof(T);
+
+	static void Encode(char*& data, size_t&, const T& value)
+	{
+		memcpy(data, &value, sizeof(T));
+		data += sizeof(T);
+	}
+
+	static T Decode(const char*& data)
+	{
+		T value;
+		memcpy(&value, data, sizeof(T));
+		data += sizeof(T);
+		return value;
+	}
+};
+
+/* strings: uint16 length + bytes + '\0', truncated to the space the other arguments leave */
+template <>
+struct ArgTraits<const char*>
+{
+	typedef const char* Type;
+	static const size_t kFixedSize = sizeof(uint16_t) + 1;
+
+	static void Encode(char*& data, size_t& space, const char* value)
+	{
+		if (value == nullptr) {
+			value = "(null)";
+		}
+
+		size_t len = strlen(value);
+		if (len > space) {
+			len = space;
+		}
+		space -= len;
+
+		uint16_t size = (uint16_t)len;
+		memcpy(data, &size, sizeof(size));
+		memcpy(data + sizeof(size), value, len);
+		data[sizeof(size) + len] = '\0';
+		data += sizeof(size) + len + 1;
+	}
+
+	static const char* Decode(const char*& data)
+	{
+		uint16_t size = 0;
+		memcpy(&size, data, sizeof(size));
+		const char* value = data + sizeof(size);
+		data += sizeof(size) + size + 1;
+		return value;
+	}
+};
+
+template <>
+struct ArgTraits<char*> : ArgTraits<const char*> { };
+
+template <typename T>
+using ArgType = typename std::conditional<std::is_array<typename std::decay<T>::type>::value || std::is_array<T>::value,
+	const char*, typename std::decay<T>::type>::type;
+
+template <typename... Args>
+struct FixedSize;
+
+template <>
+struct FixedSize<>
+{ static const size_t value = 0; };
+
+template <typename T, typename... Args>
+struct FixedSize<T, Args...>
+{ static const size_t value = ArgTraits<T>::kFixedSize + FixedSize<Args...>::value; };
+
+inline void EncodeArgs(char*&, size_t&)
+{ }
+
+template <typename T, typename... Args>
+inline void EncodeArgs(char*& data, size_t& space, const T& value, const Args&... args)
+{
+	ArgTraits<ArgType<T>>::Encode(data, space, value);
+	EncodeArgs(data, space, args...);
+}
+
+template <typename Tuple, size_t... I>
+inline int FormatTuple(char* buf, size_t size, const char* fmt, const Tuple& values, std::index_sequence<I...>)
+{
+	return snprintf(buf, size, fmt, std::get<I>(values)...);
+}
+
+template <typename... Args>
+int Format(char* buf, size_t size, const char* fmt, const char* data)
+{
+	/* braced initialisation decodes the arguments left to right */
+	std::tuple<typename ArgTraits<Args>::Type...> values{ ArgTraits<Args>::Decode(data)... };
+	(void)data;
+	return FormatTuple(buf, size, fmt, values, std::index_sequence_for<Args...>());
+}
+
+}
+
 class Logger
 {
 public:
 	Logger &operator=(const Logger &) = delete;
-	Logger(const Logger &) = delete;	
+	Logger(const Logger &) = delete;
 	static Logger& Instance();
 	~Logger();
 
 	void Init(char *pathname = nullptr);
 	void Exit();
 
-	void Log(Priority priority, const char* __file, const char* __func, int __line, const char *fmt, ...);
-	void Log2(Priority priority, const char *fmt, ...);
+	void SetLevel(Priority priority)
+	{ level_ = priority; }
+
+	bool IsEnabled(Priority priority) const
+	{ return priority >= level_.load(std::memory_order_relaxed); }
+
+	/* Records that did not fit in the calling thread's ring. */
+	uint64_t GetDroppedRecords() const
+	{ return dropped_records_; }
+
+	/* Never blocks and never formats: the call copies its arguments into the calling
+	   thread's ring, the writer thread formats and writes them. */
+	template <typename... Args>
+	void Log(Priority priority, const char* __file, const char* __func, int __line, const char *fmt, const Args&... args)
+	{
+		static_assert(log_detail::FixedSize<log_detail::ArgType<Args>...>::value <= LogRecord::kMaxArgsSize, "too many log arguments");
+
+		LogRecord* record = BeginRecord(priority, __file, __func, __line, fmt);
+		if (record != nullptr) {
+			char* data = record->args;
+			size_t space = LogRecord::kMaxArgsSize - log_detail::FixedSize<log_detail::ArgType<Args>...>::value;
+			log_detail::EncodeArgs(data, space, args...);
+			record->format = &log_detail::Format<log_detail::ArgType<Args>...>;
+			EndRecord();
+		}
+	}
+
+	template <typename... Args>
+	void Log2(Priority priority, const char *fmt, const Args&... args)
+	{
+		Log(priority, nullptr, nullptr, 0, fmt, args...);
+	}
+
+	/* Blocks until everything logged so far has been written. */
+	void Flush();
 
 private:
-	void Write(std::string buf);
 	Logger();
 
+	LogRecord* BeginRecord(Priority priority, const char* file, const char* func, int line, const char* fmt);
+	void EndRecord();
+
+	LogRing* GetThreadRing();
+	void WriterThread();
+	uint32_t Drain();
+	void Write(const LogRecord& record);
+
 	std::mutex mutex_;
+	std::vector<std::shared_ptr<LogRing>> rings_;
+	std::unique_ptr<std::thread> writer_;
+	std::atomic_bool is_running_;
+	std::atomic<int> level_;
+	std::atomic<uint64_t> dropped_records_;
+	std::atomic<uint64_t> flush_requests_;
+	std::atomic<uint64_t> flush_done_;
+
+	std::mutex file_mutex_;
 	std::ofstream ofs_;
+	std::vector<LogRecord*> pending_;
+	std::string out_;
 };
- 
+
 }
 
-#ifdef _DEBUG
-#define LOG_DEBUG(fmt, ...) xop::Logger::Instance().Log(LOG_DEBUG, __FILE__, __FUNCTION__,__LINE__, fmt, ##__VA_ARGS__)
-#else
-#define LOG_DEBUG(fmt, ...)
-#endif
-#define LOG_INFO(fmt, ...) xop::Logger::Instance().Log2(LOG_INFO, fmt, ##__VA_ARGS__)
-#define LOG_ERROR(fmt, ...) xop::Logger::Instance().Log(LOG_ERROR, __FILE__, __FUNCTION__,__LINE__, fmt, ##__VA_ARGS__)
+#define XOP_LOG(priority, ...) \
+	do { \
+		if ((priority) >= XOP_LOG_LEVEL && xop::Logger::Instance().IsEnabled(priority)) { \
+			xop::Logger::Instance().__VA_ARGS__; \
+		} \
+	} while (0)
+
+#define LOG_DEBUG(fmt, ...) XOP_LOG(xop::LOG_DEBUG, Log(xop::LOG_DEBUG, __FILE__, __FUNCTION__,__LINE__, fmt, ##__VA_ARGS__))
+#define LOG_INFO(fmt, ...) XOP_LOG(xop::LOG_INFO, Log2(xop::LOG_INFO, fmt, ##__VA_ARGS__))
+#define LOG_ERROR(fmt, ...) XOP_LOG(xop::LOG_ERROR, Log(xop::LOG_ERROR, __FILE__, __FUNCTION__,__LINE__, fmt, ##__VA_ARGS__))
 
 #endif
 
@@ -2,6 +2,33 @@
 
 using namespace xop;
 
+namespace
+{
+
+/* Per-thread free lists, handed back to their pools when the thread exits. */
+struct ThreadCache
+{
+	MemoryBlock* blocks[MemoryManager::kMaxMemoryPool] = { nullptr };
+	uint32_t counts[MemoryManager::kMaxMemoryPool] = { 0 };
+
+	~ThreadCache()
+	{
+		for (int n = 0; n < MemoryManager::kMaxMemoryPool; n++) {
+			if (blocks[n] != nullptr) {
+				MemoryBlock* tail = blocks[n];
+				while (tail->next != nullptr) {
+					tail = tail->next;
+				}
+				tail->pool->Release(blocks[n], tail);
+			}
+		}
+	}
+};
+
+thread_local ThreadCache t_cache;
+
+}
+
 void* xop::Alloc(uint32_t size)
 {
 	return MemoryManager::Instance().Alloc(size);
@@ -13,71 +40,195 @@ void xop::Free(void *ptr)
 }
 
 MemoryPool::MemoryPool()
+	: free_list_(nullptr)
+	, num_blocks_(0)
+	, in_use_(0)
+	, high_water_(0)
+	, hits_(0)
+	, misses_(0)
 {
 
 }
 
 MemoryPool::~MemoryPool()
 {
-	if (memory_) {
-		free(memory_);
+	for (auto slab : slabs_) {
+		free(slab);
 	}
 }
 
-void MemoryPool::Init(uint32_t size, uint32_t n)
+void MemoryPool::Init(uint32_t size, uint32_t max_blocks, uint32_t index)
 {
-	if (memory_) {
-		return;
+	block_size_ = size;
+	max_blocks_ = max_blocks;
+	index_ = index;
+
+	/* about 256K per thread cache, between 2 and 256 blocks */
+	cache_limit_ = (256 * 1024) / size;
+	if (cache_limit_ < 2) {
+		cache_limit_ = 2;
+	}
+	if (cache_limit_ > 256) {
+		cache_limit_ = 256;
 	}
+	batch_size_ = cache_limit_ / 2;
+}
 
-	block_size_ = size;
-	num_blocks_ = n;
-	memory_ = (char*)malloc(num_blocks_ * (block_size_ + sizeof(MemoryBlock)));
-	head_ = (MemoryBlock*)memory_;
-	head_->block_id = 1;
-	head_->pool = this;
-	head_->next = nullptr;
+bool MemoryPool::Grow()
+{
+	std::lock_guard<std::mutex> locker(mutex_);
+
+	uint32_t num_blocks = num_blocks_.load();
+	if (num_blocks >= max_blocks_) {
+		return false;
+	}
 
-	MemoryBlock* current = head_;
-	for (uint32_t n = 1; n < num_blocks_; n++) {
-		MemoryBlock* next = (MemoryBlock*)(memory_ + (n * (block_size_ + sizeof(MemoryBlock))));
-		next->block_id = n + 1;
-		next->pool = this;
-		next->next = nullptr;
+	/* carve about 256K per slab, at least one block */
+	uint32_t count = (256 * 1024) / (block_size_ + sizeof(MemoryBlock));
+	if (count == 0) {
+		count = 1;
+	}
+	if (count > max_blocks_ - num_blocks) {
+		count = max_blocks_ - num_blocks;
+	}
+
+	size_t stride = block_size_ + sizeof(MemoryBlock);
+	char* slab = (char*)malloc(count * stride);
+	if (slab == nullptr) {
+		return false;
+	}
+	slabs_.push_back(slab);
 
-		current->next = next;
-		current = next;
+	MemoryBlock* head = nullptr;
+	MemoryBlock* tail = nullptr;
+	for (uint32_t n = count; n > 0; n--) {
+		MemoryBlock* block = (MemoryBlock*)(slab + (n - 1) * stride);
+		block->pool = this;
+		block->next = head;
+		head = block;
+		if (tail == nullptr) {
+			tail = block;
+		}
 	}
+
+	num_blocks_ += count;
+	Release(head, tail);
+	return true;
 }
 
-void* MemoryPool::Alloc(uint32_t size)
+MemoryBlock* MemoryPool::Acquire(uint32_t max_count, uint32_t& count)
 {
+	/* Pushers only ever swap the top, and with a single popper the blocks
+	   below it cannot be taken and pushed back behind our back (no ABA). */
 	std::lock_guard<std::mutex> locker(mutex_);
-	if (head_ != nullptr) {
-		MemoryBlock* block = head_;
-		head_ = head_->next;
-		return ((char*)block + sizeof(MemoryBlock));
+
+	MemoryBlock* top = free_list_.load(std::memory_order_acquire);
+	MemoryBlock* last = nullptr;
+	do {
+		if (top == nullptr) {
+			count = 0;
+			return nullptr;
+		}
+
+		last = top;
+		count = 1;
+		while (count < max_count && last->next != nullptr) {
+			last = last->next;
+			count++;
+		}
+	} while (!free_list_.compare_exchange_weak(top, last->next, std::memory_order_acquire, std::memory_order_acquire));
+
+	last->next = nullptr;
+	return top;
+}
+
+void* MemoryPool::Alloc(uint32_t size)
+{
+	MemoryBlock*& cache = t_cache.blocks[index_];
+	uint32_t& count = t_cache.counts[index_];
+
+	if (cache == nullptr) {
+		cache = Acquire(batch_size_, count);
+		if (cache != nullptr) {
+			hits_++;
+		}
+		else {
+			if (!Grow()) {
+				return nullptr;
+			}
+			misses_++;
+
+			cache = Acquire(batch_size_, count);
+			if (cache == nullptr) {
+				return nullptr;
+			}
+		}
+	}
+	else {
+		hits_++;
 	}
 
-	return nullptr;
+	MemoryBlock* block = cache;
+	cache = block->next;
+	block->next = nullptr;
+	count--;
+
+	uint32_t in_use = ++in_use_;
+	uint32_t high_water = high_water_.load(std::memory_order_relaxed);
+	while (in_use > high_water && !high_water_.compare_exchange_weak(high_water, in_use)) { }
+
+	return ((char*)block + sizeof(MemoryBlock));
 }
 
 void MemoryPool::Free(void* ptr)
 {
 	MemoryBlock *block = (MemoryBlock*)((char*)ptr - sizeof(MemoryBlock));
-	if (block->block_id != 0) {
-		std::lock_guard<std::mutex> locker(mutex_);
-		block->next = head_;
-		head_ = block;
+	in_use_--;
+
+	MemoryBlock*& cache = t_cache.blocks[index_];
+	uint32_t& count = t_cache.counts[index_];
+	if (count < cache_limit_) {
+		block->next = cache;
+		cache = block;
+		count++;
 	}
+	else {
+		Release(block, block);
+	}
+}
+
+void MemoryPool::Release(MemoryBlock* head, MemoryBlock* tail)
+{
+	/* lock-free push, pops are serialized in Acquire */
+	MemoryBlock* top = free_list_.load(std::memory_order_relaxed);
+	do {
+		tail->next = top;
+	} while (!free_list_.compare_exchange_weak(top, head, std::memory_order_release, std::memory_order_relaxed));
+}
+
+MemoryPoolStats MemoryPool::GetStats() const
+{
+	MemoryPoolStats stats;
+	stats.block_size = block_size_;
+	stats.num_blocks = num_blocks_.load();
+	stats.in_use = in_use_.load();
+	stats.high_water = high_water_.load();
+	stats.hits = hits_.load();
+	stats.misses = misses_.load();
+	return stats;
 }
 
 MemoryManager::MemoryManager()
 {
-	memory_pools_[0].Init(4096, 50);
-	memory_pools_[1].Init(40960, 10);
-	memory_pools_[2].Init(102400, 5);
-	//memory_pools_[3].Init(204800, 2);
+	/* RtpPacket and shared_ptr control blocks go to the small classes, AVFrame to the large ones */
+	memory_pools_[0].Init(64, 16384, 0);
+	memory_pools_[1].Init(256, 4096, 1);
+	memory_pools_[2].Init(2048, 8192, 2);
+	memory_pools_[3].Init(16384, 512, 3);
+	memory_pools_[4].Init(65536, 256, 4);
+	memory_pools_[5].Init(262144, 64, 5);
+	memory_pools_[6].Init(1048576, 16, 6);
+	memory_pools_[7].Init(4194304, 4, 7);
 }
 
 MemoryManager::~MemoryManager()
@@ -87,8 +238,9 @@ MemoryManager::~MemoryManager()
 
 MemoryManager& MemoryManager::Instance()
 {
-	static MemoryManager s_mgr;
-	return s_mgr;
+	/* never destroyed, buffers may still be released by static objects at exit */
+	static MemoryManager* s_mgr = new MemoryManager;
+	return *s_mgr;
 }
 
 void* MemoryManager::Alloc(uint32_t size)
@@ -100,13 +252,13 @@ void* MemoryManager::Alloc(uint32_t size)
 				return ptr;
 			}				
 			else {
+				memory_pools_[n].misses_++;
 				break;
 			}
 		}
 	} 
 
 	MemoryBlock *block = (MemoryBlock*)malloc(size + sizeof(MemoryBlock));
-	block->block_id = 0;
 	block->pool = nullptr;
 	block->next = nullptr;
 	return ((char*)block + sizeof(MemoryBlock));
@@ -114,13 +266,26 @@ void* MemoryManager::Alloc(uint32_t size)
 
 void MemoryManager::Free(void* ptr)
 {
+	if (ptr == nullptr) {
+		return;
+	}
+
 	MemoryBlock *block = (MemoryBlock*)((char*)ptr - sizeof(MemoryBlock));
 	MemoryPool *pool = block->pool;
 	
-	if (pool != nullptr && block->block_id > 0) {
+	if (pool != nullptr) {
 		pool->Free(ptr);
 	}
 	else {
 		::free(block);
 	}
 }
+
+std::vector<MemoryPoolStats> MemoryManager::GetStats() const
+{
+	std::vector<MemoryPoolStats> stats;
+	for (int n = 0; n < kMaxMemoryPool; n++) {
+		stats.push_back(memory_pools_[n].GetStats());
+	}
+	return stats;
+}
@@ -4,7 +4,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <cstddef>
 #include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
 
 namespace xop
 {
@@ -16,30 +20,63 @@ class MemoryPool;
 
 struct MemoryBlock
 {
-	uint32_t block_id = 0;
-	MemoryPool *pool = nullptr;
+	MemoryPool *pool = nullptr;  /* nullptr: allocated by malloc */
 	MemoryBlock *next = nullptr;
 };
 
+struct MemoryPoolStats
+{
+	uint32_t block_size = 0;
+	uint32_t num_blocks = 0;  /* blocks carved from slabs so far */
+	uint32_t in_use = 0;
+	uint32_t high_water = 0;
+	uint64_t hits = 0;        /* served by a recycled block */
+	uint64_t misses = 0;      /* needed a new slab or fell back to malloc */
+};
+
+/* Fixed-size slab pool.
+ * Each thread allocates from a small cached free list and frees into it until
+ * the cache is full, overflow goes to a lock-free shared stack. A thread whose
+ * cache runs dry takes a bounded batch off the shared stack, so blocks freed
+ * by one thread stay available to all the others. Slabs are only carved under
+ * the mutex, on a miss. */
 class MemoryPool
 {
 public:
 	MemoryPool();
 	virtual ~MemoryPool();
 
-	void  Init(uint32_t size, uint32_t n);
+	void  Init(uint32_t size, uint32_t max_blocks, uint32_t index);
 	void* Alloc(uint32_t size);
 	void  Free(void* ptr);
 
 	size_t BolckSize() const
 	{ return block_size_; }
 
-//private:
-	char* memory_ = nullptr;
+	MemoryPoolStats GetStats() const;
+
+	/* Pushes a chain of free blocks back to the shared stack. */
+	void Release(MemoryBlock* head, MemoryBlock* tail);
+
+private:
+	friend class MemoryManager;
+
+	bool Grow();
+	MemoryBlock* Acquire(uint32_t max_count, uint32_t& count);
+
+	uint32_t index_ = 0;
 	uint32_t block_size_ = 0;
-	uint32_t num_blocks_ = 0;
-	MemoryBlock* head_ = nullptr;
-	std::mutex mutex_;
+	uint32_t max_blocks_ = 0;
+	uint32_t cache_limit_ = 0;   /* blocks a thread may keep for itself */
+	uint32_t batch_size_ = 0;    /* blocks taken off the shared stack at once */
+	std::atomic<MemoryBlock*> free_list_;
+	std::atomic<uint32_t> num_blocks_;
+	std::atomic<uint32_t> in_use_;
+	std::atomic<uint32_t> high_water_;
+	std::atomic<uint64_t> hits_;
+	std::atomic<uint64_t> misses_;
+	std::vector<char*> slabs_;
+	std::mutex mutex_;       /* slabs, and one popper at a time on the shared stack */
 };
 
 class MemoryManager
@@ -51,12 +88,46 @@ public:
 	void* Alloc(uint32_t size);
 	void  Free(void* ptr);
 
+	std::vector<MemoryPoolStats> GetStats() const;
+
+	static const int kMaxMemoryPool = 8;
+
 private:
 	MemoryManager();
 
-	static const int kMaxMemoryPool = 3;
 	MemoryPool memory_pools_[kMaxMemoryPool];
 };
 
+/* STL allocator on top of the pools, lets shared_ptr place its control block there too. */
+template <typename T>
+class PoolAllocator
+{
+public:
+	typedef T value_type;
+
+	PoolAllocator() { }
+
+	template <typename U>
+	PoolAllocator(const PoolAllocator<U>&) { }
+
+	T* allocate(std::size_t n)
+	{ return (T*)xop::Alloc((uint32_t)(n * sizeof(T))); }
+
+	void deallocate(T* ptr, std::size_t)
+	{ xop::Free(ptr); }
+};
+
+template <typename T, typename U>
+bool operator==(const PoolAllocator<T>&, const PoolAllocator<U>&) { return true; }
+
+template <typename T, typename U>
+bool operator!=(const PoolAllocator<T>&, const PoolAllocator<U>&) { return false; }
+
+/* Pool-backed buffer for media data, neither the data nor the control block hit the heap. */
+inline std::shared_ptr<uint8_t> AllocShared(uint32_t size)
+{
+	return std::shared_ptr<uint8_t>((uint8_t*)xop::Alloc(size), xop::Free, PoolAllocator<uint8_t>());
+}
+
 }
 #endif
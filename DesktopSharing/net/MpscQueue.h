@@ -0,0 +1,125 @@
+#ifndef XOP_MPSC_QUEUE_H
+#define XOP_MPSC_QUEUE_H
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+namespace xop
+{
+
+/* Bounded lock-free multi-producer/single-consumer queue.
+ * Each cell carries a sequence number, producers claim a slot with one CAS
+ * on the enqueue position, the single consumer never touches shared state
+ * other than the cell it reads. Capacity is rounded up to a power of two. */
+template <typename T>
+class MpscQueue
+{
+public:
+	MpscQueue(uint32_t capacity = 1024)
+	{
+		uint32_t size = 2;
+		while (size < capacity) {
+			size <<= 1;
+		}
+
+		mask_ = size - 1;
+		buffer_.reset(new Cell[size]);
+		for (uint32_t n = 0; n < size; n++) {
+			buffer_[n].sequence.store(n, std::memory_order_relaxed);
+		}
+
+		enqueue_pos_.store(0, std::memory_order_relaxed);
+	}
+
+	MpscQueue(const MpscQueue&) = delete;
+	MpscQueue& operator=(const MpscQueue&) = delete;
+	virtual ~MpscQueue() { }
+
+	bool Push(const T& data)
+	{
+		return PushData(data);
+	}
+
+	bool Push(T&& data)
+	{
+		return PushData(std::move(data));
+	}
+
+	// consumer thread only
+	bool Pop(T& data)
+	{
+		Cell* cell = &buffer_[dequeue_pos_ & mask_];
+		size_t seq = cell->sequence.load(std::memory_order_acquire);
+		if ((intptr_t)seq - (intptr_t)(dequeue_pos_ + 1) < 0) {
+			return false;
+		}
+
+		data = std::move(cell->data);
+		cell->data = T();
+		cell->sequence.store(dequeue_pos_ + mask_ + 1, std::memory_order_release);
+		dequeue_pos_++;
+		return true;
+	}
+
+	// consumer thread only
+	bool IsEmpty() const
+	{
+		const Cell* cell = &buffer_[dequeue_pos_ & mask_];
+		size_t seq = cell->sequence.load(std::memory_order_acquire);
+		return ((intptr_t)seq - (intptr_t)(dequeue_pos_ + 1) < 0);
+	}
+
+	uint32_t Capacity() const
+	{ return (uint32_t)(mask_ + 1); }
+
+private:
+	template <typename F>
+	bool PushData(F&& data)
+	{
+		Cell* cell = nullptr;
+		size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+
+		for (;;) {
+			cell = &buffer_[pos & mask_];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+			if (diff == 0) {
+				if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			}
+			else if (diff < 0) {
+				return false; // full
+			}
+			else {
+				pos = enqueue_pos_.load(std::memory_order_relaxed);
+			}
+		}
+
+		cell->data = std::forward<F>(data);
+		cell->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	struct Cell
+	{
+		std::atomic<size_t> sequence;
+		T data;
+	};
+
+	static const size_t kCacheLineSize = 64;
+
+	std::unique_ptr<Cell[]> buffer_;
+	size_t mask_ = 0;
+	char pad0_[kCacheLineSize];
+	std::atomic<size_t> enqueue_pos_;
+	char pad1_[kCacheLineSize];
+	size_t dequeue_pos_ = 0;
+};
+
+}
+
+#endif
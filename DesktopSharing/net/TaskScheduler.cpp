@@ -8,8 +8,10 @@ using namespace xop;
 TaskScheduler::TaskScheduler(int id)
 	: id_(id)
 	, is_shutdown_(false) 
-	, wakeup_pipe_(new Pipe())
-	, trigger_events_(new xop::RingBuffer<TriggerEvent>(kMaxTriggetEvents))
+	, wakeup_pending_(false)
+	, num_connections_(0)
+	, wakeup_event_(new WakeupEvent())
+	, trigger_events_(new xop::MpscQueue<TriggerEvent>(kMaxTriggetEvents))
 {
 	static std::once_flag flag;
 	std::call_once(flag, [] {
@@ -21,8 +23,8 @@ TaskScheduler::TaskScheduler(int id)
 #endif
 	});
 
-	if (wakeup_pipe_->Create()) {
-		wakeup_channel_.reset(new Channel(wakeup_pipe_->Read()));
+	if (wakeup_event_->Create()) {
+		wakeup_channel_.reset(new Channel(wakeup_event_->GetSocket()));
 		wakeup_channel_->EnableReading();
 		wakeup_channel_->SetReadCallback([this]() { this->Wake(); });		
 	}        
@@ -54,8 +56,7 @@ void TaskScheduler::Start()
 void TaskScheduler::Stop()
 {
 	is_shutdown_ = true;
-	char event = kTriggetEvent;
-	wakeup_pipe_->Write(&event, 1);
+	wakeup_event_->Notify();
 }
 
 TimerId TaskScheduler::AddTimer(TimerEvent timerEvent, uint32_t msec)
@@ -71,30 +72,30 @@ void TaskScheduler::RemoveTimer(TimerId timerId)
 
 bool TaskScheduler::AddTriggerEvent(TriggerEvent callback)
 {
-	if (trigger_events_->Size() < kMaxTriggetEvents) {
-		std::lock_guard<std::mutex> lock(mutex_);
-		char event = kTriggetEvent;
-		trigger_events_->Push(std::move(callback));
-		wakeup_pipe_->Write(&event, 1);
-		return true;
+	if (!trigger_events_->Push(std::move(callback))) {
+		return false;
 	}
 
-	return false;
+	/* Only the first producer after the loop started draining pays for the wakeup. */
+	if (!wakeup_pending_.exchange(true)) {
+		wakeup_event_->Notify();
+	}
+
+	return true;
 }
 
 void TaskScheduler::Wake()
 {
-	char event[10] = { 0 };
-	while (wakeup_pipe_->Read(event, 10) > 0);
+	wakeup_event_->Reset();
 }
 
 void TaskScheduler::HandleTriggerEvent()
 {
-	do 
-	{
-		TriggerEvent callback;
-		if (trigger_events_->Pop(callback)) {
-			callback();
-		}
-	} while (trigger_events_->Size() > 0);
+	wakeup_pending_.store(false);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	TriggerEvent callback;
+	while (trigger_events_->Pop(callback)) {
+		callback();
+	}
 }
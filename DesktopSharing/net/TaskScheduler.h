@@ -5,9 +5,9 @@
 #define XOP_TASK_SCHEDULER_H
 
 #include "Channel.h"
-#include "Pipe.h"
+#include "WakeupEvent.h"
 #include "Timer.h"
-#include "RingBuffer.h"
+#include "MpscQueue.h"
 
 namespace xop
 {
@@ -33,22 +33,31 @@ public:
 	int GetId() const 
 	{ return id_; }
 
+	/* Number of TcpConnections served by this scheduler, used by EventLoop for balancing. */
+	int GetNumConnections() const
+	{ return num_connections_; }
+
+	void IncreaseConnections()
+	{ num_connections_++; }
+
+	void DecreaseConnections()
+	{ num_connections_--; }
+
 protected:
 	void Wake();
 	void HandleTriggerEvent();
 
 	int id_ = 0;
 	std::atomic_bool is_shutdown_;
-	std::unique_ptr<Pipe> wakeup_pipe_;
+	std::atomic_bool wakeup_pending_;
+	std::atomic_int num_connections_;
+	std::unique_ptr<WakeupEvent> wakeup_event_;
 	std::shared_ptr<Channel> wakeup_channel_;
-	std::unique_ptr<xop::RingBuffer<TriggerEvent>> trigger_events_;
+	std::unique_ptr<xop::MpscQueue<TriggerEvent>> trigger_events_;
 
-	std::mutex mutex_;
 	TimerQueue timer_queue_;
 
-	static const char kTriggetEvent = 1;
-	static const char kTimerEvent = 2;
-	static const int  kMaxTriggetEvents = 50000;
+	static const int  kMaxTriggetEvents = 65536;
 };
 
 }
@@ -6,7 +6,7 @@ using namespace xop;
 TcpConnection::TcpConnection(TaskScheduler *task_scheduler, SOCKET sockfd)
 	: task_scheduler_(task_scheduler)
 	, read_buffer_(new BufferReader)
-	, write_buffer_(new BufferWriter(500))
+	, write_buffer_(new BufferWriter(2000))
 	, channel_(new Channel(sockfd))
 {
 	is_closed_ = false;
@@ -19,9 +19,9 @@ TcpConnection::TcpConnection(TaskScheduler *task_scheduler, SOCKET sockfd)
 	SocketUtil::SetNonBlock(sockfd);
 	SocketUtil::SetSendBufSize(sockfd, 100 * 1024);
 	SocketUtil::SetKeepAlive(sockfd);
+	SocketUtil::SetNoSigpipe(sockfd);
 
-	channel_->EnableReading();
-	task_scheduler_->UpdateChannel(channel_);
+	task_scheduler_->IncreaseConnections();
 }
 
 TcpConnection::~TcpConnection()
@@ -32,6 +32,15 @@ TcpConnection::~TcpConnection()
 	}
 }
 
+void TcpConnection::Start()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (!is_closed_ && !channel_->IsReading()) {
+		channel_->EnableReading();
+		task_scheduler_->UpdateChannel(channel_);
+	}
+}
+
 void TcpConnection::Send(std::shared_ptr<char> data, uint32_t size)
 {
 	if (!is_closed_) {
@@ -54,6 +63,33 @@ void TcpConnection::Send(const char *data, uint32_t size)
 	}
 }
 
+bool TcpConnection::Send(const char *prefix, uint32_t prefix_size, std::shared_ptr<char> data, uint32_t size)
+{
+	bool ret = false;
+
+	if (!is_closed_) {
+		mutex_.lock();
+		ret = write_buffer_->Append(prefix, prefix_size, std::move(data), size);
+		mutex_.unlock();
+
+		this->HandleWrite();
+	}
+
+	return ret;
+}
+
+uint32_t TcpConnection::GetQueuedBytes()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return write_buffer_->QueuedBytes();
+}
+
+int64_t TcpConnection::GetQueuedTime()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return write_buffer_->QueuedTime();
+}
+
 void TcpConnection::Disconnect()
 {
 	std::lock_guard<std::mutex> lock(mutex_);
@@ -131,6 +167,7 @@ void TcpConnection::Close()
 	if (!is_closed_) {
 		is_closed_ = true;
 		task_scheduler_->RemoveChannel(channel_);
+		task_scheduler_->DecreaseConnections();
 
 		if (close_cb_) {
 			close_cb_(shared_from_this());
@@ -23,6 +23,10 @@ public:
 	TcpConnection(TaskScheduler *task_scheduler, SOCKET sockfd);
 	virtual ~TcpConnection();
 
+	/* Registers the socket with the task scheduler. Call once the derived object
+	   is constructed and owned by a shared_ptr, the scheduler may read at once. */
+	void Start();
+
 	TaskScheduler* GetTaskScheduler() const 
 	{ return task_scheduler_; }
 
@@ -34,6 +38,11 @@ public:
 
 	void Send(std::shared_ptr<char> data, uint32_t size);
 	void Send(const char *data, uint32_t size);
+	bool Send(const char *prefix, uint32_t prefix_size, std::shared_ptr<char> data, uint32_t size);
+
+	/* Send queue depth, used by callers to apply their own congestion policy. */
+	uint32_t GetQueuedBytes();
+	int64_t  GetQueuedTime();
     
 	void Disconnect();
 
@@ -24,6 +24,8 @@ TcpServer::TcpServer(EventLoop* event_loop)
 					scheduler->AddTimer([this, sockfd]() {this->RemoveConnection(sockfd); return false; }, 100);
 				}
 			});
+			/* the connection scheduler runs on another thread, start reading only when fully set up */
+			conn->Start();
 		}
 	});
 }
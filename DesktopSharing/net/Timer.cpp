@@ -1,51 +1,102 @@
 #include "Timer.h"
 #include <iostream>
+#include <cstring>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 using namespace xop;
 using namespace std;
 using namespace std::chrono;
 
+static inline int FindFirstBit(uint64_t bits)
+{
+#if defined(_MSC_VER)
+	unsigned long index = 0;
+	_BitScanForward64(&index, bits);
+	return (int)index;
+#else
+	return __builtin_ctzll(bits);
+#endif
+}
+
+TimerQueue::TimerQueue()
+{
+	memset(wheel_, 0xff, sizeof(wheel_));
+	memset(bitmap_, 0, sizeof(bitmap_));
+	current_tick_ = GetTimeNow();
+}
+
+TimerQueue::~TimerQueue()
+{
+
+}
+
 TimerId TimerQueue::AddTimer(const TimerEvent& event, uint32_t ms)
-{    
+{
 	std::lock_guard<std::mutex> locker(mutex_);
 
-	int64_t timeout = GetTimeNow();
-	TimerId timer_id = ++last_timer_id_;
+	uint32_t index = AllocNode();
+	if (index == kInvalidNode) {
+		return 0;
+	}
+
+	TimerNode& node = GetNode(index);
+	node.event_callback = event;
+	node.interval = (ms > 0) ? ms : 1;
+	node.expire = GetTimeNow() + node.interval;
+	node.state = kNodePending;
+	Link(index);
+	num_timers_++;
 
-	auto timer = make_shared<Timer>(event, ms);	
-	timer->SetNextTimeout(timeout);
-	timers_.emplace(timer_id, timer);
-	events_.emplace(std::pair<int64_t, TimerId>(timeout + ms, timer_id), std::move(timer));
-	return timer_id;
+	return (node.generation << kIndexBits) | (index + 1);
 }
 
 void TimerQueue::RemoveTimer(TimerId timerId)
 {
 	std::lock_guard<std::mutex> locker(mutex_);
 
-	auto iter = timers_.find(timerId);
-	if (iter != timers_.end()) {
-		int64_t timeout = iter->second->getNextTimeout();
-		events_.erase(std::pair<int64_t, TimerId>(timeout, timerId));
-		timers_.erase(timerId);
+	uint32_t index = (timerId & kIndexMask) - 1;
+	if (timerId == 0 || index >= num_nodes_) {
+		return;
+	}
+
+	TimerNode& node = GetNode(index);
+	if (node.generation != ((timerId >> kIndexBits) & kGenerationMask)) {
+		return;
+	}
+
+	if (node.state == kNodePending) {
+		Unlink(index);
+		FreeNode(index);
+		num_timers_--;
+	}
+	else if (node.state == kNodeRunning) {
+		/* HandleTimerEvent frees it once the callback returns */
+		node.state = kNodeCancelled;
 	}
 }
 
 int64_t TimerQueue::GetTimeNow()
-{	
-	auto time_point = steady_clock::now();	
+{
+	auto time_point = steady_clock::now();
 	return duration_cast<milliseconds>(time_point.time_since_epoch()).count();
 }
 
 int64_t TimerQueue::GetTimeRemaining()
-{	
+{
 	std::lock_guard<std::mutex> locker(mutex_);
 
-	if (timers_.empty()) {
+	if (num_timers_ == 0) {
+		return -1;
+	}
+
+	int64_t next_expire = GetNextExpire();
+	if (next_expire == INT64_MAX) {
 		return -1;
 	}
 
-	int64_t msec = events_.begin()->first.first - GetTimeNow();
+	int64_t msec = next_expire - GetTimeNow();
 	if (msec < 0) {
 		msec = 0;
 	}
@@ -55,24 +106,253 @@ int64_t TimerQueue::GetTimeRemaining()
 
 void TimerQueue::HandleTimerEvent()
 {
-	if(!timers_.empty()) {
-		std::lock_guard<std::mutex> locker(mutex_);
-		int64_t timePoint = GetTimeNow();
-		while(!timers_.empty() && events_.begin()->first.first<=timePoint)
-		{	
-			TimerId timerId = events_.begin()->first.second;
-			bool flag = events_.begin()->second->event_callback_();
-			if(flag == true) {
-				events_.begin()->second->SetNextTimeout(timePoint);
-				auto timerPtr = std::move(events_.begin()->second);
-				events_.erase(events_.begin());
-				events_.emplace(std::pair<int64_t, TimerId>(timerPtr->getNextTimeout(), timerId), timerPtr);
+	std::unique_lock<std::mutex> locker(mutex_);
+
+	int64_t time_point = GetTimeNow();
+	if (num_timers_ == 0) {
+		if (current_tick_ <= time_point) {
+			current_tick_ = time_point + 1;
+		}
+		return;
+	}
+
+	while (current_tick_ <= time_point) {
+		int64_t tick = current_tick_;
+		uint32_t slot = (uint32_t)(tick & (kRootSize - 1));
+
+		/* Re-sort the upper level slot that now falls inside the next 256ms. */
+		if (slot == 0) {
+			for (int level = 1; level < kWheelLevels; level++) {
+				if (Cascade(level) != 0) {
+					break;
+				}
 			}
-			else {		
-				events_.erase(events_.begin());
-				timers_.erase(timerId);				
+		}
+
+		uint32_t head = Detach(0, slot);
+		current_tick_ = tick + 1;
+		if (head != kInvalidNode) {
+			RunExpired(head, time_point, locker);
+		}
+
+		/* Jump over empty slots, but never past the next cascade point. */
+		int next = FindSlot(0, slot + 1, kRootSize);
+		int64_t next_tick = (tick & ~(int64_t)(kRootSize - 1)) + ((next >= 0) ? next : kRootSize);
+		if (next_tick > time_point) {
+			next_tick = time_point + 1;
+		}
+		if (next_tick > current_tick_) {
+			current_tick_ = next_tick;
+		}
+	}
+}
+
+uint32_t TimerQueue::AllocNode()
+{
+	uint32_t index = free_nodes_;
+	if (index != kInvalidNode) {
+		free_nodes_ = GetNode(index).next;
+		return index;
+	}
+
+	if (num_nodes_ >= kIndexMask) {
+		return kInvalidNode;
+	}
+
+	if (num_nodes_ % kNodesPerChunk == 0) {
+		chunks_.emplace_back(new TimerNode[kNodesPerChunk]);
+	}
+
+	return num_nodes_++;
+}
+
+void TimerQueue::FreeNode(uint32_t index)
+{
+	TimerNode& node = GetNode(index);
+	node.event_callback = nullptr;
+	node.generation = (node.generation + 1) & kGenerationMask;
+	node.state = kNodeFree;
+	node.prev = kInvalidNode;
+	node.next = free_nodes_;
+	free_nodes_ = index;
+}
+
+void TimerQueue::Link(uint32_t index)
+{
+	TimerNode& node = GetNode(index);
+
+	int64_t expire = node.expire;
+	if (expire < current_tick_) {
+		expire = current_tick_;
+	}
+
+	int64_t delay = expire - current_tick_;
+	if (delay > kMaxDelay) {
+		delay = kMaxDelay;
+		expire = current_tick_ + kMaxDelay;
+	}
+
+	int level = 0;
+	uint32_t slot = 0;
+	if (delay < kRootSize) {
+		slot = (uint32_t)(expire & (kRootSize - 1));
+	}
+	else {
+		level = 1;
+		while (level < kWheelLevels - 1 && delay >= ((int64_t)1 << (kRootBits + level * kLevelBits))) {
+			level++;
+		}
+		slot = (uint32_t)((expire >> (kRootBits + (level - 1) * kLevelBits)) & (kLevelSize - 1));
+	}
+
+	node.level = (uint8_t)level;
+	node.slot = (uint8_t)slot;
+	node.prev = kInvalidNode;
+	node.next = wheel_[level][slot];
+	if (node.next != kInvalidNode) {
+		GetNode(node.next).prev = index;
+	}
+
+	wheel_[level][slot] = index;
+	bitmap_[level][slot / 64] |= (uint64_t)1 << (slot % 64);
+}
+
+void TimerQueue::Unlink(uint32_t index)
+{
+	TimerNode& node = GetNode(index);
+
+	if (node.prev != kInvalidNode) {
+		GetNode(node.prev).next = node.next;
+	}
+	else {
+		wheel_[node.level][node.slot] = node.next;
+	}
+
+	if (node.next != kInvalidNode) {
+		GetNode(node.next).prev = node.prev;
+	}
+
+	if (wheel_[node.level][node.slot] == kInvalidNode) {
+		bitmap_[node.level][node.slot / 64] &= ~((uint64_t)1 << (node.slot % 64));
+	}
+
+	node.prev = node.next = kInvalidNode;
+}
+
+uint32_t TimerQueue::Detach(int level, uint32_t slot)
+{
+	uint32_t head = wheel_[level][slot];
+	wheel_[level][slot] = kInvalidNode;
+	bitmap_[level][slot / 64] &= ~((uint64_t)1 << (slot % 64));
+	return head;
+}
+
+uint32_t TimerQueue::Cascade(int level)
+{
+	uint32_t slot = (uint32_t)((current_tick_ >> (kRootBits + (level - 1) * kLevelBits)) & (kLevelSize - 1));
+	uint32_t index = Detach(level, slot);
+
+	while (index != kInvalidNode) {
+		uint32_t next = GetNode(index).next;
+		Link(index);
+		index = next;
+	}
+
+	return slot;
+}
+
+void TimerQueue::RunExpired(uint32_t head, int64_t time_point, std::unique_lock<std::mutex>& locker)
+{
+	for (uint32_t index = head; index != kInvalidNode; index = GetNode(index).next) {
+		GetNode(index).state = kNodeRunning;
+	}
+
+	uint32_t index = head;
+	while (index != kInvalidNode) {
+		TimerNode& node = GetNode(index);
+		uint32_t next = node.next;
+		bool repeat = false;
+
+		if (node.state == kNodeRunning) {
+			locker.unlock();
+			repeat = node.event_callback();
+			locker.lock();
+		}
+
+		if (repeat && node.state == kNodeRunning) {
+			node.expire = time_point + node.interval;
+			node.state = kNodePending;
+			Link(index);
+		}
+		else {
+			FreeNode(index);
+			num_timers_--;
+		}
+
+		index = next;
+	}
+}
+
+int64_t TimerQueue::GetNextExpire()
+{
+	/* Level 0 slots are exact, upper levels report their cascade point,
+	   so the scheduler may wake up early but never late. */
+	uint32_t slot = (uint32_t)(current_tick_ & (kRootSize - 1));
+	int next = FindSlot(0, slot, kRootSize);
+	if (next < 0) {
+		next = FindSlot(0, 0, slot);
+		if (next >= 0) {
+			next += kRootSize;
+		}
+	}
+
+	int64_t next_expire = (next >= 0) ? (current_tick_ + next - slot) : INT64_MAX;
+
+	for (int level = 1; level < kWheelLevels; level++) {
+		int shift = kRootBits + (level - 1) * kLevelBits;
+		int64_t base = current_tick_ >> shift;
+		uint32_t current = (uint32_t)(base & (kLevelSize - 1));
+		if (bitmap_[level][0] == 0) {
+			continue;
+		}
+
+		/* The current slot is cascaded at the start of its turn, if that is still ahead. */
+		int64_t offset = -1;
+		if ((current_tick_ & (((int64_t)1 << shift) - 1)) == 0 && FindSlot(level, current, current + 1) >= 0) {
+			offset = 0;
+		}
+		else {
+			next = FindSlot(level, current + 1, kLevelSize);
+			if (next < 0) {
+				next = FindSlot(level, 0, current + 1);
+				next = (next >= 0) ? next + kLevelSize : -1;
+			}
+			if (next >= 0) {
+				offset = next - current;
+			}
+		}
+
+		if (offset >= 0) {
+			int64_t cascade_time = (base + offset) << shift;
+			if (cascade_time < next_expire) {
+				next_expire = cascade_time;
 			}
-		}	
+		}
 	}
+
+	return next_expire;
 }
 
+int TimerQueue::FindSlot(int level, uint32_t start, uint32_t end)
+{
+	while (start < end) {
+		uint64_t bits = bitmap_[level][start / 64] >> (start % 64);
+		if (bits != 0) {
+			uint32_t slot = start + FindFirstBit(bits);
+			return (slot < end) ? (int)slot : -1;
+		}
+		start = (start / 64 + 1) * 64;
+	}
+
+	return -1;
+}
@@ -4,8 +4,7 @@
 #ifndef _XOP_TIMER_H
 #define _XOP_TIMER_H
 
-#include <map>
-#include <unordered_map>
+#include <vector>
 #include <chrono>
 #include <functional>
 #include <cstdint>
@@ -87,22 +86,86 @@ private:
 	int64_t  next_timeout_ = 0;
 };
 
+/* Hierarchical timing wheel with millisecond ticks.
+ * Level 0 has 256 one-millisecond slots, each upper level has 64 slots that
+ * span a full turn of the level below, so four levels cover about 18.6 hours.
+ * Timers due later are parked in the last level and re-sorted on cascade.
+ * Add, remove and expire are O(1), nodes live in fixed chunks and are
+ * recycled through a free list, callbacks run without holding the lock. */
 class TimerQueue
 {
 public:
+	TimerQueue();
+	virtual ~TimerQueue();
+
 	TimerId AddTimer(const TimerEvent& event, uint32_t msec);
 	void RemoveTimer(TimerId timerId);
 
 	int64_t GetTimeRemaining();
 	void HandleTimerEvent();
 
+	/* The upper 8 bits of a TimerId are left to EventLoop for the scheduler index. */
+	static const TimerId kMaxTimerId = 0x00ffffff;
+
 private:
+	static const int kWheelLevels = 4;
+	static const int kRootBits    = 8;
+	static const int kLevelBits   = 6;
+	static const uint32_t kRootSize  = 1 << kRootBits;
+	static const uint32_t kLevelSize = 1 << kLevelBits;
+	static const int64_t  kMaxDelay  = ((int64_t)1 << (kRootBits + (kWheelLevels - 1) * kLevelBits)) - 1;
+
+	/* TimerId: [4 bits generation][20 bits node index + 1] */
+	static const int kIndexBits = 20;
+	static const uint32_t kIndexMask = (1 << kIndexBits) - 1;
+	static const uint32_t kGenerationMask = kMaxTimerId >> kIndexBits;
+	static const uint32_t kNodesPerChunk = 4096;
+	static const uint32_t kInvalidNode = 0xffffffff;
+
+	enum NodeState
+	{
+		kNodeFree,
+		kNodePending,
+		kNodeRunning,
+		kNodeCancelled,
+	};
+
+	struct TimerNode
+	{
+		TimerEvent event_callback;
+		int64_t  expire = 0;
+		uint32_t interval = 0;
+		uint32_t prev = kInvalidNode;
+		uint32_t next = kInvalidNode;
+		uint32_t generation = 0;
+		uint8_t  level = 0;
+		uint8_t  slot = 0;
+		uint8_t  state = kNodeFree;
+	};
+
 	int64_t GetTimeNow();
 
+	TimerNode& GetNode(uint32_t index)
+	{ return chunks_[index / kNodesPerChunk][index % kNodesPerChunk]; }
+
+	uint32_t AllocNode();
+	void FreeNode(uint32_t index);
+	void Link(uint32_t index);
+	void Unlink(uint32_t index);
+	uint32_t Detach(int level, uint32_t slot);
+	uint32_t Cascade(int level);
+	void RunExpired(uint32_t head, int64_t time_point, std::unique_lock<std::mutex>& locker);
+	int64_t GetNextExpire();
+	int FindSlot(int level, uint32_t start, uint32_t end);
+
 	std::mutex mutex_;
-	std::unordered_map<TimerId, std::shared_ptr<Timer>> timers_;
-	std::map<std::pair<int64_t, TimerId>, std::shared_ptr<Timer>> events_;
-	uint32_t last_timer_id_ = 0;
+	std::vector<std::unique_ptr<TimerNode[]>> chunks_;
+	uint32_t num_nodes_ = 0;
+	uint32_t free_nodes_ = kInvalidNode;
+	uint32_t num_timers_ = 0;
+	int64_t current_tick_ = 0; /* next tick to process */
+	uint32_t wheel_[kWheelLevels][kRootSize];
+	uint64_t bitmap_[kWheelLevels][kRootSize / 64];
 };
 
 }
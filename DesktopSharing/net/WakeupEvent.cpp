@@ -0,0 +1,78 @@
+#include "WakeupEvent.h"
+
+#if defined(__linux) || defined(__linux__) 
+#include <sys/eventfd.h>
+#endif
+
+using namespace xop;
+
+WakeupEvent::WakeupEvent()
+{
+
+}
+
+WakeupEvent::~WakeupEvent()
+{
+	Close();
+}
+
+bool WakeupEvent::Create()
+{
+#if defined(__linux) || defined(__linux__) 
+	event_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (event_fd_ < 0) {
+		return false;
+	}
+#else
+	pipe_.reset(new Pipe());
+	if (!pipe_->Create()) {
+		pipe_.reset();
+		return false;
+	}
+	event_fd_ = pipe_->Read();
+#endif
+	return true;
+}
+
+void WakeupEvent::Notify()
+{
+#if defined(__linux) || defined(__linux__) 
+	uint64_t one = 1;
+	int ret = (int)::write(event_fd_, &one, sizeof(one));
+	(void)ret;
+#else
+	if (pipe_) {
+		char event = 1;
+		pipe_->Write(&event, 1);
+	}
+#endif
+}
+
+void WakeupEvent::Reset()
+{
+#if defined(__linux) || defined(__linux__) 
+	uint64_t count = 0;
+	int ret = (int)::read(event_fd_, &count, sizeof(count));
+	(void)ret;
+#else
+	if (pipe_) {
+		char event[64] = { 0 };
+		while (pipe_->Read(event, 64) > 0);
+	}
+#endif
+}
+
+void WakeupEvent::Close()
+{
+#if defined(__linux) || defined(__linux__) 
+	if (event_fd_ != INVALID_SOCKET) {
+		::close(event_fd_);
+	}
+#else
+	if (pipe_) {
+		pipe_->Close();
+		pipe_.reset();
+	}
+#endif
+	event_fd_ = INVALID_SOCKET;
+}
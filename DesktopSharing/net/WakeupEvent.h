@@ -0,0 +1,33 @@
+#ifndef XOP_WAKEUP_EVENT_H
+#define XOP_WAKEUP_EVENT_H
+
+#include <memory>
+#include "Pipe.h"
+
+namespace xop
+{
+
+/* Wakes a TaskScheduler blocked in select/epoll.
+ * Linux uses a single non-blocking eventfd, other platforms fall back to a Pipe. */
+class WakeupEvent
+{
+public:
+	WakeupEvent();
+	virtual ~WakeupEvent();
+
+	bool Create();
+	void Notify();
+	void Reset();
+	void Close();
+
+	SOCKET GetSocket() const
+	{ return event_fd_; }
+
+private:
+	SOCKET event_fd_ = INVALID_SOCKET;
+	std::unique_ptr<Pipe> pipe_;
+};
+
+}
+
+#endif
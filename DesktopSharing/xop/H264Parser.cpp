@@ -1,6 +1,17 @@
 ﻿#include "H264Parser.h"
 #include <cstring>
 
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define XOP_H264_PARSER_SSE2
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define XOP_TARGET_AVX2
+#else
+#define XOP_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
 using namespace xop;
 
 Nal H264Parser::findNal(const uint8_t *data, uint32_t size)
@@ -12,61 +23,177 @@ Nal H264Parser::findNal(const uint8_t *data, uint32_t size)
         return nal;
     }
 
-    nal.second = const_cast<uint8_t*>(data) + (size-1);
+    const uint8_t* end = data + size;
+    const uint8_t* start_code = FindStartCode(data, end);
+    if (start_code + 3 >= end) {
+        return nal;
+    }
+
+    const uint8_t* begin = start_code + 3;
+    const uint8_t* next = FindStartCode(begin, end);
+    const uint8_t* last = end;
+    if (next != end) {
+        last = next;
+        while (last > begin && last[-1] == 0) {
+            last--; /* leading zero of 00 00 00 01 */
+        }
+    }
 
-    uint32_t startCode = 0;
-    uint32_t pos = 0;
-    uint8_t prefix[3] = {0};
-    memcpy(prefix, data, 3);
-    size -= 3;
-    data += 2;
+    if (last > begin) {
+        nal.first = const_cast<uint8_t*>(begin);
+        nal.second = const_cast<uint8_t*>(last) - 1;
+    }
 
-    while(size--)
-    {
-        if ((prefix[pos % 3] == 0) && (prefix[(pos + 1) % 3] == 0) && (prefix[(pos + 2) % 3] == 1))
-        {
-            if(nal.first == nullptr) // 00 00 01 
-            {
-                nal.first = const_cast<uint8_t*>(data) + 1;
-                startCode = 3;
-            }
-            else if(startCode == 3)
-            {
-                nal.second = const_cast<uint8_t*>(data) - 3;
-                break;
-            }               
+    return nal;
+}
+
+#if defined(XOP_H264_PARSER_SSE2)
+
+static inline uint32_t CountTrailingZeros(uint32_t mask)
+{
+#if defined(_MSC_VER)
+    unsigned long index = 0;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+/* 00 00 01 at i when byte i and i+1 are zero and byte i+2 is one,
+   checked for 16 (32) positions at a time with three unaligned loads */
+static const uint8_t* FindStartCodeSSE2(const uint8_t* p, const uint8_t* end)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+
+    while (p + 16 + 2 <= end) {
+        __m128i b0 = _mm_loadu_si128((const __m128i*)p);
+        __m128i b1 = _mm_loadu_si128((const __m128i*)(p + 1));
+        __m128i b2 = _mm_loadu_si128((const __m128i*)(p + 2));
+        __m128i match = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)), 
+                                      _mm_cmpeq_epi8(b2, one));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(match);
+        if (mask != 0) {
+            return p + CountTrailingZeros(mask);
         }
-        else if ((prefix[pos % 3] == 0) && (prefix[(pos + 1) % 3] == 0) && (prefix[(pos + 2) % 3] == 0))
-        {
-            if (*(data+1) == 0x01) // 00 00 00 01 
-            {              
-                if(nal.first == nullptr)
-                {
-                    if(size >= 1)
-                    {
-                        nal.first = const_cast<uint8_t*>(data) + 2;
-                    }                       
-                    else
-                    {
-                        break;  
-                    }                  
-                    startCode = 4;
-                }
-                else if(startCode == 4)
-                {
-                    nal.second = const_cast<uint8_t*>(data) - 3;
-                    break;
-                }                    
-            }
+        p += 16;
+    }
+
+    return p;
+}
+
+XOP_TARGET_AVX2
+static const uint8_t* FindStartCodeAVX2(const uint8_t* p, const uint8_t* end)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+
+    while (p + 32 + 2 <= end) {
+        __m256i b0 = _mm256_loadu_si256((const __m256i*)p);
+        __m256i b1 = _mm256_loadu_si256((const __m256i*)(p + 1));
+        __m256i b2 = _mm256_loadu_si256((const __m256i*)(p + 2));
+        __m256i match = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(b0, zero), _mm256_cmpeq_epi8(b1, zero)), 
+                                         _mm256_cmpeq_epi8(b2, one));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(match);
+        if (mask != 0) {
+            return p + CountTrailingZeros(mask);
         }
+        p += 32;
+    }
+
+    return p;
+}
 
-        prefix[(pos++) % 3] = *(++data);
+static bool IsAVX2Supported()
+{
+#if defined(_MSC_VER)
+    int info[4] = { 0 };
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
     }
-        
-    if(nal.first == nullptr)
-        nal.second = nullptr;
 
-    return nal;
+    __cpuid(info, 1);
+    bool os_xsave = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0;
+    if (!os_xsave || (_xgetbv(0) & 6) != 6) {
+        return false; /* the OS does not save the ymm registers */
+    }
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
 }
 
+static const bool kUseAVX2 = IsAVX2Supported();
+
+#endif
+
+static const uint8_t* FindStartCodeScalar(const uint8_t* p, const uint8_t* end)
+{
+    while (p + 3 <= end) {
+        if (p[2] > 1) {
+            p += 3; /* none of the three bytes can start a start code ending at p[2] */
+        }
+        else if (p[2] == 1 && p[1] == 0 && p[0] == 0) {
+            return p;
+        }
+        else {
+            p += 1;
+        }
+    }
+
+    return end;
+}
+
+const uint8_t* H264Parser::FindStartCode(const uint8_t* begin, const uint8_t* end)
+{
+    const uint8_t* p = begin;
+
+#if defined(XOP_H264_PARSER_SSE2)
+    /* the vector loops stop short of the tail, the scalar loop finishes it */
+    if (kUseAVX2) {
+        p = FindStartCodeAVX2(p, end);
+    }
+    p = FindStartCodeSSE2(p, end);
+    if (p + 2 < end && p[0] == 0 && p[1] == 0 && p[2] == 1) {
+        return p;
+    }
+#endif
 
+    return FindStartCodeScalar(p, end);
+}
+
+bool H264NalIterator::Next(const uint8_t*& nal, uint32_t& size)
+{
+    while (pos_ < end_) {
+        const uint8_t* begin = pos_;
+        while (begin < end_ && *begin == 0) {
+            begin++;
+        }
+
+        if (begin > pos_ && begin < end_ && *begin == 1) {
+            begin++; /* 00 00 01 or 00 00 00 01 */
+        }
+        else {
+            begin = pos_;
+        }
+
+        const uint8_t* next = H264Parser::FindStartCode(begin, end_);
+        const uint8_t* last = next;
+        while (last > begin && last[-1] == 0) {
+            last--;
+        }
+
+        pos_ = next;
+        if (last > begin) {
+            nal = begin;
+            size = (uint32_t)(last - begin);
+            return true;
+        }
+    }
+
+    return false;
+}
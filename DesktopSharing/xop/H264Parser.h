@@ -13,10 +13,31 @@ class H264Parser
 {
 public:    
     static Nal findNal(const uint8_t *data, uint32_t size);
+
+    /* first 00 00 01 in [begin, end), end if there is none. Scans 16 or 32 bytes 
+       per step with SSE2/AVX2 where available, bytewise otherwise. */
+    static const uint8_t* FindStartCode(const uint8_t* begin, const uint8_t* end);
         
 private:
   
 };
+
+/* Walks the NAL units of an Annex-B access unit in place: start codes and 
+   trailing zero bytes are skipped, nothing is copied. A buffer that does not 
+   begin with a start code is taken to begin with a NAL unit. */
+class H264NalIterator
+{
+public:
+    H264NalIterator(const uint8_t* data, uint32_t size)
+        : pos_(data), end_(data + size)
+    { }
+
+    bool Next(const uint8_t*& nal, uint32_t& size);
+
+private:
+    const uint8_t* pos_;
+    const uint8_t* end_;
+};
     
 }
 
@@ -1,4 +1,4 @@
-// PHZ
+﻿// PHZ
 // 2018-5-16
 
 #if defined(WIN32) || defined(_WIN32)
@@ -8,6 +8,7 @@
 #endif
 
 #include "H264Source.h"
+#include <cstring>
 #include <cstdio>
 #include <chrono>
 #if defined(__linux) || defined(__linux__)
@@ -38,86 +39,195 @@ H264Source::~H264Source()
 string H264Source::GetMediaDescription(uint16_t port)
 {
     char buf[100] = {0};
-    sprintf(buf, "m=video %hu RTP/AVP 96", port); // \r\nb=AS:2000
+    if (rtx_payload_ != 0) {
+        sprintf(buf, "m=video %hu RTP/AVP 96 %u", port, rtx_payload_);
+    }
+    else {
+        sprintf(buf, "m=video %hu RTP/AVP 96", port); // \r\nb=AS:2000
+    }
     return string(buf);
 }
 
 string H264Source::GetAttribute()
 {
-    return string("a=rtpmap:96 H264/90000");
+    string attribute = "a=rtpmap:96 H264/90000\r\na=rtcp-fb:96 nack";
+    if (rtx_payload_ != 0) {
+        char buf[100] = {0};
+        sprintf(buf, "\r\na=rtpmap:%u rtx/90000\r\na=fmtp:%u apt=96", rtx_payload_, rtx_payload_);
+        attribute += buf;
+    }
+    return attribute;
 }
 
 bool H264Source::HandleFrame(MediaChannelId channel_id, AVFrame frame)
 {
-    uint8_t* frame_buf  = frame.buffer.get();
-    uint32_t frame_size = frame.size;
-
     if (frame.timestamp == 0) {
 	    frame.timestamp = GetTimestamp();
     }    
 
-    if (frame_size <= MAX_RTP_PAYLOAD_SIZE) {
-        RtpPacket rtp_pkt;
-	    rtp_pkt.type = frame.type;
-	    rtp_pkt.timestamp = frame.timestamp;
-	    rtp_pkt.size = frame_size + 4 + RTP_HEADER_SIZE;
-	    rtp_pkt.last = 1;
-        memcpy(rtp_pkt.data.get()+4+RTP_HEADER_SIZE, frame_buf, frame_size); 
+    /* The frame is an access unit: SPS/PPS/SEI and slices may share one buffer.
+       Small NAL units are aggregated into STAP-A packets, large ones are sent 
+       as FU-A fragments, and only the final packet of the unit carries the marker. */
+    H264NalIterator nal_iter(frame.buffer.get(), frame.size);
+    const uint8_t* nal = nullptr;
+    uint32_t nal_size = 0;
+    bool has_nal = nal_iter.Next(nal, nal_size);
+    bool has_vcl = false;
+
+    Nal stap_nals[kMaxStapNals];
+    uint32_t stap_count = 0;
+    uint32_t stap_size = 1;
+
+    while (has_nal) {
+        const uint8_t* next_nal = nullptr;
+        uint32_t next_size = 0;
+        bool has_next = nal_iter.Next(next_nal, next_size);
+
+        uint8_t nal_type = nal[0] & 0x1f;
+        if (!has_vcl && nal_type >= 1 && nal_type <= 5) {
+            has_vcl = true;
+            /* nal_ref_idc == 0: nothing references this picture, congested clients may drop it */
+            if (frame.type == VIDEO_FRAME_P && (nal[0] & 0x60) == 0) {
+                frame.type = VIDEO_FRAME_B;
+            }
+        }
 
-        if (send_frame_callback_) {
-		    if (!send_frame_callback_(channel_id, rtp_pkt)) {
-			    return false;
-		    }               
+        if (nal_size + 2 + 1 <= MAX_RTP_PAYLOAD_SIZE) {
+            if (stap_count == kMaxStapNals || stap_size + 2 + nal_size > MAX_RTP_PAYLOAD_SIZE) {
+                if (!SendStapA(channel_id, frame, stap_nals, stap_count, false)) {
+                    return false;
+                }
+                stap_count = 0;
+                stap_size = 1;
+            }
+
+            stap_nals[stap_count++] = Nal((uint8_t*)nal, (uint8_t*)nal + nal_size);
+            stap_size += 2 + nal_size;
+
+            if (!has_next) {
+                if (!SendStapA(channel_id, frame, stap_nals, stap_count, true)) {
+                    return false;
+                }
+                stap_count = 0;
+            }
         }
+        else {
+            if (!SendStapA(channel_id, frame, stap_nals, stap_count, false)) {
+                return false;
+            }
+            stap_count = 0;
+            stap_size = 1;
+
+            if (!SendFuA(channel_id, frame, nal, nal_size, !has_next)) {
+                return false;
+            }
+        }
+
+        nal = next_nal;
+        nal_size = next_size;
+        has_nal = has_next;
     }
-    else {
-        char FU_A[2] = {0};
 
-        FU_A[0] = (frame_buf[0] & 0xE0) | 28;
-        FU_A[1] = 0x80 | (frame_buf[0] & 0x1f);
+    return true;
+}
 
-        frame_buf  += 1;
-        frame_size -= 1;
+bool H264Source::SendStapA(MediaChannelId channel_id, const AVFrame& frame, const Nal* nals, uint32_t count, bool last)
+{
+    if (count == 0) {
+        return true;
+    }
 
-        while (frame_size + 2 > MAX_RTP_PAYLOAD_SIZE) {
-            RtpPacket rtp_pkt;
-            rtp_pkt.type = frame.type;
-            rtp_pkt.timestamp = frame.timestamp;
-            rtp_pkt.size = 4 + RTP_HEADER_SIZE + MAX_RTP_PAYLOAD_SIZE;
-            rtp_pkt.last = 0;
+    RtpPacket rtp_pkt;
+    rtp_pkt.type = frame.type;
+    rtp_pkt.timestamp = frame.timestamp;
+    rtp_pkt.last = last ? 1 : 0;
 
-            rtp_pkt.data.get()[RTP_HEADER_SIZE+4] = FU_A[0];
-            rtp_pkt.data.get()[RTP_HEADER_SIZE+5] = FU_A[1];
-            memcpy(rtp_pkt.data.get()+4+RTP_HEADER_SIZE+2, frame_buf, MAX_RTP_PAYLOAD_SIZE-2);
+    uint8_t* payload = rtp_pkt.data.get() + 4 + RTP_HEADER_SIZE;
+    uint32_t size = 0;
 
-            if (send_frame_callback_) {
-                if (!send_frame_callback_(channel_id, rtp_pkt))
-                    return false;
+    if (count == 1) {
+        size = (uint32_t)(nals[0].second - nals[0].first);
+        memcpy(payload, nals[0].first, size);
+    }
+    else {
+        /* STAP-A header: F is set if any unit has it, NRI is the highest of the units */
+        uint8_t header = 24;
+        for (uint32_t n = 0; n < count; n++) {
+            header |= nals[n].first[0] & 0x80;
+            if ((nals[n].first[0] & 0x60) > (header & 0x60)) {
+                header = (header & ~0x60) | (nals[n].first[0] & 0x60);
             }
+        }
+
+        payload[size++] = header;
+        for (uint32_t n = 0; n < count; n++) {
+            uint32_t nal_size = (uint32_t)(nals[n].second - nals[n].first);
+            payload[size++] = (uint8_t)(nal_size >> 8);
+            payload[size++] = (uint8_t)(nal_size & 0xff);
+            memcpy(payload + size, nals[n].first, nal_size);
+            size += nal_size;
+        }
+    }
 
-            frame_buf  += MAX_RTP_PAYLOAD_SIZE - 2;
-            frame_size -= MAX_RTP_PAYLOAD_SIZE - 2;
+    rtp_pkt.size = 4 + RTP_HEADER_SIZE + size;
 
-            FU_A[1] &= ~0x80;
+    if (send_frame_callback_) {
+        if (!send_frame_callback_(channel_id, rtp_pkt)) {
+            return false;
         }
+    }
 
-        {
-            RtpPacket rtp_pkt;
-            rtp_pkt.type = frame.type;
-            rtp_pkt.timestamp = frame.timestamp;
-            rtp_pkt.size = 4 + RTP_HEADER_SIZE + 2 + frame_size;
-            rtp_pkt.last = 1;
-
-            FU_A[1] |= 0x40;
-            rtp_pkt.data.get()[RTP_HEADER_SIZE+4] = FU_A[0];
-            rtp_pkt.data.get()[RTP_HEADER_SIZE+5] = FU_A[1];
-            memcpy(rtp_pkt.data.get()+4+RTP_HEADER_SIZE+2, frame_buf, frame_size);
-
-            if (send_frame_callback_) {
-			    if (!send_frame_callback_(channel_id, rtp_pkt)) {
-				    return false;
-			    }              
-            }
+    return true;
+}
+
+bool H264Source::SendFuA(MediaChannelId channel_id, const AVFrame& frame, const uint8_t* nal, uint32_t nal_size, bool last)
+{
+    char FU_A[2] = {0};
+
+    FU_A[0] = (nal[0] & 0xE0) | 28;
+    FU_A[1] = 0x80 | (nal[0] & 0x1f);
+
+    nal  += 1;
+    nal_size -= 1;
+
+    while (nal_size + 2 > MAX_RTP_PAYLOAD_SIZE) {
+        RtpPacket rtp_pkt;
+        rtp_pkt.type = frame.type;
+        rtp_pkt.timestamp = frame.timestamp;
+        rtp_pkt.size = 4 + RTP_HEADER_SIZE + MAX_RTP_PAYLOAD_SIZE;
+        rtp_pkt.last = 0;
+
+        rtp_pkt.data.get()[RTP_HEADER_SIZE+4] = FU_A[0];
+        rtp_pkt.data.get()[RTP_HEADER_SIZE+5] = FU_A[1];
+        memcpy(rtp_pkt.data.get()+4+RTP_HEADER_SIZE+2, nal, MAX_RTP_PAYLOAD_SIZE-2);
+
+        if (send_frame_callback_) {
+            if (!send_frame_callback_(channel_id, rtp_pkt))
+                return false;
+        }
+
+        nal  += MAX_RTP_PAYLOAD_SIZE - 2;
+        nal_size -= MAX_RTP_PAYLOAD_SIZE - 2;
+
+        FU_A[1] &= ~0x80;
+    }
+
+    {
+        RtpPacket rtp_pkt;
+        rtp_pkt.type = frame.type;
+        rtp_pkt.timestamp = frame.timestamp;
+        rtp_pkt.size = 4 + RTP_HEADER_SIZE + 2 + nal_size;
+        rtp_pkt.last = last ? 1 : 0;
+
+        FU_A[1] |= 0x40;
+        rtp_pkt.data.get()[RTP_HEADER_SIZE+4] = FU_A[0];
+        rtp_pkt.data.get()[RTP_HEADER_SIZE+5] = FU_A[1];
+        memcpy(rtp_pkt.data.get()+4+RTP_HEADER_SIZE+2, nal, nal_size);
+
+        if (send_frame_callback_) {
+		    if (!send_frame_callback_(channel_id, rtp_pkt)) {
+			    return false;
+		    }              
         }
     }
 
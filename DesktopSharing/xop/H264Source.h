@@ -6,6 +6,7 @@
 
 #include "MediaSource.h"
 #include "rtp.h"
+#include "H264Parser.h"
 
 namespace xop
 { 
@@ -33,6 +34,12 @@ public:
 private:
 	H264Source(uint32_t framerate);
 
+	/* one NAL unit as a single NAL packet, several as one STAP-A */
+	bool SendStapA(MediaChannelId channel_id, const AVFrame& frame, const Nal* nals, uint32_t count, bool last);
+	bool SendFuA(MediaChannelId channel_id, const AVFrame& frame, const uint8_t* nal, uint32_t nal_size, bool last);
+
+	static const uint32_t kMaxStapNals = 16;
+
 	uint32_t framerate_ = 25;
 };
 	
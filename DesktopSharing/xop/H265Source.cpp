@@ -55,6 +55,12 @@ bool H265Source::HandleFrame(MediaChannelId channelId, AVFrame frame)
 	if (frame.timestamp == 0) {
 		frame.timestamp = GetTimestamp();
 	}
+
+	/* sub-layer non-reference pictures (even VCL types below 16) may be dropped by congested clients */
+	uint8_t nal_type = (frame_size > 0) ? ((frame_buf[0] >> 1) & 0x3f) : 0xff;
+	if (frame.type == VIDEO_FRAME_P && nal_type < 16 && (nal_type % 2) == 0) {
+		frame.type = VIDEO_FRAME_B;
+	}
         
 	if (frame_size <= MAX_RTP_PAYLOAD_SIZE) {
 		RtpPacket rtp_pkt;
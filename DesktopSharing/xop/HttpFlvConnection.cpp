@@ -83,7 +83,8 @@ void HttpFlvConnection::OnClose()
 }
 
 
-bool HttpFlvConnection::SendMediaData(uint8_t type, uint64_t timestamp, std::shared_ptr<char> payload, uint32_t payload_size)
+bool HttpFlvConnection::SendMediaData(uint8_t type, uint64_t timestamp, std::shared_ptr<char> payload, uint32_t payload_size,
+                                      std::shared_ptr<char> flv_tag, uint32_t flv_tag_size)
 {	 
 	if (payload_size == 0) {
 		return false;
@@ -102,48 +103,71 @@ bool HttpFlvConnection::SendMediaData(uint8_t type, uint64_t timestamp, std::sha
 		return true;
 	}
 
+	if (type != RTMP_VIDEO && type != RTMP_AUDIO) {
+		return false;
+	}
+
+	if (flv_tag == nullptr) {
+		flv_tag = CreateFlvTag(type == RTMP_VIDEO ? FLV_TAG_TYPE_VIDEO : FLV_TAG_TYPE_AUDIO, 
+		                       timestamp, payload.get(), payload_size, flv_tag_size);
+	}
+
 	auto conn = std::dynamic_pointer_cast<HttpFlvConnection>(shared_from_this());
-	task_scheduler_->AddTriggerEvent([conn, type, timestamp, payload, payload_size] {		
-		if (type == RTMP_VIDEO) {
-			if (!conn->has_key_frame_) {
-				uint8_t frame_type = (payload.get()[0] >> 4) & 0x0f;
-				uint8_t codec_id = payload.get()[0] & 0x0f;
-				if (frame_type == 1 && codec_id == RTMP_CODEC_ID_H264) {
-					conn->has_key_frame_ = true;
-				}
-				else {
-					return ;
-				}
-			}
+	task_scheduler_->AddTriggerEvent([conn, type, payload, payload_size, flv_tag, flv_tag_size] {
+		conn->WriteMediaData(type, payload, payload_size, flv_tag, flv_tag_size);
+	});
 
-			if (!conn->has_flv_header_) {
-				conn->SendFlvHeader();
-				conn->SendFlvTag(conn->FLV_TAG_TYPE_VIDEO, 0, conn->avc_sequence_header_, conn->avc_sequence_header_size_);
-				conn->SendFlvTag(conn->FLV_TAG_TYPE_AUDIO, 0, conn->aac_sequence_header_, conn->aac_sequence_header_size_);
-			}
+	return true;
+}
 
-			conn->SendFlvTag(conn->FLV_TAG_TYPE_VIDEO, timestamp, payload, payload_size);
-		}
-		else if (type == RTMP_AUDIO) {
-			if (!conn->has_key_frame_ && conn->avc_sequence_header_size_>0) {
+void HttpFlvConnection::WriteMediaData(uint8_t type, std::shared_ptr<char> payload, uint32_t payload_size,
+                                       std::shared_ptr<char> flv_tag, uint32_t flv_tag_size)
+{
+	if (type == RTMP_AVC_SEQUENCE_HEADER) {
+		avc_sequence_header_ = payload;
+		avc_sequence_header_size_ = payload_size;
+	}
+	else if (type == RTMP_AAC_SEQUENCE_HEADER) {
+		aac_sequence_header_ = payload;
+		aac_sequence_header_size_ = payload_size;
+	}
+	else if (type == RTMP_VIDEO) {
+		if (!has_key_frame_) {
+			uint8_t frame_type = (payload.get()[0] >> 4) & 0x0f;
+			uint8_t codec_id = payload.get()[0] & 0x0f;
+			if (frame_type == 1 && codec_id == RTMP_CODEC_ID_H264) {
+				has_key_frame_ = true;
+			}
+			else {
 				return ;
 			}
+		}
 
-			if (!conn->has_flv_header_) {
-				conn->SendFlvHeader();
-				conn->SendFlvTag(conn->FLV_TAG_TYPE_AUDIO, 0, conn->aac_sequence_header_, conn->aac_sequence_header_size_);
-			}
+		if (!has_flv_header_) {
+			SendFlvHeader();
+			SendFlvTag(FLV_TAG_TYPE_VIDEO, 0, avc_sequence_header_, avc_sequence_header_size_);
+			SendFlvTag(FLV_TAG_TYPE_AUDIO, 0, aac_sequence_header_, aac_sequence_header_size_);
+		}
 
-			conn->SendFlvTag(conn->FLV_TAG_TYPE_AUDIO, timestamp, payload, payload_size);
+		Send(flv_tag, flv_tag_size);
+	}
+	else if (type == RTMP_AUDIO) {
+		if (!has_key_frame_ && avc_sequence_header_size_>0) {
+			return ;
 		}
-	});
 
-	return true;
+		if (!has_flv_header_) {
+			SendFlvHeader();
+			SendFlvTag(FLV_TAG_TYPE_AUDIO, 0, aac_sequence_header_, aac_sequence_header_size_);
+		}
+
+		Send(flv_tag, flv_tag_size);
+	}
 }
 
 void HttpFlvConnection::SendFlvHeader()
 {
-	char flv_header[9] = { 0x46, 0x4c, 0x56, 0x01, 0x00, 0x00, 0x00, 0x00, 0x09 };
+	char flv_header[13] = { 0x46, 0x4c, 0x56, 0x01, 0x00, 0x00, 0x00, 0x00, 0x09, 0x00, 0x00, 0x00, 0x00 };
 
 	if (avc_sequence_header_size_ > 0) {
 		flv_header[4] |= 0x1;
@@ -153,9 +177,8 @@ void HttpFlvConnection::SendFlvHeader()
 		flv_header[4] |= 0x4;
 	}
 
-	this->Send(flv_header, 9);
-	char previous_tag_size[4] = { 0x0, 0x0, 0x0, 0x0 };
-	this->Send(previous_tag_size, 4);
+	/* followed by the first previous tag size, always 0 */
+	this->Send(flv_header, 13);
 
 	has_flv_header_ = true;
 }
@@ -166,8 +189,18 @@ int HttpFlvConnection::SendFlvTag(uint8_t type, uint64_t timestamp, std::shared_
 		return -1;
 	}
 
-	char tag_header[11] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
-	char previous_tag_size[4] = { 0x0, 0x0, 0x0, 0x0 };
+	uint32_t tag_size = 0;
+	std::shared_ptr<char> tag = CreateFlvTag(type, timestamp, payload.get(), payload_size, tag_size);
+	this->Send(tag, tag_size);
+	return 0;
+}
+
+std::shared_ptr<char> HttpFlvConnection::CreateFlvTag(uint8_t type, uint64_t timestamp, const char* payload, uint32_t payload_size, 
+                                                      uint32_t& tag_size)
+{
+	tag_size = 11 + payload_size + 4;
+	std::shared_ptr<char> tag(new char[tag_size], std::default_delete<char[]>());
+	char* tag_header = tag.get();
 
 	tag_header[0] = type;
 	WriteUint24BE(tag_header + 1, payload_size);
@@ -175,12 +208,9 @@ int HttpFlvConnection::SendFlvTag(uint8_t type, uint64_t timestamp, std::shared_
 	tag_header[5] = (timestamp >> 8) & 0xff;
 	tag_header[6] = timestamp & 0xff;
 	tag_header[7] = (timestamp >> 24) & 0xff;
+	tag_header[8] = tag_header[9] = tag_header[10] = 0; /* stream id */
 
-	WriteUint32BE(previous_tag_size, payload_size + 11);
-
-	this->Send(tag_header, 11);
-	this->Send(payload.get(), payload_size);
-	this->Send(previous_tag_size, 4);
-
-	return 0;
-}
\ No newline at end of file
+	memcpy(tag_header + 11, payload, payload_size);
+	WriteUint32BE(tag_header + 11 + payload_size, payload_size + 11);
+	return tag;
+}
@@ -21,7 +21,13 @@ public:
 	bool IsPlaying() const
 	{ return is_playing_; }
 
-	bool SendMediaData(uint8_t type, uint64_t timestamp, std::shared_ptr<char> payload, uint32_t payload_size);
+	/* flv_tag: the frame already serialized by CreateFlvTag, shared with the other viewers */
+	bool SendMediaData(uint8_t type, uint64_t timestamp, std::shared_ptr<char> payload, uint32_t payload_size,
+	                   std::shared_ptr<char> flv_tag = nullptr, uint32_t flv_tag_size = 0);
+
+	/* Tag header, payload and previous tag size in one buffer. */
+	static std::shared_ptr<char> CreateFlvTag(uint8_t type, uint64_t timestamp, const char* payload, uint32_t payload_size,
+	                                          uint32_t& tag_size);
 
 	void ResetKeyFrame()
 	{ has_key_frame_ = false; }
@@ -32,6 +38,10 @@ private:
 	bool OnRead(BufferReader& buffer);
 	void OnClose();
 	
+	/* SendMediaData on the connection's thread, flv_tag is required for video and audio */
+	void WriteMediaData(uint8_t type, std::shared_ptr<char> payload, uint32_t payload_size,
+	                    std::shared_ptr<char> flv_tag, uint32_t flv_tag_size);
+
 	void SendFlvHeader();
 	int  SendFlvTag(uint8_t type, uint64_t timestamp, std::shared_ptr<char> payload, uint32_t payload_size);
 
@@ -47,8 +57,9 @@ private:
 	bool has_flv_header_ = false;
 	bool is_playing_ = false;
 
-	const uint8_t FLV_TAG_TYPE_AUDIO = 0x8;
-	const uint8_t FLV_TAG_TYPE_VIDEO = 0x9;
+public:
+	static const uint8_t FLV_TAG_TYPE_AUDIO = 0x8;
+	static const uint8_t FLV_TAG_TYPE_VIDEO = 0x9;
 };
 
 };
@@ -6,7 +6,7 @@
 #include <cstring>
 #include <ctime>
 #include <map>
-#include <forward_list>
+#include <algorithm>
 #include "net/Logger.h"
 #include "net/SocketUtil.h"
 
@@ -22,9 +22,13 @@ MediaSession::MediaSession(std::string url_suffxx)
 {
 	has_new_client_ = false;
 	session_id_ = ++last_session_id_;
+	client_snapshot_ = new ClientSnapshot;
+	hazard_snapshot_ = nullptr;
+	num_clients_ = 0;
 
 	for(int n=0; n<MAX_MEDIA_CHANNEL; n++) {
 		multicast_port_[n] = 0;
+		gop_frame_begin_[n] = true;
 	}
 }
 
@@ -38,6 +42,11 @@ MediaSession::~MediaSession()
 	if (multicast_ip_ != "") {
 		MulticastAddr::instance().Release(multicast_ip_);
 	}
+
+	delete client_snapshot_.load();
+	for (auto snapshot : retired_snapshots_) {
+		delete snapshot;
+	}
 }
 
 void MediaSession::AddNotifyConnectedCallback(const NotifyConnectedCallback& callback)
@@ -53,49 +62,13 @@ void MediaSession::AddNotifyDisconnectedCallback(const NotifyDisconnectedCallbac
 bool MediaSession::AddSource(MediaChannelId channel_id, MediaSource* source)
 {
 	source->SetSendFrameCallback([this](MediaChannelId channel_id, RtpPacket pkt) {
-		std::forward_list<std::shared_ptr<RtpConnection>> clients;
-		std::map<int, RtpPacket> packets;
-		{
-			std::lock_guard<std::mutex> lock(map_mutex_);
-			for (auto iter = clients_.begin(); iter != clients_.end();) {
-				auto conn = iter->second.lock();
-				if (conn == nullptr) {
-					clients_.erase(iter++);
-				}
-				else  {				
-					int id = conn->GetId();
-					if (id >= 0) {
-						if (packets.find(id) == packets.end()) {
-							RtpPacket tmp_pkt;
-							memcpy(tmp_pkt.data.get(), pkt.data.get(), pkt.size);
-							tmp_pkt.size = pkt.size;
-							tmp_pkt.last = pkt.last;
-							tmp_pkt.timestamp = pkt.timestamp;
-							tmp_pkt.type = pkt.type;
-							packets.emplace(id, tmp_pkt);
-						}
-						clients.emplace_front(conn);
-					}
-					iter++;
-				}
-			}
-		}
-        
-		int count = 0;
-		for(auto iter : clients) {
-			int ret = 0;
-			int id = iter->GetId();
-			if (id >= 0) {
-				auto iter2 = packets.find(id);
-				if (iter2 != packets.end()) {
-					count++;
-					ret = iter->SendRtpPacket(channel_id, iter2->second);
-					if (is_multicast_ && ret == 0) {
-						break;
-					}				
-				}
-			}					
+		/* called from HandleFrame with mutex_ held, sent by SendFramePackets once the frame is done */
+		UpdateGopCache(channel_id, pkt);
+
+		if (frame_packets_ == nullptr) {
+			frame_packets_ = AllocPacketList();
 		}
+		frame_packets_->emplace_back(channel_id, std::move(pkt));
 		return true;
 		});
 
@@ -204,6 +177,7 @@ bool MediaSession::HandleFrame(MediaChannelId channel_id, AVFrame frame)
 
 	if(media_sources_[channel_id]) {
 		media_sources_[channel_id]->HandleFrame(channel_id, frame);
+		SendFramePackets();
 	}
 	else {
 		return false;
@@ -212,6 +186,69 @@ bool MediaSession::HandleFrame(MediaChannelId channel_id, AVFrame frame)
 	return true;
 }
 
+std::shared_ptr<MediaSession::PacketList> MediaSession::AllocPacketList()
+{
+	/* lists the clients are done with are emptied here, so they do not pin packet buffers */
+	std::shared_ptr<PacketList> packets;
+	for (auto& list : packet_lists_) {
+		if (list.use_count() == 1) {
+			/* pairs with the release of the last reference on a connection thread */
+			std::atomic_thread_fence(std::memory_order_acquire);
+			list->clear();
+			if (packets == nullptr) {
+				packets = list;
+			}
+		}
+	}
+
+	if (packets == nullptr) {
+		packets = std::make_shared<PacketList>();
+		if (packet_lists_.size() < kMaxPacketLists) {
+			packet_lists_.push_back(packets);
+		}
+	}
+
+	return packets;
+}
+
+void MediaSession::SendFramePackets()
+{
+	if (frame_packets_ == nullptr) {
+		return;
+	}
+
+	/* the packet buffers are shared read-only by all clients, headers are built per client.
+	   One trigger event per task scheduler hands the frame to every client of that loop. */
+	std::shared_ptr<const PacketList> packets = std::move(frame_packets_);
+
+	bool is_multicast = is_multicast_;
+	const ClientSnapshot* snapshot = AcquireClientSnapshot();
+	for (auto& group : snapshot->groups) {
+		group->task_scheduler->AddTriggerEvent([group, packets, is_multicast] {
+			for (auto& weak_conn : group->rtp_conns) {
+				auto rtp_conn = weak_conn.lock();
+				if (rtp_conn == nullptr) {
+					continue;
+				}
+
+				int ret = -1;
+				for (auto& iter : *packets) {
+					ret = rtp_conn->SendRtpPacket(iter.first, iter.second);
+				}
+
+				if (is_multicast && ret == 0) {
+					break; /* one copy to the group address serves everyone */
+				}
+			}
+		});
+
+		if (is_multicast) {
+			break;
+		}
+	}
+	ReleaseClientSnapshot();
+}
+
 bool MediaSession::AddClient(SOCKET rtspfd, std::shared_ptr<RtpConnection> rtp_conn)
 {
 	std::lock_guard<std::mutex> lock(map_mutex_);
@@ -220,6 +257,16 @@ bool MediaSession::AddClient(SOCKET rtspfd, std::shared_ptr<RtpConnection> rtp_c
 	if(iter == clients_.end()) {
 		std::weak_ptr<RtpConnection> rtp_conn_weak_ptr = rtp_conn;
 		clients_.emplace(rtspfd, rtp_conn_weak_ptr);
+		if (key_frame_request_callback_) {
+			MediaSessionId session_id = session_id_;
+			KeyFrameRequestCallback callback = key_frame_request_callback_;
+			rtp_conn->SetKeyFrameRequestCallback([session_id, callback](MediaChannelId channel_id) {
+				callback(session_id, channel_id);
+			});
+		}
+
+		UpdateClientList();
+
 		for (auto& callback : notify_connected_callbacks_) {
 			callback(session_id_, rtp_conn->GetIp(), rtp_conn->GetPort());
 		}			
@@ -244,6 +291,130 @@ void MediaSession::RemoveClient(SOCKET rtspfd)
 			}				
 		}
 		clients_.erase(iter);
+		UpdateClientList();
+	}
+}
+
+void MediaSession::UpdateClientList()
+{
+	/* rebuilt under map_mutex_ and published whole, a sender keeps the snapshot it pinned */
+	std::vector<std::shared_ptr<ClientGroup>> groups;
+	uint32_t num_clients = 0;
+
+	for (auto iter = clients_.begin(); iter != clients_.end();) {
+		auto rtp_conn = iter->second.lock();
+		if (rtp_conn == nullptr) {
+			clients_.erase(iter++);
+			continue;
+		}
+
+		TaskScheduler* task_scheduler = rtp_conn->GetTaskScheduler();
+		auto group = std::find_if(groups.begin(), groups.end(), [task_scheduler](const std::shared_ptr<ClientGroup>& g) {
+			return g->task_scheduler == task_scheduler;
+		});
+		if (group == groups.end()) {
+			groups.push_back(std::make_shared<ClientGroup>());
+			groups.back()->task_scheduler = task_scheduler;
+			group = groups.end() - 1;
+		}
+
+		(*group)->rtp_conns.push_back(iter->second);
+		num_clients++;
+		iter++;
+	}
+
+	ClientSnapshot* snapshot = new ClientSnapshot;
+	snapshot->groups.assign(groups.begin(), groups.end());
+	num_clients_ = num_clients;
+
+	retired_snapshots_.push_back(client_snapshot_.exchange(snapshot));
+	ReclaimClientSnapshots();
+}
+
+const MediaSession::ClientSnapshot* MediaSession::AcquireClientSnapshot()
+{
+	/* the hazard must be visible before the snapshot is checked to be still current,
+	   a writer that swapped it out earlier may not have seen the hazard */
+	const ClientSnapshot* snapshot = client_snapshot_.load();
+	for (;;) {
+		hazard_snapshot_.store(snapshot);
+		const ClientSnapshot* current = client_snapshot_.load();
+		if (current == snapshot) {
+			return snapshot;
+		}
+		snapshot = current;
+	}
+}
+
+void MediaSession::ReleaseClientSnapshot()
+{
+	hazard_snapshot_.store(nullptr);
+}
+
+void MediaSession::ReclaimClientSnapshots()
+{
+	/* everything retired but the one a sender may still be reading */
+	const ClientSnapshot* hazard = hazard_snapshot_.load();
+	for (auto iter = retired_snapshots_.begin(); iter != retired_snapshots_.end();) {
+		if (*iter != hazard) {
+			delete *iter;
+			iter = retired_snapshots_.erase(iter);
+		}
+		else {
+			iter++;
+		}
+	}
+}
+
+void MediaSession::SetGopCache(uint32_t max_bytes)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	max_gop_cache_bytes_ = max_bytes;
+	gop_cache_.clear();
+	gop_cache_bytes_ = 0;
+	gop_cache_valid_ = false;
+}
+
+void MediaSession::UpdateGopCache(MediaChannelId channel_id, const RtpPacket& pkt)
+{
+	bool frame_begin = gop_frame_begin_[channel_id];
+	gop_frame_begin_[channel_id] = (pkt.last != 0);
+
+	if (max_gop_cache_bytes_ == 0 || is_multicast_) {
+		return;
+	}
+
+	if (frame_begin && pkt.type == VIDEO_FRAME_I) {
+		gop_cache_.clear();
+		gop_cache_bytes_ = 0;
+		gop_cache_valid_ = true;
+	}
+
+	if (!gop_cache_valid_) {
+		return;
+	}
+
+	if (gop_cache_bytes_ + pkt.size > max_gop_cache_bytes_) {
+		/* too long a GOP, clients wait for the next key frame as before */
+		gop_cache_.clear();
+		gop_cache_bytes_ = 0;
+		gop_cache_valid_ = false;
+		return;
 	}
+
+	gop_cache_.emplace_back(channel_id, pkt);
+	gop_cache_bytes_ += pkt.size;
 }
 
+bool MediaSession::SendGopCache(std::shared_ptr<RtpConnection> rtp_conn)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (gop_cache_.empty() || rtp_conn == nullptr) {
+		return false;
+	}
+
+	auto packets = std::make_shared<RtpConnection::PacketList>(gop_cache_);
+	return rtp_conn->ReplayGopCache(packets);
+}
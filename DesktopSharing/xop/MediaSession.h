@@ -25,6 +25,7 @@ namespace xop
 {
 
 class RtpConnection;
+class TaskScheduler;
 
 class MediaSession
 {
@@ -32,6 +33,7 @@ public:
 	using Ptr = std::shared_ptr<MediaSession>;
 	using NotifyConnectedCallback = std::function<void (MediaSessionId sessionId, std::string peer_ip, uint16_t peer_port)> ;
 	using NotifyDisconnectedCallback = std::function<void (MediaSessionId sessionId, std::string peer_ip, uint16_t peer_port)> ;
+	using KeyFrameRequestCallback = std::function<void (MediaSessionId sessionId, MediaChannelId channel_id)>;
 
 	static MediaSession* CreateNew(std::string url_suffix="live");
 	virtual ~MediaSession();
@@ -44,6 +46,10 @@ public:
 	void AddNotifyConnectedCallback(const NotifyConnectedCallback& callback);
 	void AddNotifyDisconnectedCallback(const NotifyDisconnectedCallback& callback);
 
+	/* Called when a congested client has drained its queue and needs a key frame to resume. */
+	void SetKeyFrameRequestCallback(const KeyFrameRequestCallback& callback)
+	{ key_frame_request_callback_ = callback; }
+
 	std::string GetRtspUrlSuffix() const
 	{ return suffix_; }
 
@@ -59,11 +65,24 @@ public:
 	bool AddClient(SOCKET rtspfd, std::shared_ptr<RtpConnection> rtp_conn);
 	void RemoveClient(SOCKET rtspfd);
 
+	/* Packets from the last key frame are kept and replayed to clients that start playing,
+	   so they do not wait for the next GOP. Off (0) by default: while it is on, frames are
+	   packetized even with no client watching. kDefaultGopCacheBytes is a sensible size. */
+	void SetGopCache(uint32_t max_bytes);
+
+	bool IsGopCacheEnabled() const
+	{ return max_gop_cache_bytes_ != 0 && !is_multicast_; }
+
+	/* Call on the client's connection thread when it starts playing. */
+	bool SendGopCache(std::shared_ptr<RtpConnection> rtp_conn);
+
+	static const uint32_t kDefaultGopCacheBytes = 4 * 1024 * 1024;
+
 	MediaSessionId GetMediaSessionId()
 	{ return session_id_; }
 
 	uint32_t GetNumClient() const
-	{ return (uint32_t)clients_.size(); }
+	{ return num_clients_; }
 
 	bool IsMulticast() const
 	{ return is_multicast_; }
@@ -84,6 +103,34 @@ private:
 	friend class RtspServer;
 	MediaSession(std::string url_suffxx);
 
+	using PacketList = std::vector<std::pair<MediaChannelId, RtpPacket>>;
+
+	void UpdateGopCache(MediaChannelId channel_id, const RtpPacket& pkt);
+	void UpdateClientList();
+
+	/* The packets of one frame are collected in a pooled list and posted once per frame,
+	   the per-packet path only appends to it. */
+	std::shared_ptr<PacketList> AllocPacketList();
+	void SendFramePackets();
+
+	/* The clients of one task scheduler, a frame reaches all of them with one trigger event. */
+	struct ClientGroup
+	{
+		TaskScheduler* task_scheduler;
+		std::vector<std::weak_ptr<RtpConnection>> rtp_conns;
+	};
+
+	/* Immutable once published. The sender pins it with a hazard pointer instead of a lock,
+	   senders are serialized by mutex_ (HandleFrame) so one hazard slot is enough. */
+	struct ClientSnapshot
+	{
+		std::vector<std::shared_ptr<const ClientGroup>> groups;
+	};
+
+	const ClientSnapshot* AcquireClientSnapshot();
+	void ReleaseClientSnapshot();
+	void ReclaimClientSnapshots();
+
 	MediaSessionId session_id_ = 0;
 	std::string suffix_;
 	std::string sdp_;
@@ -93,15 +140,32 @@ private:
 
 	std::vector<NotifyConnectedCallback> notify_connected_callbacks_;
 	std::vector<NotifyDisconnectedCallback> notify_disconnected_callbacks_;
+	KeyFrameRequestCallback key_frame_request_callback_;
 	std::mutex mutex_;
 	std::mutex map_mutex_;
 	std::map<SOCKET, std::weak_ptr<RtpConnection>> clients_;
+	std::atomic<const ClientSnapshot*> client_snapshot_;
+	std::atomic<const ClientSnapshot*> hazard_snapshot_;
+	std::vector<const ClientSnapshot*> retired_snapshots_; /* guarded by map_mutex_ */
+	std::atomic<uint32_t> num_clients_;
 
 	bool is_multicast_ = false;
 	uint16_t multicast_port_[MAX_MEDIA_CHANNEL];
 	std::string multicast_ip_;
 	std::atomic_bool has_new_client_;
 
+	/* guarded by mutex_, packet buffers are shared with the clients */
+	std::atomic<uint32_t> max_gop_cache_bytes_{ 0 };
+	uint32_t gop_cache_bytes_ = 0;
+	bool gop_cache_valid_ = false;
+	bool gop_frame_begin_[MAX_MEDIA_CHANNEL];
+	std::vector<std::pair<MediaChannelId, RtpPacket>> gop_cache_;
+
+	/* guarded by mutex_, a pooled list is free again once only the pool holds it */
+	std::shared_ptr<PacketList> frame_packets_;
+	std::vector<std::shared_ptr<PacketList>> packet_lists_;
+	static const size_t kMaxPacketLists = 8;
+
 	static std::atomic_uint last_session_id_;
 };
 
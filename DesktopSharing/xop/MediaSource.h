@@ -41,10 +41,18 @@ public:
 	virtual uint32_t GetClockRate() const
 	{ return clock_rate_; }
 
+	/* RFC 4588 payload type for NACKed retransmissions, 0 resends on the original stream */
+	virtual uint32_t GetRtxPayloadType() const
+	{ return rtx_payload_; }
+
+	void SetRtxPayloadType(uint32_t payload)
+	{ rtx_payload_ = payload; }
+
 protected:
 	MediaType media_type_ = NONE;
 	uint32_t  payload_    = 0;
 	uint32_t  clock_rate_ = 0;
+	uint32_t  rtx_payload_ = 0;
 	SendFrameCallback send_frame_callback_;
 };
 
@@ -17,44 +17,63 @@ RtmpChunk::~RtmpChunk()
 
 int RtmpChunk::Parse(BufferReader& in_buffer, RtmpMessage& out_rtmp_msg)
 {
-	int ret = 0;
+	int bytes_used = 0;
 
-	if (!in_buffer.ReadableBytes()) {
-		return 0;
-	}
-
-	if (state_ == PARSE_HEADER) {
-		ret = ParseChunkHeader(in_buffer);
-	}
-	else if (state_ == PARSE_BODY)
-	{
-		ret = ParseChunkBody(in_buffer);
-		if (ret > 0 && chunk_stream_id_ >= 0) {
-			auto& rtmp_msg = rtmp_messages_[chunk_stream_id_];
+	/* walk every complete chunk in the buffer, but stop at the end of a message:
+	   it may change the in chunk size for the chunks behind it */
+	while (in_buffer.ReadableBytes() > 0) {
+		State state = state_;
+		int ret = 0;
 
-			if (rtmp_msg.index == rtmp_msg.length) {
-				if (rtmp_msg.timestamp >= 0xffffff) {
-					rtmp_msg._timestamp += rtmp_msg.extend_timestamp;
-				}
-				else {
-					rtmp_msg._timestamp += rtmp_msg.timestamp;
+		if (state_ == PARSE_HEADER) {
+			ret = ParseChunkHeader(in_buffer);
+		}
+		else if (state_ == PARSE_BODY) {
+			ret = ParseChunkBody(in_buffer);
+			if (ret > 0 && chunk_stream_id_ >= 0) {
+				auto& rtmp_msg = rtmp_messages_[chunk_stream_id_];
+
+				if (rtmp_msg.index == rtmp_msg.length) {
+					if (rtmp_msg.timestamp >= 0xffffff) {
+						rtmp_msg._timestamp += rtmp_msg.extend_timestamp;
+					}
+					else {
+						rtmp_msg._timestamp += rtmp_msg.timestamp;
+					}
+
+					/* the payload leaves with the message, the next one gets its own */
+					out_rtmp_msg = std::move(rtmp_msg);
+					rtmp_msg.Clear();
+					chunk_stream_id_ = -1;
+					return bytes_used + ret;
 				}
-
-				out_rtmp_msg = rtmp_msg;
-				chunk_stream_id_ = -1;
-				rtmp_msg.Clear();
 			}
 		}
+
+		if (ret < 0) {
+			return -1;
+		}
+
+		if (ret == 0 && state == state_) {
+			break;
+		}
+
+		bytes_used += ret;
 	}
 
-	return ret;
+	return bytes_used;
 }
 
 int RtmpChunk::ParseChunkHeader(BufferReader& buffer)
 {
+	/* basic header (3) + message header (11) + extended timestamp (4) at most,
+	   only those bytes are made contiguous */
 	uint32_t bytes_used = 0;
-	uint8_t* buf = (uint8_t*)buffer.Peek();
 	uint32_t buf_size = buffer.ReadableBytes();
+	if (buf_size > kMaxChunkHeaderSize) {
+		buf_size = kMaxChunkHeaderSize;
+	}
+	uint8_t* buf = (uint8_t*)buffer.Pullup(buf_size);
 
 	uint8_t flags = buf[bytes_used];
 	bytes_used += 1;
@@ -86,39 +105,41 @@ int RtmpChunk::ParseChunkHeader(BufferReader& buffer)
 		return 0;
 	}
 
-	RtmpMessageHeader header;
-	memset(&header, 0, sizeof(RtmpMessageHeader));
-	memcpy(&header, buf + bytes_used, header_len);
+	/* fields are read in place: timestamp[3] length[3] type_id stream_id[4] */
+	char* header = (char*)buf + bytes_used;
 	bytes_used += header_len;
 
 	auto& rtmp_msg = rtmp_messages_[csid];
+	uint32_t timestamp = (header_len >= 3) ? ReadUint24BE(header) : 0;
+	uint32_t extend_timestamp = 0;
+	if (timestamp >= 0xffffff || rtmp_msg.timestamp >= 0xffffff) {
+		if (buf_size < (4 + bytes_used)) {
+			return 0;
+		}
+		extend_timestamp = ReadUint32BE((char*)buf + bytes_used);
+		bytes_used += 4;
+	}
+
 	chunk_stream_id_ = rtmp_msg.csid = csid;
 
 	if (fmt == RTMP_CHUNK_TYPE_0 || fmt == RTMP_CHUNK_TYPE_1) {
-		uint32_t length = ReadUint24BE((char*)header.length);
-		if (rtmp_msg.length != length || !rtmp_msg.payload) {
-			rtmp_msg.length = length;
-			rtmp_msg.payload.reset(new char[rtmp_msg.length], std::default_delete<char[]>());
+		if (rtmp_msg.index > 0) { // a new message replaces the unfinished one
+			rtmp_msg.payload.reset();
 		}
+		rtmp_msg.length = ReadUint24BE(header + 3);
 		rtmp_msg.index = 0;
-		rtmp_msg.type_id = header.type_id;
+		rtmp_msg.type_id = header[6];
 	}
 
 	if (fmt == RTMP_CHUNK_TYPE_0) {
-		rtmp_msg.stream_id = ReadUint24LE((char*)header.stream_id);
+		rtmp_msg.stream_id = ReadUint24LE(header + 7);
 	}
 
-	uint32_t timestamp = ReadUint24BE((char*)header.timestamp);
-	uint32_t extend_timestamp = 0;
-	if (timestamp >= 0xffffff || rtmp_msg.timestamp >= 0xffffff) {
-		if (buf_size < (4 + bytes_used)) {
-			return 0;
+	if (rtmp_msg.index == 0) { // first chunk
+		if (!rtmp_msg.payload && rtmp_msg.length > 0) {
+			rtmp_msg.payload = AllocPayload(rtmp_msg.length);
 		}
-		extend_timestamp = ReadUint32BE((char*)buf + bytes_used);
-		bytes_used += 4;
-	}
 
-	if (rtmp_msg.index == 0) { // first chunk
 		if (fmt == RTMP_CHUNK_TYPE_0) {
 			// absolute timestamp 
 			rtmp_msg._timestamp = 0;
@@ -144,7 +165,6 @@ int RtmpChunk::ParseChunkHeader(BufferReader& buffer)
 int RtmpChunk::ParseChunkBody(BufferReader& buffer)
 {
 	uint32_t bytes_used = 0;
-	uint8_t* buf = (uint8_t*)buffer.Peek();
 	uint32_t buf_size = buffer.ReadableBytes();
 
 	if (chunk_stream_id_ < 0) {
@@ -166,7 +186,8 @@ int RtmpChunk::ParseChunkBody(BufferReader& buffer)
 		return -1;
 	}
 
-	memcpy(rtmp_msg.payload.get() + rtmp_msg.index, buf + bytes_used, chunk_size);
+	/* copied block by block, straight out of the read buffer */
+	buffer.ReadBytes(rtmp_msg.payload.get() + rtmp_msg.index, chunk_size);
 	bytes_used += chunk_size;
 	rtmp_msg.index += chunk_size;
 
@@ -175,10 +196,50 @@ int RtmpChunk::ParseChunkBody(BufferReader& buffer)
 		state_ = PARSE_HEADER;
 	}
 
-	buffer.Retrieve(bytes_used);
 	return bytes_used;
 }
 
+std::shared_ptr<char> RtmpChunk::AllocPayload(uint32_t size)
+{
+	if (size > kMaxPooledPayloadSize) {
+		return std::shared_ptr<char>(new char[size], std::default_delete<char[]>());
+	}
+
+	/* a pooled buffer is free again once the pool holds the only reference,
+	   the players and the gop cache may still be reading the others */
+	PooledPayload* best = nullptr;
+	for (auto& buf : payload_pool_) {
+		if (buf.capacity >= size && buf.data.use_count() == 1 &&
+			(best == nullptr || buf.capacity < best->capacity)) {
+			best = &buf;
+		}
+	}
+
+	if (best != nullptr) {
+		/* pairs with the release of the last reference on another thread */
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return best->data;
+	}
+
+	uint32_t capacity = (size + 4095) & ~4095u;
+	std::shared_ptr<char> data(new char[capacity], std::default_delete<char[]>());
+
+	if (payload_pool_.size() < kMaxPooledPayloads) {
+		payload_pool_.push_back({ capacity, data });
+	}
+	else {
+		/* swap out a smaller idle buffer so the pool follows the stream's frame sizes */
+		for (auto& buf : payload_pool_) {
+			if (buf.capacity < capacity && buf.data.use_count() == 1) {
+				buf = { capacity, data };
+				break;
+			}
+		}
+	}
+
+	return data;
+}
+
 int RtmpChunk::CreateBasicHeader(uint8_t fmt, uint32_t csid, char* buf)
 {
 	int len = 0;
@@ -198,7 +259,7 @@ int RtmpChunk::CreateBasicHeader(uint8_t fmt, uint32_t csid, char* buf)
 	return len;
 }
 
-int RtmpChunk::CreateMessageHeader(uint8_t fmt, RtmpMessage& rtmp_msg, char* buf)
+int RtmpChunk::CreateMessageHeader(uint8_t fmt, const RtmpMessage& rtmp_msg, char* buf)
 {
 	int len = 0;
 
@@ -228,40 +289,103 @@ int RtmpChunk::CreateMessageHeader(uint8_t fmt, RtmpMessage& rtmp_msg, char* buf
 
 int RtmpChunk::CreateChunk(uint32_t csid, RtmpMessage& rtmp_msg, char* buf, uint32_t buf_size)
 {
-	uint32_t buf_offset = 0, payload_offset = 0;
 	uint32_t capacity = rtmp_msg.length + rtmp_msg.length / out_chunk_size_ * 5;
 	if (buf_size < capacity) {
 		return -1;
 	}
 
-	buf_offset += CreateBasicHeader(0, csid, buf + buf_offset); //first chunk
-	buf_offset += CreateMessageHeader(0, rtmp_msg, buf + buf_offset);
+	int header_size = CreateChunkHeader(csid, rtmp_msg, buf); //first chunk
+	int body_size = CreateChunkBody(csid, out_chunk_size_, rtmp_msg, buf + header_size, buf_size - header_size);
+	if (body_size < 0) {
+		return -1;
+	}
+
+	rtmp_msg.length = 0;
+	return header_size + body_size;
+}
+
+int RtmpChunk::CreateChunkHeader(uint32_t csid, const RtmpMessage& rtmp_msg, char* buf)
+{
+	int len = 0;
+
+	len += CreateBasicHeader(0, csid, buf + len);
+	len += CreateMessageHeader(0, rtmp_msg, buf + len);
+	if (rtmp_msg._timestamp >= 0xffffff) {
+		WriteUint32BE(buf + len, (uint32_t)rtmp_msg._timestamp);
+		len += 4;
+	}
+
+	return len;
+}
+
+uint32_t RtmpChunk::GetChunkBodySize(uint32_t csid, uint32_t chunk_size, const RtmpMessage& rtmp_msg)
+{
+	char basic_header[3];
+	uint32_t header_size = CreateBasicHeader(3, csid, basic_header);
 	if (rtmp_msg._timestamp >= 0xffffff) {
-		WriteUint32BE((char*)buf + buf_offset, (uint32_t)rtmp_msg._timestamp);
-		buf_offset += 4;
+		header_size += 4;
+	}
+
+	uint32_t num_headers = rtmp_msg.length > 0 ? (rtmp_msg.length - 1) / chunk_size : 0;
+	return rtmp_msg.length + num_headers * header_size;
+}
+
+int RtmpChunk::CreateChunkBody(uint32_t csid, uint32_t chunk_size, const RtmpMessage& rtmp_msg, char* buf, uint32_t buf_size)
+{
+	uint32_t buf_offset = 0, payload_offset = 0;
+	if (buf_size < GetChunkBodySize(csid, chunk_size, rtmp_msg)) {
+		return -1;
 	}
 
-	while (rtmp_msg.length > 0)
+	while (rtmp_msg.length - payload_offset > chunk_size)
 	{
-		if (rtmp_msg.length > out_chunk_size_) {
-			memcpy(buf + buf_offset, rtmp_msg.payload.get() + payload_offset, out_chunk_size_);
-			payload_offset += out_chunk_size_;
-			buf_offset += out_chunk_size_;
-			rtmp_msg.length -= out_chunk_size_;
-
-			buf_offset += CreateBasicHeader(3, csid, buf + buf_offset);
-			if (rtmp_msg._timestamp >= 0xffffff) {
-				WriteUint32BE(buf + buf_offset, (uint32_t)rtmp_msg._timestamp);
-				buf_offset += 4;
-			}
-		}
-		else {
-			memcpy(buf + buf_offset, rtmp_msg.payload.get() + payload_offset, rtmp_msg.length);
-			buf_offset += rtmp_msg.length;
-			rtmp_msg.length = 0;
-			break;
+		memcpy(buf + buf_offset, rtmp_msg.payload.get() + payload_offset, chunk_size);
+		payload_offset += chunk_size;
+		buf_offset += chunk_size;
+
+		buf_offset += CreateBasicHeader(3, csid, buf + buf_offset);
+		if (rtmp_msg._timestamp >= 0xffffff) {
+			WriteUint32BE(buf + buf_offset, (uint32_t)rtmp_msg._timestamp);
+			buf_offset += 4;
 		}
 	}
 
+	memcpy(buf + buf_offset, rtmp_msg.payload.get() + payload_offset, rtmp_msg.length - payload_offset);
+	buf_offset += rtmp_msg.length - payload_offset;
 	return buf_offset;
-}
\ No newline at end of file
+}
+
+RtmpChunkCache::RtmpChunkCache(uint64_t timestamp, std::shared_ptr<char> payload, uint32_t size)
+{
+	rtmp_msg_._timestamp = timestamp;
+	rtmp_msg_.payload = payload;
+	rtmp_msg_.length = size;
+}
+
+uint32_t RtmpChunkCache::GetChunkBody(uint32_t csid, uint32_t chunk_size, std::shared_ptr<char>& body)
+{
+	/* a single chunk needs no fmt-3 headers, the payload is the body */
+	if (rtmp_msg_.length <= chunk_size) {
+		body = rtmp_msg_.payload;
+		return rtmp_msg_.length;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	for (auto& iter : bodies_) {
+		if (iter.csid == csid && iter.chunk_size == chunk_size) {
+			body = iter.data;
+			return iter.size;
+		}
+	}
+
+	uint32_t size = RtmpChunk::GetChunkBodySize(csid, chunk_size, rtmp_msg_);
+	std::shared_ptr<char> data(new char[size], std::default_delete<char[]>());
+	if (RtmpChunk::CreateChunkBody(csid, chunk_size, rtmp_msg_, data.get(), size) < 0) {
+		return 0;
+	}
+
+	bodies_.push_back({ csid, chunk_size, size, data });
+	body = data;
+	return size;
+}
@@ -5,7 +5,10 @@
 #include "net/BufferReader.h"
 #include "RtmpMessage.h"
 #include "amf.h"
+#include <atomic>
 #include <map>
+#include <mutex>
+#include <vector>
 
 namespace xop {
 
@@ -18,19 +21,35 @@ public:
 		PARSE_BODY,
 	};
 
+	static const uint32_t kMaxChunkHeaderSize = 3 + 11 + 4;
+
 	RtmpChunk();
 	virtual ~RtmpChunk();
 
+	/* Consumes chunks until a message completes or the buffer runs short,
+	   the message is moved out with a payload the parser no longer touches. */
 	int Parse(BufferReader& in_buffer, RtmpMessage& out_rtmp_msg);
 
 	int CreateChunk(uint32_t csid, RtmpMessage& rtmp_msg, char* buf, uint32_t buf_size);
 
+	/* The basic and fmt-0 message header of the first chunk, at most kMaxChunkHeaderSize bytes. */
+	static int CreateChunkHeader(uint32_t csid, const RtmpMessage& rtmp_msg, char* buf);
+
+	/* The payload split into chunk_size pieces with the fmt-3 headers in between,
+	   everything that follows the first chunk header. */
+	static int CreateChunkBody(uint32_t csid, uint32_t chunk_size, const RtmpMessage& rtmp_msg, char* buf, uint32_t buf_size);
+
+	static uint32_t GetChunkBodySize(uint32_t csid, uint32_t chunk_size, const RtmpMessage& rtmp_msg);
+
 	void SetInChunkSize(uint32_t in_chunk_size)
 	{ in_chunk_size_ = in_chunk_size; }
 
 	void SetOutChunkSize(uint32_t out_chunk_size)
 	{ out_chunk_size_ = out_chunk_size; }
 
+	uint32_t GetOutChunkSize() const
+	{ return out_chunk_size_; }
+
 	void Clear() 
 	{ rtmp_messages_.clear(); }
 
@@ -40,8 +59,15 @@ public:
 private:
 	int ParseChunkHeader(BufferReader& buffer);
 	int ParseChunkBody(BufferReader& buffer);
-	int CreateBasicHeader(uint8_t fmt, uint32_t csid, char* buf);
-	int CreateMessageHeader(uint8_t fmt, RtmpMessage& rtmp_msg, char* buf);
+	static int CreateBasicHeader(uint8_t fmt, uint32_t csid, char* buf);
+	static int CreateMessageHeader(uint8_t fmt, const RtmpMessage& rtmp_msg, char* buf);
+	std::shared_ptr<char> AllocPayload(uint32_t size);
+
+	struct PooledPayload
+	{
+		uint32_t capacity;
+		std::shared_ptr<char> data;
+	};
 
 	State state_;
 	int chunk_stream_id_ = 0;
@@ -49,11 +75,42 @@ private:
 	uint32_t in_chunk_size_ = 128;
 	uint32_t out_chunk_size_ = 128;
 	std::map<int, RtmpMessage> rtmp_messages_;
+	std::vector<PooledPayload> payload_pool_;
+
+	static const uint32_t kMaxPooledPayloads = 16;
+	static const uint32_t kMaxPooledPayloadSize = 1024 * 1024;
 
 	const int kDefaultStreamId = 1;
 	const int kChunkMessageHeaderLen[4] = { 11, 7, 3, 0 };
 };
 
+/* A media message chunked once for all the players it goes to. Bodies are built
+   on first use for each (out chunk size, csid) and shared, the type and stream id
+   only appear in the fmt-0 header that every connection writes for itself. */
+class RtmpChunkCache
+{
+public:
+	RtmpChunkCache(uint64_t timestamp, std::shared_ptr<char> payload, uint32_t size);
+
+	const RtmpMessage& GetMessage() const
+	{ return rtmp_msg_; }
+
+	uint32_t GetChunkBody(uint32_t csid, uint32_t chunk_size, std::shared_ptr<char>& body);
+
+private:
+	struct ChunkBody
+	{
+		uint32_t csid;
+		uint32_t chunk_size;
+		uint32_t size;
+		std::shared_ptr<char> data;
+	};
+
+	RtmpMessage rtmp_msg_;
+	std::mutex mutex_;
+	std::vector<ChunkBody> bodies_;
+};
+
 }
 
 
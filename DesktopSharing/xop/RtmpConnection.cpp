@@ -41,6 +41,9 @@ RtmpConnection::RtmpConnection(TaskScheduler *task_scheduler, SOCKET sockfd, Rtm
 	peer_bandwidth_ = rtmp->GetPeerBandwidth();
 	acknowledgement_size_ = rtmp->GetAcknowledgementSize();
 	max_gop_cache_len_ = rtmp->GetGopCacheLen();
+	max_gop_cache_bytes_ = rtmp->GetGopCacheBytes();
+	max_gop_cache_duration_ = rtmp->GetGopCacheDuration();
+	gop_cache_mode_ = rtmp->GetGopCacheMode();
 	max_chunk_size_ = rtmp->GetChunkSize();
 	stream_path_ = rtmp->GetStreamPath();
 	stream_name_ = rtmp->GetStreamName();
@@ -571,6 +574,8 @@ bool RtmpConnection::HandlePublish()
     auto session = server->GetSession(stream_path_);
     if(session) {
 		session->SetGopCache(max_gop_cache_len_);
+		session->SetGopCacheLimit(max_gop_cache_bytes_, max_gop_cache_duration_);
+		session->SetGopCacheMode(gop_cache_mode_);
 		session->AddRtmpClient(std::dynamic_pointer_cast<RtmpConnection>(shared_from_this()));
     }        
 
@@ -841,7 +846,8 @@ bool RtmpConnection::IsKeyFrame(std::shared_ptr<char> payload, uint32_t payload_
 	return (frame_type == 1 && codec_id == RTMP_CODEC_ID_H264);
 }
 
-bool RtmpConnection::SendMediaData(uint8_t type, uint64_t timestamp, std::shared_ptr<char> payload, uint32_t payload_size)
+bool RtmpConnection::SendMediaData(uint8_t type, uint64_t timestamp, std::shared_ptr<char> payload, uint32_t payload_size,
+                                   std::shared_ptr<RtmpChunkCache> chunk_cache)
 {
     if(this->IsClosed()) {
         return false;
@@ -853,6 +859,20 @@ bool RtmpConnection::SendMediaData(uint8_t type, uint64_t timestamp, std::shared
 
 	is_playing_ = true;
 
+	if (chunk_cache == nullptr) {
+		chunk_cache = std::make_shared<RtmpChunkCache>(timestamp, payload, payload_size);
+	}
+
+	auto conn = std::dynamic_pointer_cast<RtmpConnection>(shared_from_this());
+	task_scheduler_->AddTriggerEvent([conn, type, payload, payload_size, chunk_cache] {
+		conn->WriteMediaData(type, payload, payload_size, *chunk_cache);
+	});
+   
+    return true;
+}
+
+void RtmpConnection::WriteMediaData(uint8_t type, std::shared_ptr<char> payload, uint32_t payload_size, RtmpChunkCache& chunk_cache)
+{
 	if (type == RTMP_AVC_SEQUENCE_HEADER) {
 		avc_sequence_header_ = payload;
 		avc_sequence_header_size_ = payload_size;
@@ -862,36 +882,23 @@ bool RtmpConnection::SendMediaData(uint8_t type, uint64_t timestamp, std::shared
 		aac_sequence_header_size_ = payload_size;
 	}
 
-	auto conn = std::dynamic_pointer_cast<RtmpConnection>(shared_from_this());
-	task_scheduler_->AddTriggerEvent([conn, type, timestamp, payload, payload_size] {
-		if (!conn->has_key_frame_ && conn->avc_sequence_header_size_ > 0
-			&& (type != RTMP_AVC_SEQUENCE_HEADER)
-			&& (type != RTMP_AAC_SEQUENCE_HEADER)) {
-			if (conn->IsKeyFrame(payload, payload_size)) {
-				conn->has_key_frame_ = true;
-			}
-			else {
-				return ;
-			}
-		}
-
-		RtmpMessage rtmp_msg;
-		rtmp_msg._timestamp = timestamp;
-		rtmp_msg.stream_id = conn->stream_id_;
-		rtmp_msg.payload = payload;
-		rtmp_msg.length = payload_size;
-
-		if (type == RTMP_VIDEO || type == RTMP_AVC_SEQUENCE_HEADER) {
-			rtmp_msg.type_id = RTMP_VIDEO;
-			conn->SendRtmpChunks(RTMP_CHUNK_VIDEO_ID, rtmp_msg);
+	if (!has_key_frame_ && avc_sequence_header_size_ > 0
+		&& (type != RTMP_AVC_SEQUENCE_HEADER)
+		&& (type != RTMP_AAC_SEQUENCE_HEADER)) {
+		if (IsKeyFrame(payload, payload_size)) {
+			has_key_frame_ = true;
 		}
-		else if (type == RTMP_AUDIO || type == RTMP_AAC_SEQUENCE_HEADER) {
-			rtmp_msg.type_id = RTMP_AUDIO;
-			conn->SendRtmpChunks(RTMP_CHUNK_AUDIO_ID, rtmp_msg);
+		else {
+			return ;
 		}
-	});
-   
-    return true;
+	}
+
+	if (type == RTMP_VIDEO || type == RTMP_AVC_SEQUENCE_HEADER) {
+		SendRtmpChunks(RTMP_CHUNK_VIDEO_ID, RTMP_VIDEO, chunk_cache);
+	}
+	else if (type == RTMP_AUDIO || type == RTMP_AAC_SEQUENCE_HEADER) {
+		SendRtmpChunks(RTMP_CHUNK_AUDIO_ID, RTMP_AUDIO, chunk_cache);
+	}
 }
 
 bool RtmpConnection::SendVideoData(uint64_t timestamp, std::shared_ptr<char> payload, uint32_t payload_size)
@@ -901,14 +908,9 @@ bool RtmpConnection::SendVideoData(uint64_t timestamp, std::shared_ptr<char> pay
 	}
 	
 	auto conn = std::dynamic_pointer_cast<RtmpConnection>(shared_from_this());
-	task_scheduler_->AddTriggerEvent([conn, timestamp, payload, payload_size] {
-		RtmpMessage rtmp_msg;
-		rtmp_msg.type_id = RTMP_VIDEO;
-		rtmp_msg._timestamp = timestamp;
-		rtmp_msg.stream_id = conn->stream_id_;
-		rtmp_msg.payload = payload;
-		rtmp_msg.length = payload_size;
-		conn->SendRtmpChunks(RTMP_CHUNK_VIDEO_ID, rtmp_msg);
+	auto chunk_cache = std::make_shared<RtmpChunkCache>(timestamp, payload, payload_size);
+	task_scheduler_->AddTriggerEvent([conn, chunk_cache] {
+		conn->SendRtmpChunks(RTMP_CHUNK_VIDEO_ID, RTMP_VIDEO, *chunk_cache);
 	});
 
 	return true;
@@ -921,14 +923,9 @@ bool RtmpConnection::SendAudioData(uint64_t timestamp, std::shared_ptr<char> pay
 	}
 
 	auto conn = std::dynamic_pointer_cast<RtmpConnection>(shared_from_this());
-	task_scheduler_->AddTriggerEvent([conn, timestamp, payload, payload_size] {
-		RtmpMessage rtmp_msg;
-		rtmp_msg.type_id = RTMP_AUDIO;
-		rtmp_msg._timestamp = timestamp;
-		rtmp_msg.stream_id = conn->stream_id_;
-		rtmp_msg.payload = payload;
-		rtmp_msg.length = payload_size;
-		conn->SendRtmpChunks(RTMP_CHUNK_VIDEO_ID, rtmp_msg);
+	auto chunk_cache = std::make_shared<RtmpChunkCache>(timestamp, payload, payload_size);
+	task_scheduler_->AddTriggerEvent([conn, chunk_cache] {
+		conn->SendRtmpChunks(RTMP_CHUNK_VIDEO_ID, RTMP_AUDIO, *chunk_cache);
 	});
 	return true;
 }
@@ -944,3 +941,21 @@ void RtmpConnection::SendRtmpChunks(uint32_t csid, RtmpMessage& rtmp_msg)
 	}
 }
 
+void RtmpConnection::SendRtmpChunks(uint32_t csid, uint8_t type_id, RtmpChunkCache& chunk_cache)
+{
+	std::shared_ptr<char> body;
+	uint32_t body_size = chunk_cache.GetChunkBody(csid, rtmp_chunk_->GetOutChunkSize(), body);
+	if (body_size == 0) {
+		return;
+	}
+
+	RtmpMessage rtmp_msg = chunk_cache.GetMessage();
+	rtmp_msg.type_id = type_id;
+	rtmp_msg.stream_id = stream_id_;
+
+	/* only the first chunk header is ours, the body goes out in place */
+	char header[RtmpChunk::kMaxChunkHeaderSize];
+	int header_size = RtmpChunk::CreateChunkHeader(csid, rtmp_msg, header);
+	this->Send(header, header_size, body, body_size);
+}
+
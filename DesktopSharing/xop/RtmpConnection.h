@@ -118,10 +118,15 @@ private:
     bool SendNotifyMessage(uint32_t csid, std::shared_ptr<char> payload, uint32_t payload_size);   
     bool SendMetaData(AmfObjects metaData);
 	bool IsKeyFrame(std::shared_ptr<char> payload, uint32_t payload_size);
-    bool SendMediaData(uint8_t type, uint64_t timestamp, std::shared_ptr<char> payload, uint32_t payload_size);
+    bool SendMediaData(uint8_t type, uint64_t timestamp, std::shared_ptr<char> payload, uint32_t payload_size,
+                       std::shared_ptr<RtmpChunkCache> chunk_cache = nullptr);
 	bool SendVideoData(uint64_t timestamp, std::shared_ptr<char> payload, uint32_t payload_size);
 	bool SendAudioData(uint64_t timestamp, std::shared_ptr<char> payload, uint32_t payload_size);
     void SendRtmpChunks(uint32_t csid, RtmpMessage& rtmp_msg);
+    void SendRtmpChunks(uint32_t csid, uint8_t type_id, RtmpChunkCache& chunk_cache);
+
+    /* SendMediaData on the connection's thread */
+    void WriteMediaData(uint8_t type, std::shared_ptr<char> payload, uint32_t payload_size, RtmpChunkCache& chunk_cache);
 
 	std::weak_ptr<RtmpServer> rtmp_server_;
 	std::weak_ptr<RtmpPublisher> rtmp_publisher_;
@@ -139,6 +144,9 @@ private:
 	uint32_t acknowledgement_size_ = 5000000;
 	uint32_t max_chunk_size_ = 128;
 	uint32_t max_gop_cache_len_ = 0;
+	uint32_t max_gop_cache_bytes_ = 0;
+	uint32_t max_gop_cache_duration_ = 0;
+	GopCacheMode gop_cache_mode_ = GOP_CACHE_LATEST_KEY_FRAME;
 	uint32_t stream_id_ = 0;
 	uint32_t number_ = 0;
 	std::string app_;
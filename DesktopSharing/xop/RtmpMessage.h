@@ -35,9 +35,7 @@ struct RtmpMessage
 		index = 0;
 		timestamp = 0;
 		extend_timestamp = 0;
-		if (length > 0) {
-			payload.reset(new char[length], std::default_delete<char[]>());
-		}
+		payload.reset();
 	}
 
 	bool IsCompleted() const 
@@ -143,6 +143,7 @@ int RtmpPublisher::OpenUrl(std::string url, int msec, std::string& status)
 
 	task_scheduler_ = event_loop_->GetTaskScheduler().get();
 	rtmp_conn_.reset(new RtmpConnection(shared_from_this(), task_scheduler_, tcp_socket.GetSocket()));
+	rtmp_conn_->Start();
 	task_scheduler_->AddTriggerEvent([this]() {
 		rtmp_conn_->Handshake();
 	});
@@ -34,145 +34,301 @@ void RtmpSession::SendMetaData(AmfObjects& metaData)
 
 void RtmpSession::SendMediaData(uint8_t type, uint64_t timestamp, std::shared_ptr<char> data, uint32_t size)
 {
-    std::lock_guard<std::mutex> lock(mutex_);    
+	std::shared_ptr<const SubscriberGroups> groups;
+	bool has_http_clients = false;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		if (!new_rtmp_clients_.empty() || !new_http_clients_.empty()) {
+			this->StartNewClients(type, data.get(), size);
+		}
+
+		/* cached after the new clients started, they get this frame live */
+		if (this->max_gop_cache_len_ > 0) {
+			this->SaveGop(type, timestamp, data, size);
+		}
 
-	if (this->max_gop_cache_len_ > 0) {
-		this->SaveGop(type, timestamp, data, size);
+		groups = subscriber_groups_;
+		has_http_clients = has_http_clients_;
 	}
 
-    for (auto iter = rtmp_clients_.begin(); iter != rtmp_clients_.end(); )
-    {
-        auto conn = iter->second.lock(); 
-        if (conn == nullptr) {
-			rtmp_clients_.erase(iter++);
-        }
-        else {	
-            if(conn->IsPlayer()) {   
-				if (!conn->IsPlaying()) {
-					conn->SendMetaData(meta_data_);
-					conn->SendMediaData(RTMP_AVC_SEQUENCE_HEADER, 0, this->avc_sequence_header_, this->avc_sequence_header_size_);
-					conn->SendMediaData(RTMP_AAC_SEQUENCE_HEADER, 0, this->aac_sequence_header_, this->aac_sequence_header_size_);
-					
-					if (gop_cache_.size() > 0) {						
-						auto gop = gop_cache_.begin()->second;
-						for (auto iter : *gop) {
-							if (iter->type == RTMP_VIDEO) {								
-								conn->SendVideoData(iter->timestamp, iter->data, iter->size);
-							}
-							else if (iter->type == RTMP_AUDIO) {
-								conn->SendAudioData(iter->timestamp, iter->data, iter->size);
-							}
-						}
-					}
+	if (groups == nullptr || groups->empty()) {
+		return;
+	}
+
+	/* chunked once, on the first player thread that sends it */
+	auto chunk_cache = std::make_shared<RtmpChunkCache>(timestamp, data, size);
+
+	std::shared_ptr<char> flv_tag;
+	uint32_t flv_tag_size = 0;
+	if (has_http_clients && (type == RTMP_VIDEO || type == RTMP_AUDIO)) {
+		uint8_t tag_type = (type == RTMP_VIDEO) ? HttpFlvConnection::FLV_TAG_TYPE_VIDEO : HttpFlvConnection::FLV_TAG_TYPE_AUDIO;
+		flv_tag = HttpFlvConnection::CreateFlvTag(tag_type, timestamp, data.get(), size, flv_tag_size);
+	}
+
+	/* one task per thread, it writes the frame to all the clients of that thread */
+	for (size_t i = 0; i < groups->size(); i++) {
+		(*groups)[i].task_scheduler->AddTriggerEvent([groups, i, type, data, size, chunk_cache, flv_tag, flv_tag_size] {
+			const SubscriberGroup& group = (*groups)[i];
+
+			for (auto& iter : group.rtmp_clients) {
+				auto conn = iter.lock();
+				if (conn != nullptr && conn->IsPlayer()) {
+					conn->WriteMediaData(type, data, size, *chunk_cache);
 				}
-				conn->SendMediaData(type, timestamp, data, size);
-            }
-			iter++;
-        }
-    }
+			}
 
-	for (auto iter = http_clients_.begin(); iter != http_clients_.end(); )
-	{
+			for (auto& iter : group.http_clients) {
+				auto conn = iter.lock();
+				if (conn != nullptr) {
+					conn->WriteMediaData(type, data, size, flv_tag, flv_tag_size);
+				}
+			}
+		});
+	}
+}
+
+void RtmpSession::StartNewClients(uint8_t type, const char* payload, uint32_t size)
+{
+	/* where joining players start, a key frame being sent is a GOP of its own */
+	uint32_t num_gops = (gop_cache_mode_ == GOP_CACHE_PREVIOUS_GOP) ? 2 : 1;
+	if (IsKeyFrame(type, payload, size)) {
+		num_gops -= 1;
+	}
+	size_t gop_start = GetGopStart(num_gops);
+
+	for (auto& iter : new_rtmp_clients_) {
+		auto conn = iter.lock();
+		if (conn == nullptr || !conn->IsPlayer() || conn->IsPlaying()) {
+			continue;
+		}
+
+		conn->SendMetaData(meta_data_);
+		conn->SendMediaData(RTMP_AVC_SEQUENCE_HEADER, 0, this->avc_sequence_header_, this->avc_sequence_header_size_);
+		conn->SendMediaData(RTMP_AAC_SEQUENCE_HEADER, 0, this->aac_sequence_header_, this->aac_sequence_header_size_);
+
+		/* through the key frame gate, so the live frames of this GOP follow the replay */
+		for (size_t i = gop_start; i < gop_cache_.size(); i++) {
+			const AVFrame& frame = gop_cache_[i];
+			conn->SendMediaData(frame.type, frame.timestamp, frame.data, frame.size);
+		}
+
+		conn->is_playing_ = true;
+	}
+
+	for (auto& iter : new_http_clients_) {
+		auto conn = iter.lock();
+		if (conn == nullptr || conn->IsPlaying()) {
+			continue;
+		}
+
+		conn->SendMediaData(RTMP_AVC_SEQUENCE_HEADER, 0, avc_sequence_header_, avc_sequence_header_size_);
+		conn->SendMediaData(RTMP_AAC_SEQUENCE_HEADER, 0, aac_sequence_header_, aac_sequence_header_size_);
+
+		if (gop_start < gop_cache_.size()) {
+			for (size_t i = gop_start; i < gop_cache_.size(); i++) {
+				const AVFrame& frame = gop_cache_[i];
+				conn->SendMediaData(frame.type, frame.timestamp, frame.data, frame.size);
+			}
+
+			conn->ResetKeyFrame();
+		}
+
+		conn->is_playing_ = true;
+	}
+
+	new_rtmp_clients_.clear();
+	new_http_clients_.clear();
+	UpdateSubscriberGroups();
+}
+
+void RtmpSession::UpdateSubscriberGroups()
+{
+	/* rebuilt under mutex_ when clients start or leave, frames already posted keep the groups they were posted with */
+	auto groups = std::make_shared<SubscriberGroups>();
+	auto get_group = [&groups](TaskScheduler* task_scheduler) -> SubscriberGroup& {
+		for (auto& group : *groups) {
+			if (group.task_scheduler == task_scheduler) {
+				return group;
+			}
+		}
+		groups->emplace_back();
+		groups->back().task_scheduler = task_scheduler;
+		return groups->back();
+	};
+
+	for (auto iter = rtmp_clients_.begin(); iter != rtmp_clients_.end(); ) {
 		auto conn = iter->second.lock();
-		if (conn == nullptr) { // conn disconect 
+		if (conn == nullptr) {
+			rtmp_clients_.erase(iter++);
+			continue;
+		}
+
+		if (conn->IsPlayer() && conn->IsPlaying()) {
+			get_group(conn->GetTaskScheduler()).rtmp_clients.push_back(conn);
+		}
+		iter++;
+	}
+
+	has_http_clients_ = false;
+	for (auto iter = http_clients_.begin(); iter != http_clients_.end(); ) {
+		auto conn = iter->second.lock();
+		if (conn == nullptr) {
 			http_clients_.erase(iter++);
+			continue;
 		}
-		else {
-			if (!conn->IsPlaying()) {
-				conn->SendMediaData(RTMP_AVC_SEQUENCE_HEADER, 0, avc_sequence_header_, avc_sequence_header_size_);
-				conn->SendMediaData(RTMP_AAC_SEQUENCE_HEADER, 0, aac_sequence_header_, aac_sequence_header_size_);
-
-				if (gop_cache_.size() > 0) {
-					auto gop = gop_cache_.begin()->second;
-					for (auto iter : *gop) {
-						if (iter->type == RTMP_VIDEO) {
-							conn->SendMediaData(RTMP_VIDEO, iter->timestamp, iter->data, iter->size);
-						}
-						else if (iter->type == RTMP_AUDIO) {
-							conn->SendMediaData(RTMP_AUDIO, iter->timestamp, iter->data, iter->size);
-						}
-					}
-
-					conn->ResetKeyFrame();
-				}
-			}
 
-			conn->SendMediaData(type, timestamp, data, size);
-			iter++;
+		if (conn->IsPlaying()) {
+			get_group(conn->GetTaskScheduler()).http_clients.push_back(conn);
+			has_http_clients_ = true;
 		}
+		iter++;
 	}
 
-	return;
+	subscriber_groups_ = groups;
+}
+
+bool RtmpSession::IsKeyFrame(uint8_t type, const char* payload, uint32_t size)
+{
+	if (type != RTMP_VIDEO || size < 2) {
+		return false;
+	}
+
+	uint8_t frame_type = (payload[0] >> 4) & 0x0f;
+	uint8_t codec_id = payload[0] & 0x0f;
+	return (frame_type == 1 && codec_id == RTMP_CODEC_ID_H264 && payload[1] == 1);
 }
 
 void RtmpSession::SaveGop(uint8_t type, uint64_t timestamp, std::shared_ptr<char> data, uint32_t size)
 {
 	uint8_t *payload = (uint8_t *)data.get();
-	uint8_t frame_type = 0;
-	uint8_t codec_id = 0;
-	std::shared_ptr<AVFrame> av_frame = nullptr;
-	std::shared_ptr<std::list<AVFramePtr>> gop = nullptr;
-	if (gop_cache_.size() > 0) {
-		gop = gop_cache_[gop_index_];
+	if (size < 2) {
+		return;
 	}
 
+	AVFrame av_frame;
+	av_frame.key_frame = IsKeyFrame(type, data.get(), size);
+
 	if (type == RTMP_VIDEO) {
-		frame_type = (payload[0] >> 4) & 0x0f;
-		codec_id = payload[0] & 0x0f;
-		if (frame_type == 1 && codec_id == RTMP_CODEC_ID_H264) {
-			if (payload[1] == 1) {
-				if (max_gop_cache_len_ > 0) {
-					if (gop_cache_.size() == 2) {
-						gop_cache_.erase(gop_cache_.begin());
-					}
-					gop_index_ += 1;
-					gop.reset(new std::list<AVFramePtr>);
-					gop_cache_[gop_index_] = gop;
-					av_frame.reset(new AVFrame);
-				}
-			}
-		}
-		else if (codec_id == RTMP_CODEC_ID_H264 && gop != nullptr) {
-			if (max_gop_cache_len_ > 0 && gop->size() >= 1 && gop->size() < max_gop_cache_len_) {
-				av_frame.reset(new AVFrame);
-			}
+		uint8_t codec_id = payload[0] & 0x0f;
+		if (codec_id != RTMP_CODEC_ID_H264 || (!av_frame.key_frame && gop_cache_.empty())) {
+			return;
 		}
 	}
-	else if (type == RTMP_AUDIO && gop != nullptr) {
+	else if (type == RTMP_AUDIO) {
 		uint8_t sound_format = (payload[0] >> 4) & 0x0f;
 		//uint8_t sound_size = (payload[0] >> 1) & 0x01;
 		//uint8_t sound_rate = (payload[0] >> 2) & 0x03;
+		if (sound_format != RTMP_CODEC_ID_AAC || gop_cache_.empty()) {
+			return;
+		}
+	}
+	else {
+		return;
+	}
 
-		if (sound_format == RTMP_CODEC_ID_AAC) {
-			if (max_gop_cache_len_ > 0 && gop->size() >= 2 && gop->size() < max_gop_cache_len_) {
-				if (timestamp > 0) {
-					av_frame.reset(new AVFrame);
-				}
-			}
+	/* keeps a reference to the published payload without copying. Safe only because
+	   RtmpChunk::AllocPayload reuses a pooled buffer once use_count() == 1, so a buffer
+	   held here is not overwritten while cached. Keep that check if the pool changes. */
+	av_frame.type = type;
+	av_frame.timestamp = timestamp;
+	av_frame.size = size;
+	av_frame.data = data;
+	gop_cache_.push_back(std::move(av_frame));
+
+	gop_cache_stats_.num_frames += 1;
+	gop_cache_stats_.num_gops += gop_cache_.back().key_frame ? 1 : 0;
+	gop_cache_stats_.bytes += size;
+	if (gop_cache_stats_.bytes > gop_cache_stats_.peak_bytes) {
+		gop_cache_stats_.peak_bytes = gop_cache_stats_.bytes;
+	}
+
+	/* the latest GOP goes too when it alone is over the bounds, 
+	   players then wait for the next key frame */
+	while (!gop_cache_.empty() && IsGopCacheFull()) {
+		DropGop();
+	}
+}
+
+size_t RtmpSession::GetGopStart(uint32_t num_gops) const
+{
+	size_t start = gop_cache_.size();
+
+	for (size_t i = gop_cache_.size(); i > 0 && num_gops > 0; i--) {
+		if (gop_cache_[i - 1].key_frame) {
+			start = i - 1;
+			num_gops -= 1;
 		}
 	}
 
-	if (av_frame != nullptr && gop != nullptr) {
-		av_frame->type = type;
-		av_frame->timestamp = timestamp;		
-		av_frame->size = size;
-		av_frame->data.reset(new char[size], std::default_delete<char[]>());
-		memcpy(av_frame->data.get(), data.get(), size);
-		gop->push_back(av_frame);
+	return start;
+}
+
+bool RtmpSession::IsGopCacheFull() const
+{
+	if (gop_cache_stats_.num_gops > kMaxGops || gop_cache_stats_.num_frames > max_gop_cache_len_) {
+		return true;
+	}
+
+	if (max_gop_cache_bytes_ > 0 && gop_cache_stats_.bytes > max_gop_cache_bytes_) {
+		return true;
+	}
+
+	if (max_gop_cache_duration_ > 0 && gop_cache_.back().timestamp > gop_cache_.front().timestamp
+		&& gop_cache_.back().timestamp - gop_cache_.front().timestamp > max_gop_cache_duration_) {
+		return true;
+	}
+
+	return false;
+}
+
+void RtmpSession::DropGop()
+{
+	do {
+		gop_cache_stats_.num_frames -= 1;
+		gop_cache_stats_.bytes -= gop_cache_.front().size;
+		gop_cache_.pop_front();
+	} while (!gop_cache_.empty() && !gop_cache_.front().key_frame);
+
+	gop_cache_stats_.num_gops -= 1;
+	gop_cache_stats_.dropped_gops += 1;
+}
+
+void RtmpSession::ClearGopCache()
+{
+	gop_cache_.clear();
+	gop_cache_stats_.num_frames = 0;
+	gop_cache_stats_.num_gops = 0;
+	gop_cache_stats_.bytes = 0;
+}
+
+GopCacheStats RtmpSession::GetGopCacheStats()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	GopCacheStats stats = gop_cache_stats_;
+	if (!gop_cache_.empty() && gop_cache_.back().timestamp > gop_cache_.front().timestamp) {
+		stats.duration = (uint32_t)(gop_cache_.back().timestamp - gop_cache_.front().timestamp);
 	}
+
+	return stats;
 }
 
 void RtmpSession::AddRtmpClient(std::shared_ptr<RtmpConnection> conn)
 {
     std::lock_guard<std::mutex> lock(mutex_);   
 	rtmp_clients_[conn->GetSocket()] = conn;
+	if (conn->IsPlayer()) {
+		new_rtmp_clients_.push_back(conn); /* started with the next frame */
+	}
+
     if(conn->IsPublisher()) {
 		avc_sequence_header_ = nullptr;
 		aac_sequence_header_ = nullptr;
 		avc_sequence_header_size_ = 0;
 		aac_sequence_header_size_ = 0;
-		gop_cache_.clear();
-		gop_index_ = 0;		
+		ClearGopCache();
         has_publisher_ = true;
 		publisher_ = conn;
     }
@@ -187,23 +343,25 @@ void RtmpSession::RemoveRtmpClient(std::shared_ptr<RtmpConnection> conn)
 		aac_sequence_header_ = nullptr;
 		avc_sequence_header_size_ = 0;
 		aac_sequence_header_size_ = 0;
-		gop_cache_.clear();
-		gop_index_ = 0;
+		ClearGopCache();
         has_publisher_ = false;
     }
 	rtmp_clients_.erase(conn->GetSocket());
+	UpdateSubscriberGroups();
 }
 
 void RtmpSession::AddHttpClient(std::shared_ptr<HttpFlvConnection> conn)
 {
 	std::lock_guard<std::mutex> lock(mutex_);
 	http_clients_[conn->GetSocket()] = conn;
+	new_http_clients_.push_back(conn);
 }
 
 void RtmpSession::RemoveHttpClient(std::shared_ptr<HttpFlvConnection> conn)
 {
 	std::lock_guard<std::mutex> lock(mutex_);
 	http_clients_.erase(conn->GetSocket());
+	UpdateSubscriberGroups();
 }
 
 void AddHttpClient(std::shared_ptr<RtmpConnection> conn)
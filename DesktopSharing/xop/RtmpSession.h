@@ -3,15 +3,29 @@
 
 #include "net/Socket.h"
 #include "amf.h"
+#include "rtmp.h"
 #include <memory>
 #include <mutex>
-#include <list>
+#include <deque>
+#include <vector>
 
 namespace xop
 {
     
 class RtmpConnection;
 class HttpFlvConnection;
+class TaskScheduler;
+
+/* Memory held by the GOP cache, the payloads are shared with the published messages */
+struct GopCacheStats
+{
+	uint32_t num_frames = 0;
+	uint32_t num_gops = 0;
+	uint64_t bytes = 0;
+	uint64_t peak_bytes = 0;
+	uint32_t duration = 0;     /* ms from the first to the last cached frame */
+	uint64_t dropped_gops = 0; /* evicted by the bounds */
+};
 
 class RtmpSession
 {
@@ -64,9 +78,32 @@ public:
 		max_gop_cache_len_ = cacheLen;
 	}
 
+	void SetGopCacheLimit(uint32_t max_bytes, uint32_t max_duration)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		max_gop_cache_bytes_ = max_bytes;
+		max_gop_cache_duration_ = max_duration;
+	}
+
+	void SetGopCacheMode(GopCacheMode mode)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		gop_cache_mode_ = mode;
+	}
+
+	GopCacheStats GetGopCacheStats();
+
 	void SaveGop(uint8_t type, uint64_t timestamp, std::shared_ptr<char> data, uint32_t size);
 
 private:        
+	void StartNewClients(uint8_t type, const char* payload, uint32_t size);
+	void UpdateSubscriberGroups();
+	static bool IsKeyFrame(uint8_t type, const char* payload, uint32_t size);
+	size_t GetGopStart(uint32_t num_gops) const;
+	bool IsGopCacheFull() const;
+	void DropGop();
+	void ClearGopCache();
+
 
     std::mutex mutex_;
     AmfObjects meta_data_;
@@ -75,21 +112,46 @@ private:
     std::unordered_map<SOCKET, std::weak_ptr<RtmpConnection>> rtmp_clients_;
 	std::unordered_map<SOCKET, std::weak_ptr<HttpFlvConnection>> http_clients_;
 
+	/* Playing clients by the thread they run on. A frame is posted once per group
+	   and written to all of the group's clients from there. */
+	struct SubscriberGroup
+	{
+		TaskScheduler* task_scheduler = nullptr;
+		std::vector<std::weak_ptr<RtmpConnection>> rtmp_clients;
+		std::vector<std::weak_ptr<HttpFlvConnection>> http_clients;
+	};
+	using SubscriberGroups = std::vector<SubscriberGroup>;
+
+	std::shared_ptr<const SubscriberGroups> subscriber_groups_;
+	bool has_http_clients_ = false;
+
+	/* added but not sent anything yet, started by the next frame */
+	std::vector<std::weak_ptr<RtmpConnection>> new_rtmp_clients_;
+	std::vector<std::weak_ptr<HttpFlvConnection>> new_http_clients_;
+
 	std::shared_ptr<char> avc_sequence_header_;
 	std::shared_ptr<char> aac_sequence_header_;
 	uint32_t avc_sequence_header_size_ = 0;
 	uint32_t aac_sequence_header_size_ = 0;
-	uint64_t gop_index_ = 0;
 	uint32_t max_gop_cache_len_ = 0;
+	uint32_t max_gop_cache_bytes_ = 8 * 1024 * 1024;
+	uint32_t max_gop_cache_duration_ = 10000;
+	GopCacheMode gop_cache_mode_ = GOP_CACHE_LATEST_KEY_FRAME;
 
 	struct AVFrame {
 		uint8_t  type = 0;
+		bool     key_frame = false;
 		uint64_t timestamp = 0;
 		uint32_t size = 0;
 		std::shared_ptr<char> data = nullptr;
 	};
-	typedef std::shared_ptr<AVFrame> AVFramePtr;
-	std::map<uint64_t, std::shared_ptr<std::list<AVFramePtr>>> gop_cache_;
+
+	/* Frames from the oldest cached key frame on, in publishing order. New frames are
+	   pushed at the back and whole GOPs are evicted from the front, joining players
+	   never need more than the previous and the current GOP. */
+	static const uint32_t kMaxGops = 2;
+	std::deque<AVFrame> gop_cache_;
+	GopCacheStats gop_cache_stats_;
 };
 
 }
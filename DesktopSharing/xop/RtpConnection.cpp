@@ -4,10 +4,45 @@
 #include "RtpConnection.h"
 #include "RtspConnection.h"
 #include "net/SocketUtil.h"
+#include "net/BufferReader.h"
+#include "net/BufferWriter.h"
+#include <chrono>
+#if defined(__linux) || defined(__linux__)
+#include <netinet/udp.h>
+#endif
 
 using namespace std;
 using namespace xop;
 
+static int64_t GetTimeNowMs()
+{
+	auto time_point = chrono::steady_clock::now();
+	return chrono::duration_cast<chrono::milliseconds>(time_point.time_since_epoch()).count();
+}
+
+/* 32.32 fixed point seconds since 1900 */
+static uint64_t GetNtpTime()
+{
+	auto time_point = chrono::system_clock::now();
+	uint64_t usec = chrono::duration_cast<chrono::microseconds>(time_point.time_since_epoch()).count();
+	uint64_t seconds = usec / 1000000 + 2208988800ULL;
+	uint64_t fraction = ((usec % 1000000) << 32) / 1000000;
+	return (seconds << 32) | fraction;
+}
+
+/* the UDP sockets are non-blocking, a full send buffer is not an error */
+static bool IsSendBufferFull()
+{
+#if defined(__linux) || defined(__linux__)
+	return (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS);
+#elif defined(WIN32) || defined(_WIN32)
+	int error = WSAGetLastError();
+	return (error == WSAEWOULDBLOCK || error == WSAENOBUFS);
+#else
+	return (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS);
+#endif
+}
+
 RtpConnection::RtpConnection(std::weak_ptr<TcpConnection> rtsp_connection)
     : rtsp_connection_(rtsp_connection)
 {
@@ -22,11 +57,18 @@ RtpConnection::RtpConnection(std::weak_ptr<TcpConnection> rtsp_connection)
 		media_channel_info_[chn].rtp_header.seq = 0; //htons(1);
 		media_channel_info_[chn].rtp_header.ts = htonl(rd());
 		media_channel_info_[chn].rtp_header.ssrc = htonl(rd());
+		frame_begin_[chn] = true;
+		frame_dropped_[chn] = false;
+		rtx_payload_[chn] = 0;
+		rtx_ssrc_[chn] = htonl(rd());
+		rtx_seq_[chn] = rd() & 0xffff;
+		fir_seq_[chn] = -1;
 	}
 
 	auto conn = rtsp_connection_.lock();
 	rtsp_ip_ = conn->GetIp();
 	rtsp_port_ = conn->GetPort();
+	task_scheduler_ = conn->GetTaskScheduler();
 }
 
 RtpConnection::~RtpConnection()
@@ -108,7 +150,9 @@ bool RtpConnection::SetupRtpOverUdp(MediaChannelId channel_id, uint16_t rtp_port
 		break;
 	}
 
-	SocketUtil::SetSendBufSize(rtpfd_[channel_id], 50*1024);
+	SocketUtil::SetNonBlock(rtpfd_[channel_id]);
+	SocketUtil::SetNonBlock(rtcpfd_[channel_id]);
+	SocketUtil::SetSendBufSize(rtpfd_[channel_id], kUdpSendBufSize);
 
 	peer_rtp_addr_[channel_id].sin_family = AF_INET;
 	peer_rtp_addr_[channel_id].sin_addr.s_addr = peer_addr_.sin_addr.s_addr;
@@ -142,6 +186,9 @@ bool RtpConnection::SetupRtpOverMulticast(MediaChannelId channel_id, std::string
 		break;
     }
 
+	SocketUtil::SetNonBlock(rtpfd_[channel_id]);
+	SocketUtil::SetSendBufSize(rtpfd_[channel_id], kUdpSendBufSize);
+
 	media_channel_info_[channel_id].rtp_port = port;
 
 	peer_rtp_addr_[channel_id].sin_family = AF_INET;
@@ -161,6 +208,8 @@ void RtpConnection::Play()
 			media_channel_info_[chn].is_play = true;
 		}
 	}
+
+	StartRtcpTimer();
 }
 
 void RtpConnection::Record()
@@ -171,6 +220,8 @@ void RtpConnection::Record()
 			media_channel_info_[chn].is_play = true;
 		}
 	}
+
+	StartRtcpTimer();
 }
 
 void RtpConnection::Teardown()
@@ -223,72 +274,821 @@ void RtpConnection::SetFrameType(uint8_t frame_type)
 	}
 }
 
-void RtpConnection::SetRtpHeader(MediaChannelId channel_id, RtpPacket pkt)
+void RtpConnection::SetRtpHeader(MediaChannelId channel_id, const RtpPacket& pkt)
 {
 	if((media_channel_info_[channel_id].is_play || media_channel_info_[channel_id].is_record) && has_key_frame_) {
 		media_channel_info_[channel_id].rtp_header.marker = pkt.last;
 		media_channel_info_[channel_id].rtp_header.ts = htonl(pkt.timestamp);
 		media_channel_info_[channel_id].rtp_header.seq = htons(media_channel_info_[channel_id].packet_seq++);
-		memcpy(pkt.data.get()+4, &media_channel_info_[channel_id].rtp_header, RTP_HEADER_SIZE);
 	}
 }
 
-int RtpConnection::SendRtpPacket(MediaChannelId channel_id, RtpPacket pkt)
+int RtpConnection::SendRtpPacket(MediaChannelId channel_id, const RtpPacket& pkt)
 {    
 	if (is_closed_) {
 		return -1;
 	}
-   
+
+	if (replay_pending_) {
+		return 0; /* already part of the cached GOP about to be replayed */
+	}
+
+	if (!replay_packets_.empty()) {
+		if (replay_bytes_ + pkt.size > kHardQueueBytes) {
+			/* the client cannot catch up, fall back to waiting for the next key frame */
+			replay_packets_.clear();
+			replay_bytes_ = 0;
+			has_key_frame_ = false;
+		}
+		else {
+			replay_packets_.emplace_back(channel_id, pkt);
+			replay_bytes_ += pkt.size;
+			return 0;
+		}
+	}
+
+	this->SendPacket(channel_id, pkt);
+	return 0;
+}
+
+void RtpConnection::SendPacket(MediaChannelId channel_id, const RtpPacket& pkt)
+{
+	this->SetFrameType(pkt.type);
+	/* dropped packets must not take a sequence number, receivers would count them as lost */
+	if (transport_mode_ == RTP_OVER_TCP) {
+		if (!this->CheckCongestion(channel_id, pkt)) {
+			return;
+		}
+	}
+	else if (!this->CheckUdpCongestion(channel_id, pkt)) {
+		return;
+	}
+
+	this->SetRtpHeader(channel_id, pkt);
+	if((media_channel_info_[channel_id].is_play || media_channel_info_[channel_id].is_record) && has_key_frame_ ) {            
+		int ret = 0;
+		if(transport_mode_ == RTP_OVER_TCP) {
+			ret = SendRtpOverTcp(channel_id, pkt);
+		}
+		else {
+			ret = SendRtpOverUdp(channel_id, pkt);
+		}
+                   
+		if (ret > 0) {
+			MediaChannelInfo& info = media_channel_info_[channel_id];
+			info.packet_count += 1;
+			info.octet_count += pkt.size - 4 - RTP_HEADER_SIZE;
+			info.last_rtp_timestamp = pkt.timestamp;
+			info.last_rtp_send_time = GetTimeNowMs();
+		}
+	}
+}
+
+bool RtpConnection::ReplayGopCache(std::shared_ptr<PacketList> packets)
+{
+	if (is_closed_ || is_multicast_ || packets == nullptr || packets->empty()) {
+		return false;
+	}
+
 	auto conn = rtsp_connection_.lock();
 	if (!conn) {
-		return -1;
+		return false;
+	}
+
+	TaskScheduler* task_scheduler = task_scheduler_;
+	std::weak_ptr<TcpConnection> weak_conn = rtsp_connection_;
+
+	/* live packets queued before this event are in the cache, the ones after it follow the replay */
+	replay_pending_ = true;
+	bool ret = task_scheduler->AddTriggerEvent([this, packets, task_scheduler, weak_conn] {
+		replay_pending_ = false;
+		replay_bytes_ = 0;
+		replay_packets_.clear();
+		for (auto& iter : *packets) {
+			replay_packets_.push_back(iter);
+			replay_bytes_ += iter.second.size;
+		}
+
+		/* the cache starts on a key frame */
+		has_key_frame_ = false;
+		wait_key_frame_ = false;
+		for (int chn = 0; chn < MAX_MEDIA_CHANNEL; chn++) {
+			frame_begin_[chn] = true;
+			frame_dropped_[chn] = false;
+		}
+
+		if (this->SendReplayPackets()) {
+			task_scheduler->AddTimer([this, weak_conn] {
+				if (!weak_conn.lock()) {
+					return false;
+				}
+				return this->SendReplayPackets();
+			}, kReplayInterval);
+		}
+	});
+
+	if (!ret) {
+		replay_pending_ = false;
+	}
+
+	return ret;
+}
+
+bool RtpConnection::SendReplayPackets()
+{
+	auto conn = rtsp_connection_.lock();
+	if (!conn || is_closed_) {
+		replay_packets_.clear();
+		replay_bytes_ = 0;
+		return false;
 	}
-	RtspConnection *rtsp_conn = (RtspConnection *)conn.get();
-	bool ret = rtsp_conn->task_scheduler_->AddTriggerEvent([this, channel_id, pkt] {
-		this->SetFrameType(pkt.type);
-		this->SetRtpHeader(channel_id, pkt);
-		if((media_channel_info_[channel_id].is_play || media_channel_info_[channel_id].is_record) && has_key_frame_ ) {            
-			if(transport_mode_ == RTP_OVER_TCP) {
-				SendRtpOverTcp(channel_id, pkt);
+
+	/* over TCP the burst follows the send queue, over UDP a fixed budget per interval */
+	uint32_t budget = kReplayQueueBytes;
+	while (!replay_packets_.empty()) {
+		const RtpPacket& pkt = replay_packets_.front().second;
+		if (transport_mode_ == RTP_OVER_TCP) {
+			if (conn->GetQueuedBytes() >= kReplayQueueBytes) {
+				break;
+			}
+		}
+		else {
+			if (budget < pkt.size) {
+				break;
+			}
+			budget -= pkt.size;
+		}
+
+		replay_bytes_ -= pkt.size;
+		SendPacket(replay_packets_.front().first, pkt);
+		replay_packets_.pop_front();
+	}
+
+	return !replay_packets_.empty();
+}
+
+bool RtpConnection::CheckCongestion(MediaChannelId channel_id, const RtpPacket& pkt)
+{
+	/* decisions are taken once per frame, a frame is either sent or dropped whole */
+	bool frame_begin = frame_begin_[channel_id];
+	frame_begin_[channel_id] = (pkt.last != 0);
+
+	if (!frame_begin) {
+		if (frame_dropped_[channel_id]) {
+			drop_stats_.dropped_packets += 1;
+			drop_stats_.dropped_bytes += pkt.size - 4;
+			return false;
+		}
+		return true;
+	}
+
+	frame_dropped_[channel_id] = false;
+
+	if (pkt.type == AUDIO_FRAME || !has_key_frame_ ||
+		!(media_channel_info_[channel_id].is_play || media_channel_info_[channel_id].is_record)) {
+		return true;
+	}
+
+	auto conn = rtsp_connection_.lock();
+	if (!conn) {
+		return false;
+	}
+
+	uint32_t queued_bytes = conn->GetQueuedBytes();
+	int64_t queued_time = conn->GetQueuedTime();
+
+	if (wait_key_frame_) {
+		if (pkt.type == VIDEO_FRAME_I && queued_bytes < kSoftQueueBytes) {
+			wait_key_frame_ = false;
+			return true;
+		}
+
+		/* the queue has drained, ask the encoder for a key frame instead of waiting for the next GOP */
+		if (queued_bytes < kLowQueueBytes && key_frame_request_ts_.Elapsed() >= kKeyFrameRequestInterval) {
+			key_frame_request_ts_.Reset();
+			if (key_frame_request_callback_) {
+				drop_stats_.key_frame_requests += 1;
+				key_frame_request_callback_(channel_id);
+			}
+		}
+
+		DropFrame(channel_id, pkt);
+		return false;
+	}
+
+	if (queued_bytes >= kHardQueueBytes || queued_time >= kHardQueueTime) {
+		wait_key_frame_ = true;
+		DropFrame(channel_id, pkt);
+		return false;
+	}
+
+	if ((queued_bytes >= kSoftQueueBytes || queued_time >= kSoftQueueTime) && pkt.type == VIDEO_FRAME_B) {
+		DropFrame(channel_id, pkt);
+		return false;
+	}
+
+	return true;
+}
+
+void RtpConnection::DropFrame(MediaChannelId channel_id, const RtpPacket& pkt)
+{
+	frame_dropped_[channel_id] = !pkt.last;
+	drop_stats_.dropped_frames += 1;
+	drop_stats_.dropped_packets += 1;
+	drop_stats_.dropped_bytes += pkt.size - 4;
+}
+
+bool RtpConnection::CheckUdpCongestion(MediaChannelId channel_id, const RtpPacket& pkt)
+{
+	/* after a full send buffer the rest of that frame is dropped, and video
+	   up to the next key frame */
+	bool frame_begin = frame_begin_[channel_id];
+	frame_begin_[channel_id] = (pkt.last != 0);
+	if (frame_begin) {
+		frame_dropped_[channel_id] = false;
+		if (wait_key_frame_ && pkt.type != AUDIO_FRAME) {
+			if (pkt.type == VIDEO_FRAME_I) {
+				wait_key_frame_ = false;
 			}
 			else {
-				SendRtpOverUdp(channel_id, pkt);
+				DropFrame(channel_id, pkt);
+				return false;
 			}
-                   
-			//media_channel_info_[channel_id].octetCount  += pkt.size;
-			//media_channel_info_[channel_id].packetCount += 1;
 		}
-	});
+	}
+	else if (frame_dropped_[channel_id]) {
+		drop_stats_.dropped_packets += 1;
+		drop_stats_.dropped_bytes += pkt.size - 4;
+		return false;
+	}
 
-	return ret ? 0 : -1;
+	return true;
 }
 
-int RtpConnection::SendRtpOverTcp(MediaChannelId channel_id, RtpPacket pkt)
+int RtpConnection::SendRtpOverTcp(MediaChannelId channel_id, const RtpPacket& pkt)
 {
 	auto conn = rtsp_connection_.lock();
 	if (!conn) {
 		return -1;
 	}
 
-	uint8_t* rtpPktPtr = pkt.data.get();
-	rtpPktPtr[0] = '$';
-	rtpPktPtr[1] = (char)media_channel_info_[channel_id].rtp_channel;
-	rtpPktPtr[2] = (char)(((pkt.size-4)&0xFF00)>>8);
-	rtpPktPtr[3] = (char)((pkt.size -4)&0xFF);
+	/* per-client interleave + RTP header, the payload is sent from the shared packet */
+	char prefix[4 + RTP_HEADER_SIZE];
+	prefix[0] = '$';
+	prefix[1] = (char)media_channel_info_[channel_id].rtp_channel;
+	prefix[2] = (char)(((pkt.size-4)&0xFF00)>>8);
+	prefix[3] = (char)((pkt.size -4)&0xFF);
+	memcpy(prefix+4, &media_channel_info_[channel_id].rtp_header, RTP_HEADER_SIZE);
+
+	std::shared_ptr<char> payload(pkt.data, (char*)pkt.data.get() + 4 + RTP_HEADER_SIZE);
+	if (!conn->Send(prefix, 4 + RTP_HEADER_SIZE, payload, pkt.size - 4 - RTP_HEADER_SIZE)) {
+		/* the queue overflowed inside a frame, resync on the next key frame */
+		if (pkt.type != AUDIO_FRAME) {
+			wait_key_frame_ = true;
+			frame_dropped_[channel_id] = !pkt.last;
+		}
+		drop_stats_.dropped_packets += 1;
+		drop_stats_.dropped_bytes += pkt.size - 4;
+		return -1;
+	}
 
-	conn->Send((char*)rtpPktPtr, pkt.size);
 	return pkt.size;
 }
 
-int RtpConnection::SendRtpOverUdp(MediaChannelId channel_id, RtpPacket pkt)
+int RtpConnection::SendRtpOverUdp(MediaChannelId channel_id, const RtpPacket& pkt)
 {
-	int ret = sendto(rtpfd_[channel_id], (const char*)pkt.data.get()+4, pkt.size-4, 0,
-					(struct sockaddr *)&(peer_rtp_addr_[channel_id]), sizeof(struct sockaddr_in));
-                   
-	if(ret < 0) {        
-		Teardown();
+	std::vector<UdpPacket>& packets = udp_packets_[channel_id];
+
+	UdpPacket udp_pkt;
+	udp_pkt.rtp_header = media_channel_info_[channel_id].rtp_header;
+	udp_pkt.data = pkt.data;
+	udp_pkt.size = pkt.size - 4 - RTP_HEADER_SIZE;
+
+	if (!is_multicast_) {
+		std::vector<HistoryPacket>& history = history_[channel_id];
+		if (history.empty()) {
+			history.resize(kHistorySize);
+		}
+
+		HistoryPacket& item = history[ntohs(udp_pkt.rtp_header.seq) & (kHistorySize - 1)];
+		item.packet = udp_pkt;
+		item.send_time = GetTimeNowMs();
+		item.retransmit_time = 0;
+	}
+
+	packets.push_back(std::move(udp_pkt));
+
+	if (pkt.last || packets.size() >= kMaxUdpBatch) {
+		int unsent = FlushRtpOverUdp(channel_id);
+		if (unsent < 0) {
+			Teardown();
+			return -1;
+		}
+
+		if (unsent > 0) {
+			frame_dropped_[channel_id] = !pkt.last;
+			drop_stats_.dropped_frames += 1;
+			if (pkt.type != AUDIO_FRAME) {
+				wait_key_frame_ = true;
+				if (key_frame_request_callback_ && key_frame_request_ts_.Elapsed() >= kKeyFrameRequestInterval) {
+					key_frame_request_ts_.Reset();
+					drop_stats_.key_frame_requests += 1;
+					key_frame_request_callback_(channel_id);
+				}
+			}
+			return -1;
+		}
+	}
+
+	return pkt.size;
+}
+
+int RtpConnection::FlushRtpOverUdp(MediaChannelId channel_id)
+{
+	std::vector<UdpPacket>& packets = udp_packets_[channel_id];
+	size_t index = 0;
+	bool blocked = false;
+
+	while (index < packets.size()) {
+		/* equal sized packets go out as one GSO super-datagram, the rest through sendmmsg */
+		size_t count = 1;
+		if (use_udp_gso_) {
+			size_t bytes = RTP_HEADER_SIZE + packets[index].size;
+			while (index + count < packets.size() && count < kMaxUdpSegments) {
+				uint32_t size = packets[index + count].size;
+				if (size > packets[index].size || bytes + RTP_HEADER_SIZE + size > kMaxUdpDatagram) {
+					break;
+				}
+				bytes += RTP_HEADER_SIZE + size;
+				count++;
+				if (size < packets[index].size) {
+					break; /* only the last segment may be shorter */
+				}
+			}
+		}
+
+		if (count > 1) {
+			int ret = SendUdpSegments(channel_id, index, count);
+			if (ret == 0) {
+				use_udp_gso_ = false;
+				continue;
+			}
+			if (ret < 0) {
+				blocked = IsSendBufferFull();
+				break;
+			}
+		}
+		else {
+			count = use_udp_gso_ ? 1 : (packets.size() - index);
+			int ret = SendUdpBatch(channel_id, index, count);
+			if (ret < 0) {
+				blocked = IsSendBufferFull();
+				break;
+			}
+			if ((size_t)ret < count) {
+				index += ret;
+				blocked = true;
+				break; /* the socket buffer filled up mid-batch */
+			}
+		}
+
+		index += count;
+	}
+
+	/* the packets that did not fit are dropped, not queued */
+	int unsent = (int)(packets.size() - index);
+	for (size_t n = index; n < packets.size(); n++) {
+		drop_stats_.dropped_packets += 1;
+		drop_stats_.dropped_bytes += RTP_HEADER_SIZE + packets[n].size;
+	}
+	packets.clear();
+
+	if (unsent > 0 && !blocked) {
 		return -1;
 	}
+	return unsent;
+}
+
+int RtpConnection::SendUdpSegments(MediaChannelId channel_id, size_t index, size_t count)
+{
+#if (defined(__linux) || defined(__linux__)) && defined(UDP_SEGMENT)
+	std::vector<UdpPacket>& packets = udp_packets_[channel_id];
+	struct iovec iov[kMaxUdpSegments * 2];
+	for (size_t n = 0; n < count; n++) {
+		UdpPacket& udp_pkt = packets[index + n];
+		iov[n * 2].iov_base = &udp_pkt.rtp_header;
+		iov[n * 2].iov_len = RTP_HEADER_SIZE;
+		iov[n * 2 + 1].iov_base = udp_pkt.data.get() + 4 + RTP_HEADER_SIZE;
+		iov[n * 2 + 1].iov_len = udp_pkt.size;
+	}
+
+	char control[CMSG_SPACE(sizeof(uint16_t))];
+	memset(control, 0, sizeof(control));
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &peer_rtp_addr_[channel_id];
+	msg.msg_namelen = sizeof(struct sockaddr_in);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = count * 2;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_UDP;
+	cmsg->cmsg_type = UDP_SEGMENT;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+	uint16_t segment_size = (uint16_t)(RTP_HEADER_SIZE + packets[index].size);
+	memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(uint16_t));
+
+	int ret = (int)sendmsg(rtpfd_[channel_id], &msg, 0);
+	if (ret < 0 && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP)) {
+		return 0; /* no UDP GSO on this kernel or device */
+	}
+	return ret;
+#else
+	return 0;
+#endif
+}
+
+int RtpConnection::SendUdpBatch(MediaChannelId channel_id, size_t index, size_t count)
+{
+	std::vector<UdpPacket>& packets = udp_packets_[channel_id];
+	int ret = 0;
+
+#if defined(__linux) || defined(__linux__)
+	struct mmsghdr msgs[kMaxUdpBatch];
+	struct iovec iov[kMaxUdpBatch * 2];
+	memset(msgs, 0, sizeof(struct mmsghdr) * count);
+
+	for (size_t n = 0; n < count; n++) {
+		UdpPacket& udp_pkt = packets[index + n];
+		iov[n * 2].iov_base = &udp_pkt.rtp_header;
+		iov[n * 2].iov_len = RTP_HEADER_SIZE;
+		iov[n * 2 + 1].iov_base = udp_pkt.data.get() + 4 + RTP_HEADER_SIZE;
+		iov[n * 2 + 1].iov_len = udp_pkt.size;
+		msgs[n].msg_hdr.msg_name = &peer_rtp_addr_[channel_id];
+		msgs[n].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		msgs[n].msg_hdr.msg_iov = &iov[n * 2];
+		msgs[n].msg_hdr.msg_iovlen = 2;
+	}
+
+	size_t sent = 0;
+	while (sent < count) {
+		ret = sendmmsg(rtpfd_[channel_id], msgs + sent, (unsigned int)(count - sent), 0);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		sent += ret;
+	}
+
+	if (sent > 0) {
+		ret = (int)sent;
+	}
+#elif defined(WIN32) || defined(_WIN32)
+	for (size_t n = 0; n < count; n++) {
+		UdpPacket& udp_pkt = packets[index + n];
+		WSABUF wsa_buf[2];
+		wsa_buf[0].buf = (char*)&udp_pkt.rtp_header;
+		wsa_buf[0].len = RTP_HEADER_SIZE;
+		wsa_buf[1].buf = (char*)udp_pkt.data.get() + 4 + RTP_HEADER_SIZE;
+		wsa_buf[1].len = udp_pkt.size;
+
+		DWORD bytes_sent = 0;
+		if (WSASendTo(rtpfd_[channel_id], wsa_buf, 2, &bytes_sent, 0, (struct sockaddr *)&(peer_rtp_addr_[channel_id]),
+					sizeof(struct sockaddr_in), NULL, NULL) == SOCKET_ERROR) {
+			ret = (n > 0) ? (int)n : -1;
+			break;
+		}
+		ret = (int)(n + 1);
+	}
+#endif
 
 	return ret;
 }
+
+void RtpConnection::StartRtcpTimer()
+{
+	if (has_rtcp_timer_ || is_multicast_) {
+		return;
+	}
+
+	has_rtcp_timer_ = true;
+	std::weak_ptr<TcpConnection> weak_conn = rtsp_connection_;
+	task_scheduler_->AddTimer([this, weak_conn] {
+		if (!weak_conn.lock()) {
+			return false;
+		}
+		return this->SendRtcpReports();
+	}, kRtcpInterval);
+}
+
+bool RtpConnection::SendRtcpReports()
+{
+	if (is_closed_) {
+		return false;
+	}
+
+	uint64_t ntp_time = GetNtpTime();
+	int64_t now = GetTimeNowMs();
+
+	for (int chn = 0; chn < MAX_MEDIA_CHANNEL; chn++) {
+		MediaChannelInfo& info = media_channel_info_[chn];
+		if (!info.is_setup || !(info.is_play || info.is_record) || info.packet_count == 0) {
+			continue;
+		}
+
+		/* the RTP time of this instant, extrapolated from the last packet sent */
+		uint32_t rtp_timestamp = info.last_rtp_timestamp + 
+			(uint32_t)((now - info.last_rtp_send_time) * info.clock_rate / 1000);
+
+		/* SR without report blocks followed by an SDES with the CNAME */
+		char buf[64] = { 0 };
+		buf[0] = (char)0x80;
+		buf[1] = (char)200;
+		WriteUint16BE(buf + 2, 6);
+		memcpy(buf + 4, &info.rtp_header.ssrc, 4);
+		WriteUint32BE(buf + 8, (uint32_t)(ntp_time >> 32));
+		WriteUint32BE(buf + 12, (uint32_t)ntp_time);
+		WriteUint32BE(buf + 16, rtp_timestamp);
+		WriteUint32BE(buf + 20, (uint32_t)info.packet_count);
+		WriteUint32BE(buf + 24, (uint32_t)info.octet_count);
+
+		const char cname[] = "xop";
+		uint32_t size = 28;
+		buf[size + 0] = (char)0x81;
+		buf[size + 1] = (char)202;
+		memcpy(buf + size + 4, &info.rtp_header.ssrc, 4);
+		buf[size + 8] = 1;
+		buf[size + 9] = (char)(sizeof(cname) - 1);
+		memcpy(buf + size + 10, cname, sizeof(cname) - 1);
+		uint32_t sdes_size = (10 + (uint32_t)sizeof(cname) - 1 + 1 + 3) / 4 * 4; /* items end with a zero byte */
+		WriteUint16BE(buf + size + 2, (uint16_t)(sdes_size / 4 - 1));
+		size += sdes_size;
+
+		info.last_rtcp_ntp_time = ntp_time;
+		rtcp_stats_[chn].packet_count = info.packet_count;
+		rtcp_stats_[chn].octet_count = info.octet_count;
+		SendRtcp((MediaChannelId)chn, buf, size);
+	}
+
+	return true;
+}
+
+int RtpConnection::SendRtcp(MediaChannelId channel_id, const char* data, uint32_t size)
+{
+	if (transport_mode_ == RTP_OVER_TCP) {
+		auto conn = rtsp_connection_.lock();
+		if (!conn) {
+			return -1;
+		}
+
+		std::shared_ptr<char> buf(new char[4 + size], std::default_delete<char[]>());
+		buf.get()[0] = '$';
+		buf.get()[1] = (char)media_channel_info_[channel_id].rtcp_channel;
+		WriteUint16BE(buf.get() + 2, (uint16_t)size);
+		memcpy(buf.get() + 4, data, size);
+		conn->Send(buf, 4 + size);
+		return size;
+	}
+
+	return (int)::sendto(rtcpfd_[channel_id], data, size, 0, 
+		(struct sockaddr *)&peer_rtcp_sddr_[channel_id], sizeof(struct sockaddr_in));
+}
+
+void RtpConnection::HandleRtcp(const uint8_t* data, uint32_t size)
+{
+	uint64_t ntp_time = GetNtpTime();
+
+	/* compound packet: a sequence of RTCP packets, each with its length in 32-bit words - 1 */
+	while (size >= 4) {
+		uint8_t version = data[0] >> 6;
+		uint8_t count = data[0] & 0x1f;
+		uint8_t packet_type = data[1];
+		uint32_t length = (ReadUint16BE((char*)data + 2) + 1) * 4;
+		if (version != RTP_VERSION || length > size) {
+			break;
+		}
+
+		uint32_t offset = 0;
+		if (packet_type == 201) {
+			offset = 8;  /* RR: header, sender SSRC */
+		}
+		else if (packet_type == 200) {
+			offset = 28; /* SR: header, sender SSRC, sender info */
+		}
+
+		if (offset > 0) {
+			for (uint32_t n = 0; n < count && offset + 24 <= length; n++, offset += 24) {
+				HandleReportBlock(data + offset, ntp_time);
+			}
+		}
+		else if (packet_type == 205 && count == 1) {
+			HandleNack(data, length); /* RTPFB, FMT 1: generic NACK */
+		}
+		else if (packet_type == 206 && (count == 1 || count == 4)) {
+			HandleKeyFrameRequest(data, length, count); /* PSFB, FMT 1: PLI, FMT 4: FIR */
+		}
+
+		data += length;
+		size -= length;
+	}
+}
+
+void RtpConnection::HandleReportBlock(const uint8_t* block, uint64_t ntp_time)
+{
+	for (int chn = 0; chn < MAX_MEDIA_CHANNEL; chn++) {
+		MediaChannelInfo& info = media_channel_info_[chn];
+		if (!info.is_setup || memcmp(block, &info.rtp_header.ssrc, 4) != 0) {
+			continue;
+		}
+
+		RtcpStats& stats = rtcp_stats_[chn];
+		stats.num_reports += 1;
+		stats.fraction_lost = block[4];
+
+		int32_t packets_lost = (int32_t)ReadUint24BE((char*)block + 5);
+		if (packets_lost & 0x800000) {
+			packets_lost |= ~0xffffff; /* signed 24 bits */
+		}
+		stats.packets_lost = packets_lost;
+
+		uint32_t jitter = ReadUint32BE((char*)block + 12);
+		if (info.clock_rate > 0) {
+			stats.jitter = (uint32_t)((uint64_t)jitter * 1000 / info.clock_rate);
+		}
+
+		/* RTT = arrival - LSR - DLSR, in 1/65536 s */
+		uint32_t lsr = ReadUint32BE((char*)block + 16);
+		uint32_t dlsr = ReadUint32BE((char*)block + 20);
+		uint32_t arrival = (uint32_t)(ntp_time >> 16);
+		if (lsr != 0 && arrival - lsr >= dlsr) {
+			stats.rtt = (uint32_t)((uint64_t)(arrival - lsr - dlsr) * 1000 / 65536);
+		}
+		break;
+	}
+}
+
+void RtpConnection::HandleNack(const uint8_t* data, uint32_t size)
+{
+	if (transport_mode_ != RTP_OVER_UDP || size < 12) {
+		return;
+	}
+
+	int chn = 0;
+	for (; chn < MAX_MEDIA_CHANNEL; chn++) {
+		if (media_channel_info_[chn].is_setup && memcmp(data + 8, &media_channel_info_[chn].rtp_header.ssrc, 4) == 0) {
+			break;
+		}
+	}
+
+	if (chn == MAX_MEDIA_CHANNEL) {
+		return;
+	}
+
+	/* FCI: PID, the first lost packet, and BLP, a bitmask of the 16 that follow it */
+	int64_t now = GetTimeNowMs();
+	for (uint32_t offset = 12; offset + 4 <= size; offset += 4) {
+		uint16_t pid = ReadUint16BE((char*)data + offset);
+		uint16_t blp = ReadUint16BE((char*)data + offset + 2);
+
+		Retransmit((MediaChannelId)chn, pid, now);
+		for (int n = 0; n < 16; n++) {
+			if (blp & (1 << n)) {
+				Retransmit((MediaChannelId)chn, (uint16_t)(pid + n + 1), now);
+			}
+		}
+	}
+}
+
+void RtpConnection::Retransmit(MediaChannelId channel_id, uint16_t seq, int64_t now)
+{
+	rtcp_stats_[channel_id].nack_packets += 1;
+
+	std::vector<HistoryPacket>& history = history_[channel_id];
+	if (history.empty()) {
+		return;
+	}
+
+	HistoryPacket& item = history[seq & (kHistorySize - 1)];
+	if (item.packet.data == nullptr || ntohs(item.packet.rtp_header.seq) != seq || now - item.send_time > kNackWindow) {
+		return; /* overwritten or too old to be useful */
+	}
+
+	int64_t interval = rtcp_stats_[channel_id].rtt;
+	if (interval < kMinRetransmitInterval) {
+		interval = kMinRetransmitInterval;
+	}
+	if (item.retransmit_time != 0 && now - item.retransmit_time < interval) {
+		return; /* the previous retransmission may still be in flight */
+	}
+	item.retransmit_time = now;
+
+	const uint8_t* payload = item.packet.data.get() + 4 + RTP_HEADER_SIZE;
+	int ret = 0;
+	if (rtx_payload_[channel_id] != 0) {
+		/* RFC 4588: own SSRC and sequence numbers, the original sequence number leads the payload */
+		RtpHeader rtp_header = item.packet.rtp_header;
+		rtp_header.payload = rtx_payload_[channel_id];
+		rtp_header.ssrc = rtx_ssrc_[channel_id];
+		rtp_header.seq = htons(rtx_seq_[channel_id]++);
+		ret = SendUdpPacket(channel_id, rtp_header, (const char*)&item.packet.rtp_header.seq, 2, payload, item.packet.size);
+	}
+	else {
+		ret = SendUdpPacket(channel_id, item.packet.rtp_header, nullptr, 0, payload, item.packet.size);
+	}
+
+	if (ret > 0) {
+		rtcp_stats_[channel_id].retransmitted_packets += 1;
+	}
+}
+
+int RtpConnection::SendUdpPacket(MediaChannelId channel_id, const RtpHeader& rtp_header, const char* prefix, uint32_t prefix_size,
+                                 const uint8_t* payload, uint32_t size)
+{
+#if defined(__linux) || defined(__linux__)
+	struct iovec iov[3];
+	int num_iov = 0;
+	iov[num_iov].iov_base = (void*)&rtp_header;
+	iov[num_iov++].iov_len = RTP_HEADER_SIZE;
+	if (prefix_size > 0) {
+		iov[num_iov].iov_base = (void*)prefix;
+		iov[num_iov++].iov_len = prefix_size;
+	}
+	iov[num_iov].iov_base = (void*)payload;
+	iov[num_iov++].iov_len = size;
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &peer_rtp_addr_[channel_id];
+	msg.msg_namelen = sizeof(struct sockaddr_in);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = num_iov;
+	return (int)sendmsg(rtpfd_[channel_id], &msg, 0);
+#elif defined(WIN32) || defined(_WIN32)
+	WSABUF wsa_buf[3];
+	DWORD num_buf = 0;
+	wsa_buf[num_buf].buf = (char*)&rtp_header;
+	wsa_buf[num_buf++].len = RTP_HEADER_SIZE;
+	if (prefix_size > 0) {
+		wsa_buf[num_buf].buf = (char*)prefix;
+		wsa_buf[num_buf++].len = prefix_size;
+	}
+	wsa_buf[num_buf].buf = (char*)payload;
+	wsa_buf[num_buf++].len = size;
+
+	DWORD bytes_sent = 0;
+	if (WSASendTo(rtpfd_[channel_id], wsa_buf, num_buf, &bytes_sent, 0, (struct sockaddr *)&(peer_rtp_addr_[channel_id]),
+				sizeof(struct sockaddr_in), NULL, NULL) == SOCKET_ERROR) {
+		return -1;
+	}
+	return (int)bytes_sent;
+#else
+	return -1;
+#endif
+}
+
+void RtpConnection::HandleKeyFrameRequest(const uint8_t* data, uint32_t size, uint8_t fmt)
+{
+	if (size < 12) {
+		return;
+	}
+
+	for (int chn = 0; chn < MAX_MEDIA_CHANNEL; chn++) {
+		MediaChannelInfo& info = media_channel_info_[chn];
+		if (!info.is_setup) {
+			continue;
+		}
+
+		if (fmt == 1) {
+			if (memcmp(data + 8, &info.rtp_header.ssrc, 4) != 0) {
+				continue;
+			}
+		}
+		else {
+			/* FIR names the target in its FCI entries (SSRC, command sequence number),
+			   a repeated sequence number is a retransmission of the same request */
+			bool found = false;
+			for (uint32_t offset = 12; offset + 8 <= size; offset += 8) {
+				if (memcmp(data + offset, &info.rtp_header.ssrc, 4) == 0) {
+					found = (fir_seq_[chn] != data[offset + 4]);
+					fir_seq_[chn] = data[offset + 4];
+					break;
+				}
+			}
+			if (!found) {
+				continue;
+			}
+		}
+
+		/* the encoder coalesces requests from all viewers */
+		rtcp_stats_[chn].key_frame_requests += 1;
+		if (key_frame_request_callback_) {
+			key_frame_request_callback_((MediaChannelId)chn);
+		}
+		break;
+	}
+}
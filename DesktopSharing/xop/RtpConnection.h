@@ -6,6 +6,7 @@
 
 #include <cstdint>
 #include <vector>
+#include <deque>
 #include <string>
 #include <memory>
 #include <random>
@@ -13,15 +14,43 @@
 #include "media.h"
 #include "net/Socket.h"
 #include "net/TcpConnection.h"
+#include "net/Timestamp.h"
 
 namespace xop
 {
 
 class RtspConnection;
 
+/* Per-client counters of the RTP over TCP congestion policy */
+struct RtpDropStats
+{
+	uint64_t dropped_frames = 0;
+	uint64_t dropped_packets = 0;
+	uint64_t dropped_bytes = 0;
+	uint64_t key_frame_requests = 0;
+};
+
+/* Per-channel sender counters and the reception quality of the last RTCP receiver report */
+struct RtcpStats
+{
+	uint64_t packet_count = 0;
+	uint64_t octet_count = 0;
+	uint32_t num_reports = 0;
+	uint8_t  fraction_lost = 0; /* lost/256 since the previous report */
+	int32_t  packets_lost = 0;  /* cumulative */
+	uint32_t jitter = 0;        /* ms */
+	uint32_t rtt = 0;           /* ms, 0 until a report references one of our SRs */
+	uint32_t nack_packets = 0;  /* sequence numbers NACKed by the client */
+	uint32_t retransmitted_packets = 0;
+	uint32_t key_frame_requests = 0; /* PLI and FIR */
+};
+
 class RtpConnection
 {
 public:
+    using KeyFrameRequestCallback = std::function<void(MediaChannelId channel_id)>;
+    using PacketList = std::vector<std::pair<MediaChannelId, RtpPacket>>;
+
     RtpConnection(std::weak_ptr<TcpConnection> rtsp_connection);
     virtual ~RtpConnection();
 
@@ -31,6 +60,9 @@ public:
     void SetPayloadType(MediaChannelId channel_id, uint32_t payload)
     { media_channel_info_[channel_id].rtp_header.payload = payload; }
 
+    void SetRtxPayloadType(MediaChannelId channel_id, uint32_t payload)
+    { rtx_payload_[channel_id] = (uint8_t)payload; }
+
     bool SetupRtpOverTcp(MediaChannelId channel_id, uint16_t rtp_channel, uint16_t rtcp_channel);
     bool SetupRtpOverUdp(MediaChannelId channel_id, uint16_t rtp_port, uint16_t rtcp_port);
     bool SetupRtpOverMulticast(MediaChannelId channel_id, std::string ip, uint16_t port);
@@ -69,7 +101,15 @@ public:
     void Teardown();
 
     std::string GetRtpInfo(const std::string& rtsp_url);
-    int SendRtpPacket(MediaChannelId channel_id, RtpPacket pkt);
+    /* Call on the connection's task scheduler, MediaSession posts one task per scheduler. */
+    int SendRtpPacket(MediaChannelId channel_id, const RtpPacket& pkt);
+
+    TaskScheduler* GetTaskScheduler() const
+    { return task_scheduler_; }
+
+    /* Sends the cached GOP ahead of the live packets, paced by the send queue.
+       Must be called on the connection's thread, before later live packets are queued. */
+    bool ReplayGopCache(std::shared_ptr<PacketList> packets);
 
     bool IsClosed() const
     { return is_closed_; }
@@ -79,15 +119,59 @@ public:
     bool HasKeyFrame() const
     { return has_key_frame_; }
 
+    void SetKeyFrameRequestCallback(const KeyFrameRequestCallback& callback)
+    { key_frame_request_callback_ = callback; }
+
+    RtpDropStats GetDropStats() const
+    { return drop_stats_; }
+
+    RtcpStats GetRtcpStats(MediaChannelId channel_id) const
+    { return rtcp_stats_[channel_id]; }
+
+    /* A compound RTCP packet from the client, report blocks are matched to channels by SSRC. */
+    void HandleRtcp(const uint8_t* data, uint32_t size);
+
 private:
     friend class RtspConnection;
     friend class MediaSession;
     void SetFrameType(uint8_t frameType = 0);
-    void SetRtpHeader(MediaChannelId channel_id, RtpPacket pkt);
-    int  SendRtpOverTcp(MediaChannelId channel_id, RtpPacket pkt);
-    int  SendRtpOverUdp(MediaChannelId channel_id, RtpPacket pkt);
+    void SendPacket(MediaChannelId channel_id, const RtpPacket& pkt);
+    bool SendReplayPackets();
+    void StartRtcpTimer();
+    bool SendRtcpReports();
+    int  SendRtcp(MediaChannelId channel_id, const char* data, uint32_t size);
+    void HandleReportBlock(const uint8_t* block, uint64_t ntp_time);
+    void HandleNack(const uint8_t* data, uint32_t size);
+    void HandleKeyFrameRequest(const uint8_t* data, uint32_t size, uint8_t fmt);
+    void Retransmit(MediaChannelId channel_id, uint16_t seq, int64_t now);
+    int  SendUdpPacket(MediaChannelId channel_id, const RtpHeader& rtp_header, const char* prefix, uint32_t prefix_size,
+                       const uint8_t* payload, uint32_t size);
+    void SetRtpHeader(MediaChannelId channel_id, const RtpPacket& pkt);
+    bool CheckCongestion(MediaChannelId channel_id, const RtpPacket& pkt);
+    bool CheckUdpCongestion(MediaChannelId channel_id, const RtpPacket& pkt);
+    void DropFrame(MediaChannelId channel_id, const RtpPacket& pkt);
+    int  SendRtpOverTcp(MediaChannelId channel_id, const RtpPacket& pkt);
+    int  SendRtpOverUdp(MediaChannelId channel_id, const RtpPacket& pkt);
+    int  FlushRtpOverUdp(MediaChannelId channel_id);   /* packets dropped on a full socket, -1 on error */
+    int  SendUdpSegments(MediaChannelId channel_id, size_t index, size_t count);
+    int  SendUdpBatch(MediaChannelId channel_id, size_t index, size_t count); /* packets sent */
+
+    /* A frame's RTP packets are queued here and sent to the peer together
+       once its last packet arrives. */
+    struct UdpPacket
+    {
+        RtpHeader rtp_header;
+        std::shared_ptr<uint8_t> data; /* shared RtpPacket data */
+        uint32_t size;                 /* payload size, after the reserved header */
+    };
+
+    static const size_t kMaxUdpBatch = 256;
+    static const size_t kMaxUdpSegments = 64;
+    static const size_t kMaxUdpDatagram = 65507;
+    static const int    kUdpSendBufSize = 512 * 1024; /* one full batch of MTU sized packets */
 
 	std::weak_ptr<TcpConnection> rtsp_connection_;
+    TaskScheduler* task_scheduler_ = nullptr;
     std::string rtsp_ip_;
     uint16_t rtsp_port_;
 
@@ -107,6 +191,58 @@ private:
     struct sockaddr_in peer_rtp_addr_[MAX_MEDIA_CHANNEL];
     struct sockaddr_in peer_rtcp_sddr_[MAX_MEDIA_CHANNEL];
     MediaChannelInfo media_channel_info_[MAX_MEDIA_CHANNEL];
+
+    std::vector<UdpPacket> udp_packets_[MAX_MEDIA_CHANNEL];
+    bool use_udp_gso_ = true;
+
+    /* Send queue budget for RTP over TCP. Over the soft limit non-reference
+       frames are dropped, over the hard limit everything is dropped up to the
+       next key frame, which is requested once the queue has drained. */
+    static const uint32_t kSoftQueueBytes = 512 * 1024;
+    static const uint32_t kHardQueueBytes = 2048 * 1024;
+    static const uint32_t kLowQueueBytes  = 64 * 1024;
+    static const int64_t  kSoftQueueTime  = 300;
+    static const int64_t  kHardQueueTime  = 1000;
+    static const int64_t  kKeyFrameRequestInterval = 1000;
+
+    bool frame_begin_[MAX_MEDIA_CHANNEL];
+    bool frame_dropped_[MAX_MEDIA_CHANNEL];
+    bool wait_key_frame_ = false;
+    Timestamp key_frame_request_ts_;
+    RtpDropStats drop_stats_;
+    KeyFrameRequestCallback key_frame_request_callback_;
+
+    /* GOP replay: live packets wait behind the cached ones until the replay has caught up */
+    static const uint32_t kReplayQueueBytes = 256 * 1024;
+    static const uint32_t kReplayInterval = 10;
+
+    bool replay_pending_ = false;
+    uint32_t replay_bytes_ = 0;
+    std::deque<std::pair<MediaChannelId, RtpPacket>> replay_packets_;
+
+    static const uint32_t kRtcpInterval = 5000;
+
+    bool has_rtcp_timer_ = false;
+    RtcpStats rtcp_stats_[MAX_MEDIA_CHANNEL];
+
+    /* Packets sent over UDP by sequence number, answered from when the client
+       NACKs them within the window. The buffers are the shared RtpPacket data. */
+    struct HistoryPacket
+    {
+        UdpPacket packet;
+        int64_t send_time = 0;
+        int64_t retransmit_time = 0;
+    };
+
+    static const uint32_t kHistorySize = 1024;
+    static const int64_t  kNackWindow = 1000;
+    static const int64_t  kMinRetransmitInterval = 10;
+
+    std::vector<HistoryPacket> history_[MAX_MEDIA_CHANNEL];
+    uint8_t  rtx_payload_[MAX_MEDIA_CHANNEL];
+    uint32_t rtx_ssrc_[MAX_MEDIA_CHANNEL];
+    uint16_t rtx_seq_[MAX_MEDIA_CHANNEL];
+    int fir_seq_[MAX_MEDIA_CHANNEL];
 };
 
 }
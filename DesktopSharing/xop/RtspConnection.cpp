@@ -205,20 +205,31 @@ void RtspConnection::SendRtspMessage(std::shared_ptr<char> buf, uint32_t size)
 
 void RtspConnection::HandleRtcp(BufferReader& buffer)
 {    
-	char *peek = buffer.Peek();
-	if(peek[0] == '$' &&  buffer.ReadableBytes() > 4) {
-		uint32_t pkt_size = peek[2]<<8 | peek[3];
-		if(pkt_size +4 >=  buffer.ReadableBytes()) {
-			buffer.Retrieve(pkt_size +4);  
+	/* interleaved frames: '$', channel, 16-bit length, RTCP packet */
+	while (buffer.ReadableBytes() >= 4 && buffer.Front().data[0] == '$') {
+		char *peek = buffer.Pullup(4);
+		uint32_t pkt_size = ReadUint16BE(peek + 2);
+		if (buffer.ReadableBytes() < pkt_size + 4) {
+			break;
+		}
+
+		peek = buffer.Pullup(pkt_size + 4);
+		if (rtp_conn_ != nullptr) {
+			rtp_conn_->HandleRtcp((const uint8_t*)peek + 4, pkt_size);
 		}
+		buffer.Retrieve(pkt_size + 4);
 	}
 }
  
 void RtspConnection::HandleRtcp(SOCKET sockfd)
 {
-	char buf[1024] = {0};
-	if(recv(sockfd, buf, 1024, 0) > 0) {
+	char buf[1500] = {0};
+	int size = (int)recv(sockfd, buf, sizeof(buf), 0);
+	if(size > 0) {
 		KeepAlive();
+		if (rtp_conn_ != nullptr) {
+			rtp_conn_->HandleRtcp((const uint8_t*)buf, (uint32_t)size);
+		}
 	}
 }
 
@@ -260,6 +271,7 @@ void RtspConnection::HandleCmdDescribe()
 			if(source != nullptr) {
 				rtp_conn_->SetClockRate((MediaChannelId)chn, source->GetClockRate());
 				rtp_conn_->SetPayloadType((MediaChannelId)chn, source->GetPayloadType());
+				rtp_conn_->SetRtxPayloadType((MediaChannelId)chn, source->GetRtxPayloadType());
 			}
 		}
 
@@ -379,6 +391,14 @@ void RtspConnection::HandleCmdPlay()
 
 	int size = rtsp_request_->BuildPlayRes(res.get(), 2048, nullptr, session_id);
 	SendRtspMessage(res, size);
+
+	auto rtsp = rtsp_.lock();
+	if (rtsp) {
+		MediaSession::Ptr media_session = rtsp->LookMediaSession(session_id_);
+		if (media_session) {
+			media_session->SendGopCache(rtp_conn_);
+		}
+	}
 }
 
 void RtspConnection::HandleCmdTeardown()
@@ -474,6 +494,7 @@ void RtspConnection::SendAnnounce()
 			if (source != nullptr) {
 				rtp_conn_->SetClockRate((MediaChannelId)chn, source->GetClockRate());
 				rtp_conn_->SetPayloadType((MediaChannelId)chn, source->GetPayloadType());
+				rtp_conn_->SetRtxPayloadType((MediaChannelId)chn, source->GetRtxPayloadType());
 			}
 		}
 	}
@@ -15,7 +15,7 @@ using namespace xop;
 
 bool RtspRequest::ParseRequest(BufferReader *buffer)
 {
-	if(buffer->Peek()[0] == '$') {
+	if(buffer->ReadableBytes() > 0 && buffer->Front().data[0] == '$') {
 		method_ = RTCP;
 		return true;
 	}
@@ -554,20 +554,23 @@ int RtspRequest::BuildUnauthorizedRes(const char* buf, int buf_size, const char*
 
 bool RtspResponse::ParseResponse(xop::BufferReader *buffer)
 {
-	if (strstr(buffer->Peek(), "\r\n\r\n") != NULL) {
-		if (strstr(buffer->Peek(), "OK") == NULL) {
+	const char* last_crlf_crlf = buffer->FindLastCrlfCrlf();
+	if (last_crlf_crlf != nullptr) {
+		const char* begin = buffer->Peek();
+		string response(begin, last_crlf_crlf + 4);
+		if (response.find("OK") == string::npos) {
 			return false;
 		}
 
-		char* ptr = strstr(buffer->Peek(), "Session");
-		if (ptr != NULL) {
+		size_t pos = response.find("Session");
+		if (pos != string::npos) {
 			char session_id[50] = {0};
-			if (sscanf(ptr, "%*[^:]: %s", session_id) == 1)
+			if (sscanf(response.c_str() + pos, "%*[^:]: %49s", session_id) == 1)
 				session_ = session_id;
 		}
 
 		cseq_++;
-		buffer->RetrieveUntil("\r\n\r\n");
+		buffer->RetrieveUntil(last_crlf_crlf + 4);
 	}
 
 	return true;
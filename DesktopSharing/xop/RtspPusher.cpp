@@ -77,7 +77,8 @@ int RtspPusher::OpenUrl(std::string url, int msec)
 
 	task_scheduler_ = event_loop_->GetTaskScheduler().get();
 	rtsp_conn_.reset(new RtspConnection(shared_from_this(), task_scheduler_, tcpSocket.GetSocket()));
-    event_loop_->AddTriggerEvent([this]() {
+	rtsp_conn_->Start();
+    task_scheduler_->AddTriggerEvent([this]() {
 		rtsp_conn_->SendOptions(RtspConnection::RTSP_PUSHER);
     });
 
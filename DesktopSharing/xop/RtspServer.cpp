@@ -90,7 +90,8 @@ bool RtspServer::PushFrame(MediaSessionId session_id, MediaChannelId channel_id,
         }
     }
 
-    if (sessionPtr!=nullptr && sessionPtr->GetNumClient()!=0) {
+    /* with a GOP cache the frames are packetized even without clients, so the first one starts at once */
+    if (sessionPtr!=nullptr && (sessionPtr->GetNumClient()!=0 || sessionPtr->IsGopCacheEnabled())) {
         return sessionPtr->HandleFrame(channel_id, frame);
     }
 
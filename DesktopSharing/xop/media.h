@@ -5,6 +5,7 @@
 #define XOP_MEDIA_H
 
 #include <memory>
+#include "net/MemoryManager.h"
 
 namespace xop
 {
@@ -31,7 +32,16 @@ enum FrameType
 struct AVFrame
 {	
 	AVFrame(uint32_t size = 0)
-		:buffer(new uint8_t[size + 1], std::default_delete< uint8_t[]>())
+		:buffer(AllocShared(size + 1))
+	{
+		this->size = size;
+		type = 0;
+		timestamp = 0;
+	}
+
+	/* wraps data that is already shared, nothing is copied */
+	AVFrame(std::shared_ptr<uint8_t> data, uint32_t size)
+		:buffer(std::move(data))
 	{
 		this->size = size;
 		type = 0;
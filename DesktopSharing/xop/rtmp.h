@@ -42,6 +42,13 @@ static const int RTMP_AAC_SEQUENCE_HEADER = 0x19;
 namespace xop
 {
 
+/* Where a player joining a live stream starts from the GOP cache */
+enum GopCacheMode
+{
+	GOP_CACHE_LATEST_KEY_FRAME, /* the last key frame, lowest delay */
+	GOP_CACHE_PREVIOUS_GOP,     /* the GOP before it when still cached, a longer catch-up */
+};
+
 struct MediaInfo
 {
 	uint8_t  video_codec_id = RTMP_CODEC_ID_H264;
@@ -75,9 +82,20 @@ public:
 		}
 	}
 
+	/* len: max frames cached, 0 disables the GOP cache */
 	void SetGopCache(uint32_t len = 10000)
 	{ max_gop_cache_len_ = len; }
 
+	/* max_duration: ms, the oldest GOP is dropped once either bound is exceeded, 0 leaves a bound off */
+	void SetGopCacheLimit(uint32_t max_bytes, uint32_t max_duration)
+	{
+		max_gop_cache_bytes_ = max_bytes;
+		max_gop_cache_duration_ = max_duration;
+	}
+
+	void SetGopCacheMode(GopCacheMode mode)
+	{ gop_cache_mode_ = mode; }
+
 	void SetPeerBandwidth(uint32_t size)
 	{ peer_bandwidth_ = size; }
 
@@ -87,6 +105,15 @@ public:
 	uint32_t GetGopCacheLen() const
 	{ return max_gop_cache_len_; }
 
+	uint32_t GetGopCacheBytes() const
+	{ return max_gop_cache_bytes_; }
+
+	uint32_t GetGopCacheDuration() const
+	{ return max_gop_cache_duration_; }
+
+	GopCacheMode GetGopCacheMode() const
+	{ return gop_cache_mode_; }
+
 	uint32_t GetAcknowledgementSize() const
 	{ return acknowledgement_size_; }
 
@@ -175,6 +202,9 @@ public:
 	uint32_t acknowledgement_size_ = 5000000;
 	uint32_t max_chunk_size_ = 128;
 	uint32_t max_gop_cache_len_ = 0;
+	uint32_t max_gop_cache_bytes_ = 8 * 1024 * 1024;
+	uint32_t max_gop_cache_duration_ = 10000;
+	GopCacheMode gop_cache_mode_ = GOP_CACHE_LATEST_KEY_FRAME;
 };
 
 }
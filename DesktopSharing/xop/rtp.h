@@ -6,6 +6,7 @@
 
 #include <memory>
 #include <cstdint>
+#include "net/MemoryManager.h"
 
 #define RTP_HEADER_SIZE   	   12
 #define MAX_RTP_PAYLOAD_SIZE   1420 //1460  1500-20-12-8
@@ -55,16 +56,20 @@ struct MediaChannelInfo
 	uint64_t packet_count;
 	uint64_t octet_count;
 	uint64_t last_rtcp_ntp_time;
+	uint32_t last_rtp_timestamp;
+	int64_t  last_rtp_send_time; /* ms, steady clock */
 
 	bool is_setup;
 	bool is_play;
 	bool is_record;
 };
 
+/* data: [4 bytes reserved][12 bytes reserved][payload], written once by the MediaSource 
+   and shared read-only by every client. Interleave and RTP headers are built per client. */
 struct RtpPacket
 {
 	RtpPacket()
-		: data(new uint8_t[1600], std::default_delete<uint8_t[]>())
+		: data(AllocShared(1600))
 	{
 		type = 0;
 	}